@@ -4,187 +4,700 @@
 
 #include "def.h"
 
-pthread_mutex_t mutex_for_fs_stat;//mutex used by RSFS_stat()
 
 
 //initialize file system - should be called as the first thing before accessing this file system 
 int RSFS_init(){
+    struct rsfs *fs = rsfs_current;
     char *debugTitle = "RSFS_init";
 
-    //initialize data blocks
-    for(int i=0; i<NUM_DBLOCKS; i++){
-      void *block = malloc(BLOCK_SIZE); //a data block is allocated from memory
-      if(block==NULL){
-        printf("[%s] fails to init data_blocks\n", debugTitle);
-        return -1;
-      }
-      data_blocks[i] = block;  
-    } 
+    //the mutexes and conditions below are process-shared and robust when the instance is in shared memory (shm.c)
 
     //initialize bitmaps
-    for(int i=0; i<NUM_DBLOCKS; i++) data_bitmap[i]=0;
-    pthread_mutex_init(&data_bitmap_mutex,NULL);
-    for(int i=0; i<NUM_INODES; i++) inode_bitmap[i]=0;
-    pthread_mutex_init(&inode_bitmap_mutex,NULL);    
+    for(int i=0; i<NUM_DBLOCKS; i++){
+        fs->data_bitmap[i]=0;
+        fs->data_refcount[i]=0;
+    }
+    fs->data_blocks_used=0;
+    fs->data_block_refs=0;
+    fs->pages_released=0;
+    numa_init();
+    fs->log_mode=0;
+    fs->log_head=0;
+    fs->log_last=-1;
+    rsfs_mutex_init(&fs->data_bitmap_mutex);
+    for(int i=0; i<NUM_INODES; i++) fs->inode_bitmap[i]=0;
+    fs->inodes_used=0;
+    rsfs_mutex_init(&fs->inode_bitmap_mutex);    
 
     //initialize inodes
     for(int i=0; i<NUM_INODES; i++) {
-        inodes[i].length = 0;
-        inodes[i].reader_count = 0;    // Initialize reader count
-        inodes[i].writer_active = 0;    // Initialize writer flag
-        pthread_mutex_init(&inodes[i].rwlock, NULL);      // Initialize rwlock
-        pthread_cond_init(&inodes[i].readers_done, NULL); // Initialize condition variable
+        fs->inodes[i].length = 0;
+        fs->inodes[i].is_inline = 0;
+        fs->inodes[i].compressed = 0;
+        fs->inodes[i].reader_count = 0;    // Initialize reader count
+        fs->inodes[i].writer_active = 0;    // Initialize writer flag
+        rsfs_mutex_init(&fs->inodes[i].rwlock);      // Initialize rwlock
+        rsfs_cond_init(&fs->inodes[i].readers_done); // Initialize condition variable
         
         // Initialize block array (if not already done elsewhere)
         for(int j = 0; j < NUM_POINTERS; j++) {
-            inodes[i].block[j] = -1;
+            fs->inodes[i].block[j] = -1;
         }
     }
-    pthread_mutex_init(&inodes_mutex,NULL); 
+    rsfs_mutex_init(&fs->inodes_mutex); 
 
     //initialize open file table
     for(int i=0; i<NUM_OPEN_FILE; i++){
-        struct open_file_entry entry = open_file_table[i];  // Use pointer to modify actual entry
-        entry.used=0; //each entry is not used initially
-        pthread_mutex_init(&entry.entry_mutex,NULL);
-        entry.position=0;
-        entry.access_flag=-1;
-        entry.inode_number=-1;
+        struct open_file_entry *entry = &fs->open_file_table[i];
+        entry->used=0; //each entry is not used initially
+        rsfs_mutex_init(&entry->entry_mutex);
+        entry->position=0;
+        entry->access_flag=-1;
+        entry->inode_number=-1;
     }
-    pthread_mutex_init(&open_file_table_mutex,NULL); 
+    rsfs_mutex_init(&fs->open_file_table_mutex); 
 
     //initialize root inode
-    root_inode_number = allocate_inode();
-    if(root_inode_number<0){
-        printf("[%s] fails to allocate root inode\n", debugTitle);
+    fs->root_inode_number = allocate_inode();
+    if(fs->root_inode_number<0){
+        rsfs_error(ENOSPC, "[%s] fails to allocate root inode\n", debugTitle);
         return -1;
     }
-    pthread_mutex_init(&root_dir_mutex,NULL); 
-    
+    fs->inodes[fs->root_inode_number].is_dir = 1;
+    rsfs_mutex_init(&fs->root_dir_mutex); 
+    dcache_clear();
+    fs->dcache_enabled = 1;
+    name_scan_init();
+    crc32c_init();
+    block_copy_init();
+
+    //initialize the mutexes of the chunk cache, the snapshot table and the background threads
+    rsfs_mutex_init(&fs->chunk_cache_mutex);
+    rsfs_mutex_init(&fs->snapshots_mutex);
+    rsfs_mutex_init(&fs->scrub_mutex);
+    rsfs_mutex_init(&fs->defrag_mutex);
+    rsfs_mutex_init(&fs->cleaner_mutex);
     
     //initialize mutex_for_fs_stat
-    pthread_mutex_init(&mutex_for_fs_stat,NULL);
+    rsfs_mutex_init(&fs->mutex_for_fs_stat);
 
     //return 0 means success
     return 0;
 }
 
 
-//create file
+//create file (is_dir=0) or empty directory (is_dir=1) file_name in directory dir
 //if file does not exist, create the file and return 0;
 //if file_name already exists, return -1; 
 //otherwise (other errors), return -2.
-int RSFS_create(char file_name){
+static int create_at(int dir, char file_name, int is_dir){
+    struct rsfs *fs = rsfs_current;
 
-    //search root_dir for dir_entry matching provided file_name
-    struct dir_entry *dir_entry = search_dir(file_name);
-
-    if(dir_entry){//already exists
-        printf("[create] file (%c) already exists.\n", file_name);
+    //search the directory for dir_entry matching provided file_name
+    if(search_dir(dir, file_name)>=0){//already exists
+        rsfs_error(EEXIST, "[create] file (%c) already exists.\n", file_name);
         return -1;
     }else{
 
-        if(DEBUG) printf("[create] file (%c) does not exist.\n", file_name);
+        rsfs_log(LOG_DEBUG, "[create] file (%c) does not exist.\n", file_name);
 
         //get a free inode 
         char inode_number = allocate_inode();
         if(inode_number<0){
-            printf("[create] fail to allocate an inode.\n");
+            rsfs_error(ENOSPC, "[create] fail to allocate an inode.\n");
             return -2;
         } 
-        if(DEBUG) printf("[create] allocate inode with number:%d.\n", inode_number);
-
-        //insert (file_name, inode_number) to root directory entry
-        dir_entry = insert_dir(file_name, inode_number);
-        if(DEBUG) printf("[create] insert a dir_entry with file_name:%c.\n", dir_entry->name);
+        rsfs_log(LOG_DEBUG, "[create] allocate inode with number:%d.\n", inode_number);
+        fs->inodes[(int)inode_number].is_dir = is_dir;
+
+        //insert (file_name, inode_number) to the directory
+        int ret = insert_dir(dir, file_name, inode_number);
+        if(ret!=inode_number){
+            //directory full or removed, or another thread created the same file meanwhile
+            free_inode(inode_number);
+            if(ret>=0) rsfs_error(EEXIST, "[create] file (%c) already exists.\n", file_name);
+            if(ret==-2) rsfs_error(ENOENT, "[create] directory of file (%c) was removed.\n", file_name);
+            return ret>=0 ? -1 : -2;
+        }
+        rsfs_log(LOG_DEBUG, "[create] insert a dir_entry with file_name:%c.\n", file_name);
         
         return 0;
     }
 }
 
+//create file in the root directory
+static int rsfs_create(char file_name){
+    struct rsfs *fs = rsfs_current;
+    return create_at(fs->root_inode_number, file_name, 0);
+}
 
+//create file (is_dir=0) or directory (is_dir=1) at path, whose parent directory must exist
+//return 0 if succeed, -1 if it already exists, or -2 on other errors
+static int create_path(const char *path, int is_dir){
+    int dir;
+    char name;
 
-//delete file
-int RSFS_delete(char file_name){
+    int inode_number = lookup_path(path, &dir, &name);
+    if(inode_number>=0){
+        rsfs_error(EEXIST, "[create] path (%s) already exists.\n", path);
+        return -1;
+    }
+    if(dir<0){
+        rsfs_error(-inode_number, "[create] invalid path or missing directory: %s\n", path ? path : "(null)");
+        return -2;
+    }
+    return create_at(dir, name, is_dir);
+}
+
+
+
+//helper: free the data blocks and the inode of a file whose dir_entry is gone
+static void free_file(int inode_number){
+    struct rsfs *fs = rsfs_current;
+    struct inode *inode = &fs->inodes[inode_number];
+
+    //shared blocks are only released when their last reference goes
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    release_inode_content(inode);
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+    if(inode->compressed) chunk_cache_invalidate(inode_number);
+
+    free_inode(inode_number);
+}
+
+
+//delete file (is_dir=0) or empty directory (is_dir=1) file_name from directory dir
+static int delete_at(int dir, char file_name, int is_dir){
+    struct rsfs *fs = rsfs_current;
 
     char debug_title[32] = "[RSFS_delete]";
 
-    //to do: find the corresponding dir_entry
-    struct dir_entry *dir_entry = search_dir(file_name);
-    if(dir_entry==NULL){
-        printf("%s director entry does not exist for file (%c)\n", 
+    //to do: find and free the dir_entry in one step, so that concurrent deletes cannot both succeed
+    int inode_number = delete_dir(dir, file_name, is_dir);
+    if(inode_number==-1){
+        rsfs_error(ENOENT, "%s director entry does not exist for file (%c)\n", 
             debug_title, file_name);
         return -1;
     }
+    if(inode_number<0){
+        rsfs_error(inode_number==-3 ? ENOTEMPTY : (is_dir ? ENOTDIR : EISDIR),
+            "%s file (%c) is %s\n", debug_title, file_name,
+            inode_number==-3 ? "a directory that is not empty" : (is_dir ? "not a directory" : "a directory"));
+        return -2;
+    }
 
     //to do: find the corresponding inode
-    int inode_number = dir_entry->inode_number;
-    if(inode_number<0 || inode_number>=NUM_INODES){
-        printf("%s inode number (%d) is invalid.\n", 
+    if(inode_number>=NUM_INODES){
+        rsfs_error(EIO, "%s inode number (%d) is invalid.\n", 
             debug_title, inode_number);
         return -2;
     }
-    struct inode *inode = &inodes[inode_number];
+    struct inode *inode = &fs->inodes[inode_number];
+
+    //an open file keeps its inode and blocks until the last RSFS_close
+    rsfs_mutex_lock(&inode->rwlock);
+    int in_use = (inode->reader_count>0 || inode->writer_active);
+    if(in_use) inode->unlinked = 1;
+    pthread_mutex_unlock(&inode->rwlock);
+
+    if(!in_use) free_file(inode_number);
+    
+    return 0;
+}
+
+//delete file from the root directory
+static int rsfs_delete(char file_name){
+    struct rsfs *fs = rsfs_current;
+    return delete_at(fs->root_inode_number, file_name, 0);
+}
+
+//delete file (is_dir=0) or empty directory (is_dir=1) at path
+//return 0 if succeed, -1 if it does not exist, or -2 on other errors
+static int delete_path(const char *path, int is_dir){
+    int dir;
+    char name;
+
+    int inode_number = lookup_path(path, &dir, &name);
+    if(inode_number<0){
+        rsfs_error(-inode_number, "[RSFS_delete] invalid path or missing file: %s\n", path ? path : "(null)");
+        return inode_number==-ENOENT ? -1 : -2;
+    }
+    return delete_at(dir, name, is_dir);
+}
+
+
+//create the n files named in names in the root directory, taking each lock once for the whole batch
+//if results is not NULL, results[i] is set to 0 if names[i] was created, -1 if it already exists, or -2 on other errors
+//return the number of files created, or -1 if the arguments are invalid
+static int rsfs_create_many(const char *names, int n, int *results){
+    struct rsfs *fs = rsfs_current;
+
+    if(names==NULL || n<0){
+        rsfs_error(EINVAL, "[RSFS_create_many] invalid names or count\n");
+        return -1;
+    }
 
-    //to do: find the data blocks, free them in data-bitmap
-    pthread_mutex_lock(&data_bitmap_mutex);
-    for(int i = 0; i <= inode->length/BLOCK_SIZE; i++){
-        int block_number = inode->block[i];
-        if(block_number>=0) data_bitmap[block_number]=0;    
+    int *inode_numbers = results ? results : malloc(n*sizeof(int));
+    if(inode_numbers==NULL && n>0){
+        rsfs_error(ENOMEM, "[RSFS_create_many] out of memory\n");
+        return -1;
     }
-    pthread_mutex_unlock(&data_bitmap_mutex);
 
-    //to do: free the inode in inode-bitmap
-    pthread_mutex_lock(&inode_bitmap_mutex);
-    inode_bitmap[inode_number]=0;
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    int created = insert_dir_many(fs->root_inode_number, names, n, inode_numbers);
 
-    //to do: free the dir_entry
-    int ret = delete_dir(file_name);
-    
+    int exists = 0, failed = 0;
+    for(int i=0; i<n; i++){
+        if(inode_numbers[i]==-1) exists++;
+        if(inode_numbers[i]==-2) failed++;
+        if(inode_numbers[i]>=0) inode_numbers[i] = 0;
+    }
+    if(failed) rsfs_error(ENOSPC, "[RSFS_create_many] %d of %d files not created: no inode or dir_entry left\n", failed, n);
+    else if(exists) rsfs_error(EEXIST, "[RSFS_create_many] %d of %d files already exist\n", exists, n);
+
+    if(results==NULL) free(inode_numbers);
+    return created;
+}
+
+
+//delete the n files named in names from the root directory, taking each lock once for the whole batch
+//(open files are freed by their last RSFS_close, as with RSFS_delete)
+//if results is not NULL, results[i] is set to 0 if names[i] was deleted, -1 if it does not exist, or -2 on other errors
+//return the number of files deleted, or -1 if the arguments are invalid
+static int rsfs_delete_many(const char *names, int n, int *results){
+    struct rsfs *fs = rsfs_current;
+
+    if(names==NULL || n<0){
+        rsfs_error(EINVAL, "[RSFS_delete_many] invalid names or count\n");
+        return -1;
+    }
+
+    int *inode_numbers = results ? results : malloc(n*sizeof(int));
+    if(inode_numbers==NULL && n>0){
+        rsfs_error(ENOMEM, "[RSFS_delete_many] out of memory\n");
+        return -1;
+    }
+
+    int deleted = delete_dir_many(fs->root_inode_number, names, n, inode_numbers);
+
+    //the files nobody has open are freed together
+    int to_free[NUM_INODES], num_free = 0, missing = 0, failed = 0;
+    for(int i=0; i<n; i++){
+        int inode_number = inode_numbers[i];
+        if(inode_number<0){
+            if(inode_number==-1) missing++;
+            else failed++;
+            continue;
+        }
+        inode_numbers[i] = 0;
+
+        struct inode *inode = &fs->inodes[inode_number];
+        rsfs_mutex_lock(&inode->rwlock);
+        int in_use = (inode->reader_count>0 || inode->writer_active);
+        if(in_use) inode->unlinked = 1;
+        pthread_mutex_unlock(&inode->rwlock);
+
+        if(!in_use){
+            if(inode->compressed) chunk_cache_invalidate(inode_number);
+            to_free[num_free++] = inode_number;
+        }
+    }
+
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    release_inodes_content(to_free, num_free);
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    free_inodes(to_free, num_free);
+
+    if(failed) rsfs_error(EISDIR, "[RSFS_delete_many] %d of %d names are directories\n", failed, n);
+    else if(missing) rsfs_error(ENOENT, "[RSFS_delete_many] %d of %d files do not exist\n", missing, n);
+
+    if(results==NULL) free(inode_numbers);
+    return deleted;
+}
+
+
+//clone file
+//create file dst_name sharing all data blocks of src_name; blocks are copied on the first write to either file
+//return 0 if succeed; -1 if src_name does not exist or dst_name already exists; -2 on other errors
+static int rsfs_clone(char src_name, char dst_name){
+    struct rsfs *fs = rsfs_current;
+
+    char debug_title[32] = "[RSFS_clone]";
+
+    int src_inode_number = search_dir(fs->root_inode_number, src_name);
+    if(src_inode_number<0){
+        rsfs_error(ENOENT, "%s file (%c) does not exist\n", debug_title, src_name);
+        return -1;
+    }
+    if(fs->inodes[src_inode_number].is_dir){
+        rsfs_error(EISDIR, "%s file (%c) is a directory\n", debug_title, src_name);
+        return -2;
+    }
+
+    if(search_dir(fs->root_inode_number, dst_name)>=0){
+        rsfs_error(EEXIST, "%s file (%c) already exists\n", debug_title, dst_name);
+        return -1;
+    }
+
+    int dst_inode_number = allocate_inode();
+    if(dst_inode_number<0){
+        rsfs_error(ENOSPC, "%s fail to allocate an inode\n", debug_title);
+        return -2;
+    }
+
+    //only metadata is copied: O(NUM_POINTERS) regardless of the file length
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    share_inode_content(&fs->inodes[dst_inode_number], &fs->inodes[src_inode_number]);
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+    if(insert_dir(fs->root_inode_number, dst_name, dst_inode_number)!=dst_inode_number){
+        metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+        release_inode_content(&fs->inodes[dst_inode_number]);
+        metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+        free_inode(dst_inode_number);
+        return -2;
+    }
+
+    return 0;
+}
+
+
+//take a snapshot of the whole file system: the files of the root directory (sub-directories are not captured)
+//every file's content is captured by sharing its data blocks, so the cost is O(metadata);
+//bytes still in the write-back buffer of a RSFS_BUFFERED fd are not captured
+//return the snapshot id, or -1 if all NUM_SNAPSHOTS slots are in use
+static int rsfs_snapshot(){
+    struct rsfs *fs = rsfs_current;
+
+    int snapshot_id = allocate_snapshot();
+    if(snapshot_id<0){
+        rsfs_error(ENOSPC, "[RSFS_snapshot] no free snapshot slot\n");
+        return -1;
+    }
+    struct snapshot *snapshot = &fs->snapshots[snapshot_id];
+
+    //the root directory lives inline in its inode
+    struct dir_block *dir = (struct dir_block *)fs->inodes[fs->root_inode_number].inline_data;
+
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    for(int i=0; i<DIR_ENTRIES; i++){
+        if(dir->names[i]==0 || fs->inodes[(int)dir->inode_numbers[i]].is_dir) continue;
+
+        int n = snapshot->num_files++;
+        snapshot->names[n] = dir->names[i];
+        share_inode_content(&snapshot->files[n], &fs->inodes[(int)dir->inode_numbers[i]]);
+    }
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    return snapshot_id;
+}
+
+
+//roll the file system back to a snapshot: all current files of the root directory are deleted,
+//and the captured ones are recreated sharing the snapshot's blocks (the snapshot is kept);
+//sub-directories are left alone, and a captured file whose name is now a directory's is not restored;
+//no file may be open
+//return 0 if succeed, or -1 otherwise
+static int rsfs_restore(int snapshot_id){
+    struct rsfs *fs = rsfs_current;
+
+    char debug_title[32] = "[RSFS_restore]";
+
+    if(snapshot_id<0 || snapshot_id>=NUM_SNAPSHOTS || !fs->snapshots[snapshot_id].used){
+        rsfs_error(EINVAL, "%s invalid snapshot id: %d\n", debug_title, snapshot_id);
+        return -1;
+    }
+    struct snapshot *snapshot = &fs->snapshots[snapshot_id];
+
+    //the open file table stays locked until the files are swapped, so that no file gets opened meanwhile
+    metrics_lock(&fs->open_file_table_mutex, METRIC_LOCK_OPEN_FILE_TABLE);
+    for(int i=0; i<NUM_OPEN_FILE; i++){
+        if(fs->open_file_table[i].used){
+            metrics_unlock(&fs->open_file_table_mutex, METRIC_LOCK_OPEN_FILE_TABLE);
+            rsfs_error(EBUSY, "%s files are still open\n", debug_title);
+            return -1;
+        }
+    }
+
+    struct dir_block *dir = (struct dir_block *)fs->inodes[fs->root_inode_number].inline_data;
+    struct inode *root_inode = &fs->inodes[fs->root_inode_number];
+
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+    //drop the current files
+    for(int i=0; i<DIR_ENTRIES; i++){
+        if(dir->names[i]==0) continue;
+
+        int inode_number = dir->inode_numbers[i];
+        if(fs->inodes[inode_number].is_dir) continue;
+        release_inode_content(&fs->inodes[inode_number]);
+        chunk_cache_invalidate(inode_number);
+        free_inode(inode_number);
+
+        dcache_insert(fs->root_inode_number, dir->names[i], -1);
+        dir->names[i] = 0;
+        dir->inode_numbers[i] = 0;
+        root_inode->length--;
+    }
+
+    //recreate the captured ones in the free entries
+    int ret = 0, slot = 0;
+    for(int n=0; n<snapshot->num_files; n++){
+        if(name_scan(dir->names, DIR_ENTRIES, snapshot->names[n])>=0){
+            rsfs_error(EEXIST, "%s file (%c) is now a directory\n", debug_title, snapshot->names[n]);
+            ret = -1;
+            continue;
+        }
+
+        while(slot<DIR_ENTRIES && dir->names[slot]!=0) slot++;
+        int inode_number = (slot<DIR_ENTRIES) ? allocate_inode() : -1;
+        if(inode_number<0){
+            rsfs_error(ENOSPC, "%s fail to allocate an inode or a dir_entry\n", debug_title);
+            ret = -1;
+            break;
+        }
+        share_inode_content(&fs->inodes[inode_number], &snapshot->files[n]);
+
+        dir->names[slot] = snapshot->names[n];
+        dir->inode_numbers[slot] = inode_number;
+        dcache_insert(fs->root_inode_number, snapshot->names[n], inode_number);
+        root_inode->length++;
+    }
+
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+    metrics_unlock(&fs->open_file_table_mutex, METRIC_LOCK_OPEN_FILE_TABLE);
+
+    return ret;
+}
+
+
+//delete a snapshot: its references to data blocks are dropped,
+//so blocks no longer used by any file become available
+//return 0 if succeed, or -1 otherwise
+static int rsfs_delete_snapshot(int snapshot_id){
+    struct rsfs *fs = rsfs_current;
+
+    if(snapshot_id<0 || snapshot_id>=NUM_SNAPSHOTS || !fs->snapshots[snapshot_id].used){
+        rsfs_error(EINVAL, "[RSFS_delete_snapshot] invalid snapshot id: %d\n", snapshot_id);
+        return -1;
+    }
+    struct snapshot *snapshot = &fs->snapshots[snapshot_id];
+
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    for(int n=0; n<snapshot->num_files; n++){
+        release_inode_content(&snapshot->files[n]);
+    }
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+    free_snapshot(snapshot_id);
+    return 0;
+}
+
+
+//fill st with the file system's counters; they are maintained by the allocators,
+//so this neither scans the bitmaps nor takes any lock
+//return 0 if succeed, or -1 if st is NULL
+static int rsfs_statfs(struct rsfs_statfs *st){
+    struct rsfs *fs = rsfs_current;
+    if(st==NULL){
+        rsfs_error(EINVAL, "[RSFS_statfs] invalid buffer\n");
+        return -1;
+    }
+
+    st->block_size = BLOCK_SIZE;
+    st->total_blocks = NUM_DBLOCKS;
+    st->used_blocks = __atomic_load_n(&fs->data_blocks_used, __ATOMIC_RELAXED);
+    st->block_refs = __atomic_load_n(&fs->data_block_refs, __ATOMIC_RELAXED);
+    st->total_inodes = NUM_INODES;
+    st->used_inodes = __atomic_load_n(&fs->inodes_used, __ATOMIC_RELAXED);
+    st->open_files = __atomic_load_n(&fs->open_entries, __ATOMIC_RELAXED);
+    st->max_open_files = NUM_OPEN_FILE;
+    st->max_file_size = MAX_FILE_SIZE;
+    st->checksum_errors = __atomic_load_n(&fs->checksum_mismatches, __ATOMIC_RELAXED);
+    st->scrubbed_blocks = __atomic_load_n(&fs->scrub_checked, __ATOMIC_RELAXED);
+    st->fragmentation = fragmentation_score();
+    st->defrag_moved_blocks = __atomic_load_n(&fs->defrag_moved, __ATOMIC_RELAXED);
+    st->clean_segments = clean_segments();
+    st->cleaned_blocks = __atomic_load_n(&fs->cleaner_moved, __ATOMIC_RELAXED);
+    st->resident_blocks = data_blocks_resident();
+    st->nodes = fs->numa_nodes;
+    st->released_pages = __atomic_load_n(&fs->pages_released, __ATOMIC_RELAXED);
+    return 0;
+}
+
+
+//fill st with the status of the open file fd
+//return 0 if succeed, or -1 otherwise
+static int rsfs_fstat(int fd, struct rsfs_fstat *st){
+    struct rsfs *fs = rsfs_current;
+    if(fd<0 || fd>=NUM_OPEN_FILE || st==NULL){
+        rsfs_error(st==NULL ? EINVAL : EBADF, "[RSFS_fstat] invalid fd or buffer\n");
+        return -1;
+    }
+
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    rsfs_mutex_lock(&entry->entry_mutex);
+
+    if(!entry->used){
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EBADF, "[RSFS_fstat] file descriptor not in use\n");
+        return -1;
+    }
+
+    st->inode_number = entry->inode_number;
+    st->pending = entry->wb_len;
+    st->access_flag = entry->access_flag;
+    st->position = entry->position;
+
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    struct inode *inode = &fs->inodes[entry->inode_number];
+
+    st->length = inode->length;
+    st->is_inline = inode->is_inline;
+    st->compressed = inode->compressed;
+    st->blocks = 0;
+    st->local_blocks = 0;
+    int local = numa_local_index();
+    if(!inode->is_inline){
+        for(int i=0; i<NUM_POINTERS; i++){
+            st->blocks += (inode->block[i]>=0);
+            st->local_blocks += (inode->block[i]>=0 && numa_block_index(inode->block[i])==local);
+        }
+    }
+    st->stored = inode->length;
+    if(inode->compressed){
+        st->stored = 0;
+        for(int c=0; c*COMPRESS_CHUNK_SIZE<inode->length; c++) st->stored += inode->chunk_clen[c];
+    }
+
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    pthread_mutex_unlock(&entry->entry_mutex);
     return 0;
 }
 
 
 //print status of the file system
-void RSFS_stat(){
+//the file list is taken under root_dir_mutex and inodes_mutex, the totals come from RSFS_statfs()
+static void rsfs_stat(){
+    struct rsfs *fs = rsfs_current;
 
-    pthread_mutex_lock(&mutex_for_fs_stat);
+    rsfs_mutex_lock(&fs->mutex_for_fs_stat);
+
+    struct rsfs_statfs st;
+    rsfs_statfs(&st);
 
 
     printf("\nCurrent status of the file system:\n\n %16s%10s%10s\n", "File Name", "Length", "iNode #");
 
     //list files
-    for(int i=0; i<BLOCK_SIZE/sizeof(struct dir_entry); i++){
-        struct dir_entry *dir_entry = (struct dir_entry *)root_data_block + i;
-        if(dir_entry->name==0) continue;
+    int inline_files=0, compressed_files=0, compressed_length=0, compressed_stored=0;
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    struct dir_block *dir = (struct dir_block *)fs->inodes[fs->root_inode_number].inline_data;
+    for(int i=0; i<DIR_ENTRIES; i++){
+        if(dir->names[i]==0) continue;
         
-        int inode_number = dir_entry->inode_number;
-        struct inode *inode = &inodes[inode_number];
+        int inode_number = dir->inode_numbers[i];
+        struct inode *inode = &fs->inodes[inode_number];
+        if(inode->is_inline && !inode->is_dir && inode->length>0) inline_files++;
+        if(inode->compressed){
+            compressed_files++;
+            compressed_length+=inode->length;
+            for(int c=0; c*COMPRESS_CHUNK_SIZE<inode->length; c++) compressed_stored+=inode->chunk_clen[c];
+        }
         
-        printf("%16c%10d%10d\n", dir_entry->name, inode->length, inode_number);
+        printf("%16c%10d%10d\n", dir->names[i], inode->length, inode_number);
     }
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
     
     
     //data blocks
-    int db_used=0;
-    for(int i=0; i<NUM_DBLOCKS; i++) db_used+=data_bitmap[i];
-    printf("\nTotal Data Blocks: %4d,  Used: %d,  Unused: %d\n", NUM_DBLOCKS, db_used, NUM_DBLOCKS-db_used);
+    printf("\nTotal Data Blocks: %4d,  Used: %d,  Unused: %d\n", st.total_blocks, st.used_blocks, st.total_blocks-st.used_blocks);
+
+    //memory: blocks committed (resident) vs. reserved only, until written
+    printf("Resident Data Blocks: %d,  Pages Released: %lu\n", st.resident_blocks, (unsigned long)st.released_pages);
+
+    //dedup: block pointers held by files vs. blocks physically used
+    printf("Dedup Ratio: %10.2f  (%d block references in %d blocks)\n",
+        st.used_blocks ? (double)st.block_refs/st.used_blocks : 1.0, st.block_refs, st.used_blocks);
+
+    //inline files: each non-empty one saves a data block, and so does the inline root directory
+    printf("Inline Files: %9d,  Data Blocks Saved: %d\n", inline_files, inline_files+1);
+
+    //compressed files: content length vs. bytes actually stored in blocks
+    printf("Compressed Files: %5d,  Length: %d,  Stored: %d\n", compressed_files, compressed_length, compressed_stored);
 
     //inodes
-    int inodes_used=0;
-    for(int i=0; i<NUM_INODES; i++) inodes_used+=inode_bitmap[i];
-    printf("Total iNode Blocks: %3d,  Used: %d,  Unused: %d\n", NUM_INODES, inodes_used, NUM_INODES-inodes_used);
+    printf("Total iNode Blocks: %3d,  Used: %d,  Unused: %d\n", st.total_inodes, st.used_inodes, st.total_inodes-st.used_inodes);
 
     //open files
-    int of_num=0;
-    for(int i=0; i<NUM_OPEN_FILE; i++) of_num+=open_file_table[i].used;
-    printf("Total Opened Files: %3d\n\n", of_num);
+    printf("Total Opened Files: %3d\n\n", st.open_files);
 
-    pthread_mutex_unlock(&mutex_for_fs_stat);
+    pthread_mutex_unlock(&fs->mutex_for_fs_stat);
 }
 
 
+//turn block-level deduplication on or off;
+//blocks already shared stay shared, and are unshared by copy-on-write when modified
+void RSFS_set_dedup(int enable){
+    struct rsfs *fs = rsfs_current;
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+    fs->dedup_enabled = enable ? 1 : 0;
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+}
+
+
+
+
+
+//store the file of fd compressed (enable=1) or raw (enable=0);
+//only allowed while the file is empty and fd is open with RSFS_RDWR
+//return 0 if succeed, or -1 otherwise
+static int rsfs_set_compressed(int fd, int enable){
+    struct rsfs *fs = rsfs_current;
+    if(fd<0 || fd>=NUM_OPEN_FILE){
+        rsfs_error(EBADF, "[RSFS_set_compressed] invalid fd: %d\n", fd);
+        return -1;
+    }
+
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    rsfs_mutex_lock(&entry->entry_mutex);
+
+    if(!entry->used || entry->access_flag!=RSFS_RDWR){
+        rsfs_error(EBADF, "[RSFS_set_compressed] file not open for writing\n");
+        pthread_mutex_unlock(&entry->entry_mutex);
+        return -1;
+    }
+
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    struct inode *inode = &fs->inodes[entry->inode_number];
+
+    int ret = -1;
+    if(inode->length==0 && entry->wb_len==0){
+        //compressed content always lives in blocks, never inline
+        inode_write_begin(inode);
+        if(enable && inode->is_inline){
+            inode->is_inline = 0;
+            for(int i=0; i<NUM_POINTERS; i++) inode->block[i] = -1;
+        }
+        inode->compressed = enable ? 1 : 0;
+        inode_write_end(inode);
+        ret = 0;
+    }else{
+        rsfs_error(EINVAL, "[RSFS_set_compressed] file is not empty\n");
+    }
+
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    pthread_mutex_unlock(&entry->entry_mutex);
+    return ret;
+}
+
 
 
 
@@ -192,42 +705,73 @@ void RSFS_stat(){
 
 
 
-//open a file with RSFS_RDONLY or RSFS_RDWR flags
+// release_access: Undo the reader/writer registration made by RSFS_open on an inode and wake up
+// waiting openers. If the file was deleted while open and this was its last user, free it now.
+static void release_access(int inode_number, int access_flag) {
+    struct rsfs *fs = rsfs_current;
+    struct inode *inode = &fs->inodes[inode_number];
+
+    rsfs_mutex_lock(&inode->rwlock);
+    if (access_flag == RSFS_RDWR) {
+        inode->writer_active = 0;
+    } else {
+        inode->reader_count--;
+    }
+    int last_user = inode->unlinked && inode->reader_count == 0 && !inode->writer_active;
+    if (last_user) inode->unlinked = 0;
+
+    // Signal waiting threads that access is available
+    pthread_cond_broadcast(&inode->readers_done);
+    pthread_mutex_unlock(&inode->rwlock);
+
+    if (last_user) free_file(inode_number);
+}
+
+
+//open file file_name of directory dir with RSFS_RDONLY or RSFS_RDWR flags
 //return a file descriptor if succeed; 
 //otherwise return a negative integer value
-int RSFS_open(char file_name, int access_flag) {
+static int open_at(int dir, char file_name, int access_flag) {
+    struct rsfs *fs = rsfs_current;
+    // RSFS_BUFFERED is only meaningful together with RSFS_RDWR
+    int buffered = (access_flag == (RSFS_RDWR | RSFS_BUFFERED));
+    if (buffered) access_flag = RSFS_RDWR;
+
     if (access_flag != RSFS_RDONLY && access_flag != RSFS_RDWR) {
-        printf("[RSFS_open] invalid access flag: %d\n", access_flag);
+        rsfs_error(EINVAL, "[RSFS_open] invalid access flag: %d\n", access_flag);
         return -1;
     }
 
-    struct dir_entry *entry = search_dir(file_name);
-    if (entry == NULL) {
-        printf("[RSFS_open] fail to find file with name: %c\n", file_name);
+    int inode_number = search_dir(dir, file_name);
+    if (inode_number < 0) {
+        rsfs_error(ENOENT, "[RSFS_open] fail to find file with name: %c\n", file_name);
         return -2;
     }
 
-    int inode_number = entry->inode_number;
-    if (inode_number < 0 || inode_number >= NUM_INODES) {
-        printf("[RSFS_open] invalid inode number: %d\n", inode_number);
+    if (inode_number <= fs->root_inode_number || inode_number >= NUM_INODES) {
+        rsfs_error(EIO, "[RSFS_open] invalid inode number: %d\n", inode_number);
+        return -3;
+    }
+    if (fs->inodes[inode_number].is_dir) {
+        rsfs_error(EISDIR, "[RSFS_open] file (%c) is a directory\n", file_name);
         return -3;
     }
 
-    struct inode *inode = &inodes[inode_number];
+    struct inode *inode = &fs->inodes[inode_number];
     
     // Lock the rwlock before checking/modifying reader/writer status
-    pthread_mutex_lock(&inode->rwlock);
+    rsfs_mutex_lock(&inode->rwlock);
     
     if (access_flag == RSFS_RDWR) {
         // Writer access - wait until no readers and no writers
         while (inode->reader_count > 0 || inode->writer_active) {
-            pthread_cond_wait(&inode->readers_done, &inode->rwlock);
+            metrics_cond_wait(&inode->readers_done, &inode->rwlock, METRIC_LOCK_READERS_DONE);
         }
         inode->writer_active = 1;
     } else {
         // Reader access - wait until no writers
         while (inode->writer_active) {
-            pthread_cond_wait(&inode->readers_done, &inode->rwlock);
+            metrics_cond_wait(&inode->readers_done, &inode->rwlock, METRIC_LOCK_READERS_DONE);
         }
         inode->reader_count++;
     }
@@ -238,62 +782,453 @@ int RSFS_open(char file_name, int access_flag) {
     int fd = allocate_open_file_entry(access_flag, inode_number);
     if (fd < 0) {
         // If allocation fails, we need to undo our reader/writer registration
-        pthread_mutex_lock(&inode->rwlock);
-        if (access_flag == RSFS_RDWR) {
-            inode->writer_active = 0;
-        } else {
-            inode->reader_count--;
-        }
-        pthread_cond_broadcast(&inode->readers_done);
-        pthread_mutex_unlock(&inode->rwlock);
+        release_access(inode_number, access_flag);
         
-        printf("[RSFS_open] fail to allocate open file entry.\n");
+        rsfs_error(EMFILE, "[RSFS_open] fail to allocate open file entry.\n");
         return -4;
     }
 
+    // The file may have been deleted (and its inode reused) while we waited; checked once the entry is in use,
+    // since RSFS_restore swaps the files only while no entry is
+    if (search_dir(dir, file_name) != inode_number) {
+        free_open_file_entry(fd);
+        release_access(inode_number, access_flag);
+        rsfs_error(ENOENT, "[RSFS_open] fail to find file with name: %c\n", file_name);
+        return -2;
+    }
+    fs->open_file_table[fd].buffered = buffered;
+
     return fd;
 }
 
-// RSFS_append: Append data from buf to the end of the file.
-// Locks the open file entry and inode during update. Allocates data blocks as needed.
-// Returns number of bytes successfully appended
-//append the content in buf to the end of the file of descriptor fd
-//return the number of bytes actually appended to the file
-int RSFS_append(int fd, void *buf, int size) {
-    // Check the sanity of the arguments
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
-        return 0;
+//open a file of the root directory
+static int rsfs_open(char file_name, int access_flag) {
+    struct rsfs *fs = rsfs_current;
+    return open_at(fs->root_inode_number, file_name, access_flag);
+}
+
+//open the file at path
+static int open_path(const char *path, int access_flag) {
+    int dir;
+    char name;
+
+    int inode_number = lookup_path(path, &dir, &name);
+    if (inode_number < 0) {
+        rsfs_error(-inode_number, "[RSFS_open] invalid path or missing file: %s\n", path ? path : "(null)");
+        return -2;
     }
-    
-    // Get the open file entry corresponding to fd
-    struct open_file_entry *entry = &open_file_table[fd];
-    
-    // Lock the entry mutex to ensure exclusive access
-    pthread_mutex_lock(&entry->entry_mutex);
-    
-    if (!entry->used) {
-        pthread_mutex_unlock(&entry->entry_mutex);
-        return 0;
+    return open_at(dir, name, access_flag);
+}
+
+
+//store the names of up to max entries of the directory at path ("/" or "" for the root) into names
+//return the number of names stored, or -1 if path is not a directory
+static int rsfs_readdir(const char *path, char *names, int max){
+    struct rsfs *fs = rsfs_current;
+    int dir = fs->root_inode_number;
+
+    if(path!=NULL && path[0]!='\0' && strcmp(path, "/")!=0){
+        dir = lookup_path(path, NULL, NULL);
+        if(dir<0){
+            rsfs_error(-dir, "[RSFS_readdir] invalid path or missing directory: %s\n", path);
+            return -1;
+        }
     }
-    
-    
-    // Check if the file is opened with RSFS_RDWR mode
-    if (entry->access_flag == RSFS_RDONLY) {
-        pthread_mutex_unlock(&entry->entry_mutex);
-        return 0;
+    if(names==NULL || max<0){
+        rsfs_error(EINVAL, "[RSFS_readdir] invalid buffer\n");
+        return -1;
+    }
+
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    if(!fs->inodes[dir].is_dir){
+        metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+        rsfs_error(ENOTDIR, "[RSFS_readdir] not a directory: %s\n", path);
+        return -1;
+    }
+
+    int n = 0;
+    struct dir_block *entries = (struct dir_block *)fs->inodes[dir].inline_data;
+    for(int i=0; i<DIR_ENTRIES && n<max; i++){
+        if(entries->names[i]!=0) names[n++] = entries->names[i];
+    }
+
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+    return n;
+}
+
+//helper: the attributes of inode into ent, read without inodes_mutex and made consistent by its sequence counter
+//(see inode_write_begin); after READ_RETRIES torn attempts, they are read under inodes_mutex
+static void read_dirent_attrs(struct inode *inode, struct rsfs_dirent *ent){
+    struct rsfs *fs = rsfs_current;
+    for(int tries=0; tries<READ_RETRIES; tries++){
+        unsigned int seq = __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+        if(seq & 1) continue;
+
+        ent->length = __atomic_load_n(&inode->length, __ATOMIC_RELAXED);
+        ent->blocks = 0;
+        if(!__atomic_load_n(&inode->is_inline, __ATOMIC_RELAXED)){
+            for(int i=0; i<NUM_POINTERS; i++) ent->blocks += (__atomic_load_n(&inode->block[i], __ATOMIC_RELAXED)>=0);
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&inode->seq, __ATOMIC_RELAXED)==seq) return;
+    }
+
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    ent->length = inode->length;
+    ent->blocks = 0;
+    for(int i=0; !inode->is_inline && i<NUM_POINTERS; i++) ent->blocks += (inode->block[i]>=0);
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+}
+
+//store up to max entries of the directory at path ("/" or "" for the root), with the attributes of each, into ents,
+//starting at *cursor (0 for the first call) and advancing it; no file is opened, and each call holds root_dir_mutex once
+//return the number of entries stored (0 once the directory is exhausted), or -1 if path is not a directory
+static int rsfs_readdir_plus(const char *path, int *cursor, struct rsfs_dirent *ents, int max){
+    struct rsfs *fs = rsfs_current;
+    int dir = fs->root_inode_number;
+
+    if(path!=NULL && path[0]!='\0' && strcmp(path, "/")!=0){
+        dir = lookup_path(path, NULL, NULL);
+        if(dir<0){
+            rsfs_error(-dir, "[RSFS_readdir_plus] invalid path or missing directory: %s\n", path);
+            return -1;
+        }
+    }
+    if(cursor==NULL || *cursor<0 || ents==NULL || max<0){
+        rsfs_error(EINVAL, "[RSFS_readdir_plus] invalid cursor or buffer\n");
+        return -1;
+    }
+
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    if(!fs->inodes[dir].is_dir){
+        metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+        rsfs_error(ENOTDIR, "[RSFS_readdir_plus] not a directory: %s\n", path);
+        return -1;
+    }
+
+    //the entries and the inodes they name stay put while root_dir_mutex is held
+    int n = 0, i;
+    struct dir_block *entries = (struct dir_block *)fs->inodes[dir].inline_data;
+    for(i=*cursor; i<DIR_ENTRIES && n<max; i++){
+        if(entries->names[i]==0) continue;
+
+        struct inode *inode = &fs->inodes[(int)entries->inode_numbers[i]];
+        ents[n].name = entries->names[i];
+        ents[n].inode_number = entries->inode_numbers[i];
+        ents[n].is_dir = inode->is_dir;
+        read_dirent_attrs(inode, &ents[n]);
+        n++;
+    }
+    *cursor = i;
+
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+    return n;
+}
+
+// migrate_inline_data: Move the content of an inline inode into a freshly allocated data block.
+// Caller must hold inodes_mutex. Returns 0 on success, or -1 if no data block is available
+static int migrate_inline_data(struct inode *inode) {
+    struct rsfs *fs = rsfs_current;
+    if (!inode->is_inline) {
+        return 0;
+    }
+
+    int block_number = allocate_data_block();
+    if (block_number < 0) {
+        return -1;
+    }
+
+    // inline_data and block[] share storage, so copy the content out first
+    memcpy(fs->data_blocks[block_number], inode->inline_data, inode->length);
+    checksum_update(block_number);
+
+    inode->is_inline = 0;
+    for (int i = 0; i < NUM_POINTERS; i++) {
+        inode->block[i] = -1;
+    }
+    inode->block[0] = block_number;
+
+    return 0;
+}
+
+
+// get_writable_block: Return the data block at index i of the inode, ready to be modified.
+// Allocates it if missing, or copies it first if it is shared (copy-on-write).
+// Caller must hold inodes_mutex. Returns the block number, or -1 if no data block is available
+static int get_writable_block(struct inode *inode, int i) {
+    int block_number = inode->block[i];
+    if (block_number < 0) {
+        block_number = allocate_data_block();
+    } else {
+        block_number = cow_data_block(block_number);
+    }
+    if (block_number < 0) {
+        return -1;
+    }
+
+    inode->block[i] = block_number;
+    return block_number;
+}
+
+
+// block_written: Called after data was copied into block i of the inode up to end_in_block.
+// Its checksum is updated, and a block that became full is handed to the dedup index,
+// which may swap in a shared block. Caller must hold inodes_mutex
+static void block_written(struct inode *inode, int i, int end_in_block) {
+    checksum_update(inode->block[i]);
+    if (end_in_block == BLOCK_SIZE) {
+        inode->block[i] = dedup_data_block(inode->block[i]);
+    }
+}
+
+
+// write_blocks: Fast path of a write or append starting at a block boundary: the writable blocks for the
+// whole range are reserved first, then each run of physically adjacent blocks is filled by a single block_copy.
+// Caller must hold inodes_mutex. Returns the number of bytes written, short if blocks ran out
+static int write_blocks(struct inode *inode, int start_block, const char *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    int last_block = start_block + (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (last_block > NUM_POINTERS) last_block = NUM_POINTERS;
+
+    int end_block = start_block;
+    while (end_block < last_block && get_writable_block(inode, end_block) >= 0) {
+        end_block++;
+    }
+
+    int written = 0;
+    for (int i = start_block; i < end_block; ) {
+        int run = 1;
+        while (i + run < end_block && inode->block[i + run] == inode->block[i] + run) {
+            run++;
+        }
+        int chunk = run * BLOCK_SIZE;
+        if (chunk > size - written) chunk = size - written;
+
+        block_copy(fs->data_blocks[(int)inode->block[i]], buf + written, chunk);
+        for (int k = 0; k < run; k++) {
+            int end_in_block = chunk - k * BLOCK_SIZE;
+            block_written(inode, i + k, end_in_block > BLOCK_SIZE ? BLOCK_SIZE : end_in_block);
+        }
+
+        written += chunk;
+        i += run;
+    }
+    return written;
+}
+
+
+// stream_read: Copy len bytes starting at byte off of the inode's blocks into buf.
+// Used for the compressed stream, which ignores inode->length. Caller must hold inodes_mutex
+static void stream_read(struct inode *inode, int off, char *buf, int len) {
+    struct rsfs *fs = rsfs_current;
+    while (len > 0) {
+        int i = off / BLOCK_SIZE;
+        int offset_in_block = off % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - offset_in_block;
+        if (chunk > len) chunk = len;
+
+        memcpy(buf, (char*)fs->data_blocks[(int)inode->block[i]] + offset_in_block, chunk);
+        buf += chunk;
+        off += chunk;
+        len -= chunk;
+    }
+}
+
+
+// stream_write: Copy len bytes of buf into the inode's blocks starting at byte off.
+// Blocks must be reserved by the caller; shared ones are copied first.
+// Caller must hold inodes_mutex. Returns the number of bytes written
+static int stream_write(struct inode *inode, int off, const char *buf, int len) {
+    struct rsfs *fs = rsfs_current;
+    int written = 0;
+    while (written < len) {
+        int i = off / BLOCK_SIZE;
+        int offset_in_block = off % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - offset_in_block;
+        if (chunk > len - written) chunk = len - written;
+
+        if (get_writable_block(inode, i) < 0) {
+            break;
+        }
+        memcpy((char*)fs->data_blocks[(int)inode->block[i]] + offset_in_block, buf + written, chunk);
+        block_written(inode, i, offset_in_block + chunk);
+
+        written += chunk;
+        off += chunk;
+    }
+    return written;
+}
+
+
+// compressed_chunk: Get the content of chunk c of a compressed file into dst,
+// from the chunk cache or by decompressing it. Caller must hold inodes_mutex.
+// Returns the length of the chunk content, or -1 (EIO) if the stored chunk does not decompress to it;
+// a corrupt chunk is never cached
+static int compressed_chunk(struct inode *inode, int c, char *dst) {
+    struct rsfs *fs = rsfs_current;
+    int inode_number = inode - fs->inodes;
+    int length = inode->length - c * COMPRESS_CHUNK_SIZE;
+    if (length > COMPRESS_CHUNK_SIZE) length = COMPRESS_CHUNK_SIZE;
+
+    if (chunk_cache_get(inode_number, c, dst) == length) {
+        return length;
+    }
+
+    // The chunks are stored back to back: find where this one starts
+    int off = 0;
+    for (int i = 0; i < c; i++) {
+        off += inode->chunk_clen[i];
+    }
+
+    char stored[COMPRESS_CHUNK_SIZE];
+    int clen = inode->chunk_clen[c];
+    if (clen <= 0 || clen > length || off + clen > MAX_FILE_SIZE) {
+        rsfs_error(EIO, "[compressed_chunk] chunk %d of inode %d has an invalid stored length: %d\n", c, inode_number, clen);
+        return -1;
+    }
+    stream_read(inode, off, stored, clen);
+    if (clen == length) {
+        memcpy(dst, stored, length); // did not compress, kept raw
+    } else if (lz_decompress(stored, clen, dst, COMPRESS_CHUNK_SIZE) != length) {
+        rsfs_error(EIO, "[compressed_chunk] chunk %d of inode %d is corrupted\n", c, inode_number);
+        return -1;
+    }
+
+    chunk_cache_put(inode_number, c, dst, length);
+    return length;
+}
+
+
+// compressed_update: Replace the content of a compressed file from position pos on
+// with size bytes of buf; the file then ends at pos+size (the append and write semantics).
+// Every chunk from the one containing pos is recompressed and stored again.
+// Caller must hold inodes_mutex. Returns the number of bytes written, -1 if out of data blocks,
+// or -2 if the chunk containing pos is corrupted (EIO); the file is left unchanged on error
+static int compressed_update(struct inode *inode, int pos, const char *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    if (pos + size > MAX_FILE_SIZE) {
+        size = MAX_FILE_SIZE - pos;
+    }
+    if (size <= 0) {
+        return 0;
+    }
+
+    // Content from the start of the first modified chunk to the new end of the file
+    int first = pos / COMPRESS_CHUNK_SIZE;
+    int base = first * COMPRESS_CHUNK_SIZE;
+    int new_length = pos + size;
+    char plain[MAX_FILE_SIZE];
+    if (pos > base && compressed_chunk(inode, first, plain) < 0) {
+        return -2;
+    }
+    memcpy(plain + pos - base, buf, size);
+
+    // Recompress chunk by chunk, keeping a chunk raw when it does not shrink
+    char stream[MAX_FILE_SIZE];
+    short clen[MAX_CHUNKS];
+    int stream_len = 0;
+    int last = (new_length - 1) / COMPRESS_CHUNK_SIZE;
+    for (int c = first; c <= last; c++) {
+        char *src = plain + (c - first) * COMPRESS_CHUNK_SIZE;
+        int len = new_length - c * COMPRESS_CHUNK_SIZE;
+        if (len > COMPRESS_CHUNK_SIZE) len = COMPRESS_CHUNK_SIZE;
+
+        int n = lz_compress(src, len, stream + stream_len, len - 1);
+        if (n < 0) {
+            memcpy(stream + stream_len, src, len);
+            n = len;
+        }
+        clen[c] = n;
+        stream_len += n;
+    }
+
+    int off = 0;
+    for (int c = 0; c < first; c++) {
+        off += inode->chunk_clen[c];
+    }
+
+    // Reserve the missing blocks and unshare the shared ones (a copy keeps their content) before writing any,
+    // so that running out leaves the file, its chunk lengths and its length as they were
+    char reserved[NUM_POINTERS] = {0};
+    int end_block = (off + stream_len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int i = off / BLOCK_SIZE; i < end_block; i++) {
+        reserved[i] = (inode->block[i] < 0);
+        if (get_writable_block(inode, i) < 0) {
+            for (int j = off / BLOCK_SIZE; j < i; j++) {
+                if (reserved[j]) {
+                    free_data_block(inode->block[j]);
+                    inode->block[j] = -1;
+                }
+            }
+            return -1;
+        }
+    }
+
+    // Every block of the stream is private now: the copy cannot fall short
+    for (int done = 0; done < stream_len; ) {
+        int i = (off + done) / BLOCK_SIZE;
+        int offset_in_block = (off + done) % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - offset_in_block;
+        if (chunk > stream_len - done) chunk = stream_len - done;
+
+        memcpy(fs->data_blocks[(int)inode->block[i]] + offset_in_block, stream + done, chunk);
+        block_written(inode, i, offset_in_block + chunk);
+        done += chunk;
+    }
+
+    // Release the blocks past the new end of the stream
+    for (int i = end_block; i < NUM_POINTERS; i++) {
+        if (inode->block[i] >= 0) {
+            free_data_block(inode->block[i]);
+            inode->block[i] = -1;
+        }
+    }
+
+    for (int c = first; c <= last; c++) {
+        inode->chunk_clen[c] = clen[c];
+    }
+    inode->length = new_length;
+    chunk_cache_invalidate(inode - fs->inodes);
+
+    return size;
+}
+
+
+// append_internal: Append size bytes from buf to the end of the file of the given inode.
+// Caller must hold inodes_mutex. Allocates data blocks as needed.
+// Returns number of bytes actually appended (short if the file or the data blocks run out)
+static int append_internal(struct inode *inode, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    // Save the original file length
+    int original_length = inode->length;
+
+    // Compressed file: recompress the last chunk together with the new bytes
+    if (inode->compressed) {
+        int appended = compressed_update(inode, original_length, buf, size);
+        return (appended < 0) ? 0 : appended;
+    }
+
+    // Small files stay inline; once they outgrow the inode they move into a block
+    if (inode->is_inline) {
+        if (original_length + size <= INLINE_DATA_SIZE) {
+            memcpy(inode->inline_data + original_length, buf, size);
+            inode->length += size;
+            return size;
+        }
+        if (migrate_inline_data(inode) < 0) {
+            return 0;
+        }
     }
     
-    
-    // Get the inode
-    int inode_number = entry->inode_number;
-    struct inode *inode = &inodes[inode_number];
-    
-    // Lock the inode mutex to ensure exclusive access
-    pthread_mutex_lock(&inodes_mutex);
-    
-    // Save the original file length
-    int original_length = inode->length;
-    
+    // Block-aligned end of file: whole runs of blocks at once
+    if (original_length % BLOCK_SIZE == 0 && size >= BLOCK_SIZE) {
+        inode->length += write_blocks(inode, original_length / BLOCK_SIZE, buf, size);
+        return inode->length - original_length;
+    }
+
     // Calculate how many bytes to append
     int bytes_to_append = size;
     
@@ -303,7 +1238,9 @@ int RSFS_append(int fd, void *buf, int size) {
     
     // Calculate how many bytes can be written to the first block
     int bytes_to_first_block;
-    if (offset_in_block == 0) {
+    if (start_block >= NUM_POINTERS) {
+        bytes_to_first_block = 0;
+    } else if (offset_in_block == 0) {
         bytes_to_first_block = (bytes_to_append > BLOCK_SIZE) ? BLOCK_SIZE : bytes_to_append;
     } else {
         bytes_to_first_block = (BLOCK_SIZE - offset_in_block);
@@ -312,21 +1249,16 @@ int RSFS_append(int fd, void *buf, int size) {
     
     // Before allocating first block (if needed)
     if (bytes_to_first_block > 0) {
-        if (inode->block[start_block] < 0) {  // Only allocate if no block exists
-            int new_block = allocate_data_block();
-            inode->block[start_block] = new_block;
-            
-            if (inode->block[start_block] < 0) {
-                pthread_mutex_unlock(&inodes_mutex);
-                pthread_mutex_unlock(&entry->entry_mutex);
-                return 0;
-            }
+        // Allocate the block if needed, or unshare it before modifying
+        if (get_writable_block(inode, start_block) < 0) {
+            return 0;
         }
         
         // Copy data to the first block
-        void *dst = (char*)data_blocks[inode->block[start_block]] + offset_in_block;
+        void *dst = (char*)fs->data_blocks[(int)inode->block[start_block]] + offset_in_block;
         void *src = buf;
         memcpy(dst, src, bytes_to_first_block);
+        block_written(inode, start_block, offset_in_block + bytes_to_first_block);
         
         // Update file length and bytes left to append
         inode->length += bytes_to_first_block;
@@ -343,20 +1275,17 @@ int RSFS_append(int fd, void *buf, int size) {
             break;
         }
         
-        if (inode->block[start_block] < 0) {  // Only allocate if no block exists
-            int new_block = allocate_data_block();
-            inode->block[start_block] = new_block;
-            
-            if (inode->block[start_block] < 0) {
-                break;
-            }
+        // Allocate the block if needed, or unshare it before modifying
+        if (get_writable_block(inode, start_block) < 0) {
+            break;
         }
         
         // Calculate how many bytes to write to this block
         int bytes_to_block = (bytes_to_append > BLOCK_SIZE) ? BLOCK_SIZE : bytes_to_append;
         
         // Copy data to the block
-        memcpy(data_blocks[inode->block[start_block]], buf, bytes_to_block);
+        memcpy(fs->data_blocks[(int)inode->block[start_block]], buf, bytes_to_block);
+        block_written(inode, start_block, bytes_to_block);
         
         // Update file length and bytes left to append
         inode->length += bytes_to_block;
@@ -367,14 +1296,144 @@ int RSFS_append(int fd, void *buf, int size) {
         buf = (char*)buf + bytes_to_block;
     }
     
-    // Calculate how many bytes were actually appended
-    int bytes_appended = inode->length - original_length;
-    
-    // Update the current position in open file entry
+    // Return how many bytes were actually appended
+    return inode->length - original_length;
+}
+
+
+// flush_write_buffer: Copy the pending bytes of a RSFS_BUFFERED entry into data blocks.
+// Caller must hold entry->entry_mutex; inodes_mutex is taken once for the whole buffer.
+// Returns 0 if everything was flushed, or -1 if some bytes could not be stored: they stay at the front of wb_buf
+// for the next flush, and wb_error is set until one succeeds
+static int flush_write_buffer(struct open_file_entry *entry) {
+    struct rsfs *fs = rsfs_current;
+    if (!entry->buffered || entry->wb_len == 0) {
+        return 0;
+    }
+
+    struct inode *inode = &fs->inodes[entry->inode_number];
+
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    inode_write_begin(inode);
+    int flushed = append_internal(inode, entry->wb_buf, entry->wb_len);
+    inode_write_end(inode);
+    entry->position = inode->length;
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+    if (flushed < entry->wb_len) {
+        memmove(entry->wb_buf, entry->wb_buf + flushed, entry->wb_len - flushed);
+        entry->wb_len -= flushed;
+        entry->wb_error = 1;
+        return -1;
+    }
+    entry->wb_len = 0;
+    entry->wb_error = 0;
+    return 0;
+}
+
+
+// append_locked: Append size bytes of buf to the file of entry, bypassing its write-back buffer,
+// and move its position to the new end. Caller holds entry->entry_mutex and inodes_mutex.
+// Returns number of bytes actually appended
+static int append_locked(struct open_file_entry *entry, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    struct inode *inode = &fs->inodes[entry->inode_number];
+
+    inode_write_begin(inode);
+    int bytes_appended = append_internal(inode, buf, size);
+    inode_write_end(inode);
+
     entry->position = inode->length;
+    return bytes_appended;
+}
+
+
+// RSFS_append: Append data from buf to the end of the file.
+// Locks the open file entry and inode during update. Allocates data blocks as needed.
+// In RSFS_BUFFERED mode the data is only copied into the fd's write-back buffer,
+// and block allocation is delayed until the buffer fills up, or RSFS_fsync/RSFS_close. Bytes a flush could
+// not store stay buffered; until a retried flush stores them, appends accept nothing and fail with ENOSPC.
+// Returns number of bytes successfully appended
+//append the content in buf to the end of the file of descriptor fd
+//return the number of bytes actually appended to the file
+static int rsfs_append(int fd, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    // Check the sanity of the arguments
+    if (fd < 0 || fd >= NUM_OPEN_FILE || size <= 0) {
+        rsfs_error(fd < 0 || fd >= NUM_OPEN_FILE ? EBADF : EINVAL, "[RSFS_append] invalid fd or size\n");
+        return 0;
+    }
+    
+    // Get the open file entry corresponding to fd
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    
+    // Lock the entry mutex to ensure exclusive access
+    rsfs_mutex_lock(&entry->entry_mutex);
+    
+    if (!entry->used) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EBADF, "[RSFS_append] file descriptor not in use\n");
+        return 0;
+    }
+    
+    
+    // Check if the file is opened with RSFS_RDWR mode
+    if (entry->access_flag == RSFS_RDONLY) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EBADF, "[RSFS_append] file not open for writing\n");
+        return 0;
+    }
+    
+    
+    // Get the inode
+    int inode_number = entry->inode_number;
+    struct inode *inode = &fs->inodes[inode_number];
+
+    // Buffered mode: stage the bytes in wb_buf, flushing whenever it fills up
+    if (entry->buffered) {
+        // Bytes an earlier flush could not store come first; while they cannot be stored, nothing is accepted
+        if (entry->wb_error && flush_write_buffer(entry) < 0) {
+            pthread_mutex_unlock(&entry->entry_mutex);
+            rsfs_error(ENOSPC, "[RSFS_append] fail to allocate data blocks for buffered bytes\n");
+            return 0;
+        }
+
+        int bytes_buffered = 0;
+        while (bytes_buffered < size) {
+            if (entry->wb_len == 0) {
+                // Starting a new batch: learn where it will land in the file
+                metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+                entry->position = inode->length;
+                metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+            }
+
+            // Never accept more than the file can eventually hold
+            int room = MAX_FILE_SIZE - entry->position - entry->wb_len;
+            if (room <= 0) break;
+            if (room > WB_BUFFER_SIZE - entry->wb_len) room = WB_BUFFER_SIZE - entry->wb_len;
+
+            int chunk = (size - bytes_buffered > room) ? room : (size - bytes_buffered);
+            memcpy(entry->wb_buf + entry->wb_len, (char*)buf + bytes_buffered, chunk);
+            entry->wb_len += chunk;
+            bytes_buffered += chunk;
+
+            // Threshold reached: allocate and copy the whole buffer at once
+            if (entry->wb_len == WB_BUFFER_SIZE && flush_write_buffer(entry) < 0) {
+                break;
+            }
+        }
+
+        pthread_mutex_unlock(&entry->entry_mutex);
+        return bytes_buffered;
+    }
+    
+    // Lock the inode mutex to ensure exclusive access
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    
+    int bytes_appended = append_locked(entry, buf, size);
     
     // Unlock the mutexes
-    pthread_mutex_unlock(&inodes_mutex);
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
     pthread_mutex_unlock(&entry->entry_mutex);
     
     // Return the number of bytes appended to the file
@@ -382,56 +1441,61 @@ int RSFS_append(int fd, void *buf, int size) {
 }
 
 
-
-
-
-// RSFS_fseek: Update the file's current position (like lseek).
-// If offset is valid, update position. Otherwise, leave position unchanged.
-// Returns the new position or -1 on error.
-int RSFS_fseek(int fd, int offset) {
-    // Sanity test of fd
+// RSFS_fsync: Flush the write-back buffer of a RSFS_BUFFERED fd into data blocks.
+// Returns 0 on success (also when nothing is buffered), or -1 on error; bytes that could not be stored
+// stay buffered, so RSFS_fsync can be retried once blocks are freed.
+static int rsfs_fsync(int fd) {
+    struct rsfs *fs = rsfs_current;
     if (fd < 0 || fd >= NUM_OPEN_FILE) {
-        printf("[RSFS_fseek] invalid fd: %d\n", fd);
+        rsfs_error(EBADF, "[RSFS_fsync] invalid fd: %d\n", fd);
         return -1;
     }
-    
-    // Get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
-    
-    // Lock the entry mutex to ensure exclusive access
-    pthread_mutex_lock(&entry->entry_mutex);
-    
-    // Check if the file entry is in use
+
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    rsfs_mutex_lock(&entry->entry_mutex);
+
     if (!entry->used) {
-        printf("[RSFS_fseek] file descriptor not in use\n");
+        rsfs_error(EBADF, "[RSFS_fsync] file descriptor not in use\n");
         pthread_mutex_unlock(&entry->entry_mutex);
         return -1;
     }
-    
+
+    int ret = flush_write_buffer(entry);
+    if (ret < 0) {
+        rsfs_error(ENOSPC, "[RSFS_fsync] fail to allocate data blocks for buffered bytes\n");
+    }
+
+    pthread_mutex_unlock(&entry->entry_mutex);
+    return ret;
+}
+
+
+
+
+
+// seek_locked: Move the position of entry to offset if it lies within 0...length.
+// Caller holds entry->entry_mutex and has flushed the entry's write-back buffer.
+// Returns the new position, the unchanged one if offset is invalid, or -1 on error
+static int seek_locked(struct open_file_entry *entry, int offset) {
+    struct rsfs *fs = rsfs_current;
     // Get the current position
     int current_pos = entry->position;
     
     // Get the inode and file length
     int inode_number = entry->inode_number;
-    struct inode *inode = &inodes[inode_number];
-    
-    // Lock the inode mutex to ensure exclusive access
-    pthread_mutex_lock(&inodes_mutex);
+    struct inode *inode = &fs->inodes[inode_number];
     
-    int file_length = inode->length;
+    // A single word: no need for inodes_mutex, the length is either the old one or the new one
+    int file_length = __atomic_load_n(&inode->length, __ATOMIC_ACQUIRE);
     
     // Check if argument offset is within 0...length
     if (offset < 0 || offset > file_length) {
-        printf("[RSFS_fseek] offset %d is outside valid range 0...%d\n", offset, file_length);
-        pthread_mutex_unlock(&inodes_mutex);
-        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EINVAL, "[RSFS_fseek] offset %d is outside valid range 0...%d\n", offset, file_length);
         return current_pos; // Return current position without updating
     }
     
     if (inode_number < 0 || inode_number >= NUM_INODES) {
-        printf("[RSFS_fseek] invalid inode number: %d\n", inode_number);
-        pthread_mutex_unlock(&inodes_mutex);
-        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EIO, "[RSFS_fseek] invalid inode number: %d\n", inode_number);
         return -1;
     }
     
@@ -439,49 +1503,121 @@ int RSFS_fseek(int fd, int offset) {
     entry->position = offset;
     current_pos = offset;
     
-    // Unlock mutexes
-    pthread_mutex_unlock(&inodes_mutex);
-    pthread_mutex_unlock(&entry->entry_mutex);
-    
-    // Return the new current position
     return current_pos;
 }
 
 
-
-
-
-
-// RSFS_read: Read data from the file starting at its current position.
-// Reads up to `size` bytes or until end of file. Updates file position.
-// Returns number of bytes read or -1 on error.
-int RSFS_read(int fd, void *buf, int size) {
-    if (fd < 0 || fd >= NUM_OPEN_FILE || size < 0) {
+// RSFS_fseek: Update the file's current position (like lseek).
+// If offset is valid, update position. Otherwise, leave position unchanged.
+// Returns the new position or -1 on error.
+static int rsfs_fseek(int fd, int offset) {
+    struct rsfs *fs = rsfs_current;
+    // Sanity test of fd
+    if (fd < 0 || fd >= NUM_OPEN_FILE) {
+        rsfs_error(EBADF, "[RSFS_fseek] invalid fd: %d\n", fd);
         return -1;
     }
     
-    struct open_file_entry *entry = &open_file_table[fd];
-    pthread_mutex_lock(&entry->entry_mutex);
+    // Get the corresponding open file entry
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    
+    // Lock the entry mutex to ensure exclusive access
+    rsfs_mutex_lock(&entry->entry_mutex);
     
+    // Check if the file entry is in use
     if (!entry->used) {
+        rsfs_error(EBADF, "[RSFS_fseek] file descriptor not in use\n");
         pthread_mutex_unlock(&entry->entry_mutex);
         return -1;
     }
     
-    if (entry->access_flag != RSFS_RDONLY && entry->access_flag != RSFS_RDWR) {
+    // Pending appends must land before the file length is checked
+    if (flush_write_buffer(entry) < 0) {
         pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(ENOSPC, "[RSFS_fseek] fail to allocate data blocks for buffered bytes\n");
         return -1;
     }
+
+    int current_pos = seek_locked(entry, offset);
     
-    int current_pos = entry->position;
-    int inode_number = entry->inode_number;
-    struct inode *inode = &inodes[inode_number];
-    
-    pthread_mutex_lock(&inodes_mutex);
+    // Unlock mutexes
+    pthread_mutex_unlock(&entry->entry_mutex);
     
-    if (current_pos >= inode->length) {
-        pthread_mutex_unlock(&inodes_mutex);
-        pthread_mutex_unlock(&entry->entry_mutex);
+    // Return the new current position
+    return current_pos;
+}
+
+
+
+
+
+
+// read_optimistic: Copy up to size bytes from position pos of the file into buf without inodes_mutex,
+// validated by the inode's sequence counter (see inode_write_begin): the length and the block pointers are
+// read into locals and bounds-checked, so that a copy racing a writer is merely wrong, never out of range,
+// and is then thrown away. Returns the number of bytes read, -1 if a writer interfered (try again),
+// or -2 if the file needs the locked path (compressed content, or blocks to verify against their checksums)
+static int read_optimistic(struct inode *inode, int pos, char *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    if (__atomic_load_n(&fs->checksum_verify, __ATOMIC_RELAXED) || __atomic_load_n(&inode->compressed, __ATOMIC_RELAXED)) {
+        return -2;
+    }
+
+    unsigned int seq = __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+        return -1;
+    }
+
+    int length = __atomic_load_n(&inode->length, __ATOMIC_RELAXED);
+    char is_inline = __atomic_load_n(&inode->is_inline, __ATOMIC_RELAXED);
+    char pointers[INLINE_DATA_SIZE]; // block[] or, for an inline file, the content itself
+    memcpy(pointers, inode->inline_data, INLINE_DATA_SIZE);
+
+    int n = (pos + size > length) ? (length - pos) : size;
+    if (n < 0) n = 0; // at or past the end of the file
+    if (length > (is_inline ? INLINE_DATA_SIZE : MAX_FILE_SIZE)) {
+        n = -1; // torn by a writer
+    } else if (is_inline) {
+        memcpy(buf, pointers + pos, n);
+    } else {
+        int copied = 0;
+        int i = pos / BLOCK_SIZE;
+        int offset_in_block = pos % BLOCK_SIZE;
+        while (copied < n && i < NUM_POINTERS && pointers[i] >= 0 && pointers[i] < NUM_DBLOCKS) {
+            // A run of adjacent blocks is copied at once
+            int run = 1;
+            while (i + run < NUM_POINTERS && pointers[i + run] == pointers[i] + run
+                   && run * BLOCK_SIZE - offset_in_block < n - copied) {
+                run++;
+            }
+            int chunk = run * BLOCK_SIZE - offset_in_block;
+            if (chunk > n - copied) chunk = n - copied;
+
+            memcpy(buf + copied, fs->data_blocks[(int)pointers[i]] + offset_in_block, chunk);
+            copied += chunk;
+            offset_in_block = 0;
+            i += run;
+        }
+        n = copied;
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); // the copy is done before seq is checked again
+    if (__atomic_load_n(&inode->seq, __ATOMIC_RELAXED) != seq) {
+        return -1;
+    }
+    return n;
+}
+
+
+// read_locked: Read up to size bytes of the file of entry from its position, and advance the position.
+// Caller holds entry->entry_mutex and inodes_mutex, and has flushed the entry's write-back buffer.
+// Returns number of bytes read or -1 on error
+static int read_locked(struct open_file_entry *entry, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    int current_pos = entry->position;
+    struct inode *inode = &fs->inodes[entry->inode_number];
+
+    if (current_pos >= inode->length) {
         return 0;
     }
     
@@ -489,8 +1625,46 @@ int RSFS_read(int fd, void *buf, int size) {
                          (inode->length - current_pos) : size;
     int bytes_read = 0;
     
+    // Inline file: the content is right in the inode
+    if (inode->is_inline) {
+        memcpy(buf, inode->inline_data + current_pos, bytes_to_read);
+        entry->position += bytes_to_read;
+        return bytes_to_read;
+    }
+
+    // Compressed file: decompress (or take from the chunk cache) only the chunks covering the range
+    if (inode->compressed) {
+        char chunk[COMPRESS_CHUNK_SIZE];
+        while (bytes_read < bytes_to_read) {
+            int pos = current_pos + bytes_read;
+            int offset_in_chunk = pos % COMPRESS_CHUNK_SIZE;
+            int chunk_len = compressed_chunk(inode, pos / COMPRESS_CHUNK_SIZE, chunk);
+            if (chunk_len < 0) {
+                return -1;
+            }
+
+            int n = chunk_len - offset_in_chunk;
+            if (n > bytes_to_read - bytes_read) n = bytes_to_read - bytes_read;
+            memcpy((char*)buf + bytes_read, chunk + offset_in_chunk, n);
+            bytes_read += n;
+        }
+        entry->position += bytes_read;
+        return bytes_read;
+    }
+
     int start_block = current_pos / BLOCK_SIZE;
     int offset_in_block = current_pos % BLOCK_SIZE;
+
+    // Optionally check the blocks covering the range against their checksums before copying anything
+    if (__atomic_load_n(&fs->checksum_verify, __ATOMIC_RELAXED)) {
+        int last_block = (current_pos + bytes_to_read - 1) / BLOCK_SIZE;
+        for (int i = start_block; i <= last_block && i < NUM_POINTERS; i++) {
+            if (inode->block[i] >= 0 && checksum_check(inode->block[i]) < 0) {
+                rsfs_error(EIO, "[RSFS_read] data block %d of the file is corrupted\n", inode->block[i]);
+                return -1;
+            }
+        }
+    }
     
     // Read from first block
     int bytes_from_first_block = BLOCK_SIZE - offset_in_block;
@@ -500,7 +1674,7 @@ int RSFS_read(int fd, void *buf, int size) {
 
     
     if (inode->block[start_block] >= 0) {  // Check if block exists
-        void *src = (char*)data_blocks[inode->block[start_block]] + offset_in_block;
+        void *src = (char*)fs->data_blocks[(int)inode->block[start_block]] + offset_in_block;
         memcpy(buf, src, bytes_from_first_block);
         bytes_read += bytes_from_first_block;
         bytes_to_read -= bytes_from_first_block;
@@ -510,25 +1684,95 @@ int RSFS_read(int fd, void *buf, int size) {
     start_block++;
     char *dst = (char*)buf + bytes_from_first_block;
     
-    // Read from remaining blocks
+    // Read from remaining blocks; a run of adjacent blocks is copied at once
     while (bytes_to_read > 0 && start_block < NUM_POINTERS) {
         if (inode->block[start_block] < 0) break;  // Stop if we hit an unallocated block
         
-        int bytes_from_block = (bytes_to_read > BLOCK_SIZE) ? 
-                               BLOCK_SIZE : bytes_to_read;
+        int run = 1;
+        while (start_block + run < NUM_POINTERS && run * BLOCK_SIZE < bytes_to_read
+               && inode->block[start_block + run] == inode->block[start_block] + run) {
+            run++;
+        }
+        int bytes_from_run = (bytes_to_read > run * BLOCK_SIZE) ? 
+                             run * BLOCK_SIZE : bytes_to_read;
         
-        void *src = data_blocks[inode->block[start_block]];
-        memcpy(dst, src, bytes_from_block);
+        void *src = fs->data_blocks[(int)inode->block[start_block]];
+        memcpy(dst, src, bytes_from_run);
         
-        bytes_read += bytes_from_block;
-        bytes_to_read -= bytes_from_block;
-        dst += bytes_from_block;
-        start_block++;
+        bytes_read += bytes_from_run;
+        bytes_to_read -= bytes_from_run;
+        dst += bytes_from_run;
+        start_block += run;
     }
     
     entry->position += bytes_read;
+    return bytes_read;
+}
+
+
+// read_lockless: Read at the position of entry with read_optimistic, retrying READ_RETRIES times, and advance it.
+// Caller holds entry->entry_mutex and has flushed the entry's write-back buffer.
+// Returns the number of bytes read, or -1 if the read must take the locked path (read_locked)
+static int read_lockless(struct open_file_entry *entry, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    struct inode *inode = &fs->inodes[entry->inode_number];
+
+    for (int tries = 0; tries < READ_RETRIES; tries++) {
+        int n = read_optimistic(inode, entry->position, buf, size);
+        if (n == -2) break;
+        if (n >= 0) {
+            entry->position += n;
+            return n;
+        }
+    }
+    return -1;
+}
+
+
+// RSFS_read: Read data from the file starting at its current position.
+// Reads up to `size` bytes or until end of file. Updates file position.
+// Returns number of bytes read or -1 on error.
+static int rsfs_read(int fd, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    if (fd < 0 || fd >= NUM_OPEN_FILE || size < 0) {
+        rsfs_error(fd < 0 || fd >= NUM_OPEN_FILE ? EBADF : EINVAL, "[RSFS_read] invalid fd or size\n");
+        return -1;
+    }
+    
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    rsfs_mutex_lock(&entry->entry_mutex);
+    
+    if (!entry->used) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EBADF, "[RSFS_read] file descriptor not in use\n");
+        return -1;
+    }
+    
+    if (entry->access_flag != RSFS_RDONLY && entry->access_flag != RSFS_RDWR) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EIO, "[RSFS_read] invalid access flag: %d\n", entry->access_flag);
+        return -1;
+    }
+    
+    // Read our own buffered appends
+    if (flush_write_buffer(entry) < 0) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(ENOSPC, "[RSFS_read] fail to allocate data blocks for buffered bytes\n");
+        return -1;
+    }
+
+    // Common case: no writer at work, so the copy needs no lock shared with other files' readers
+    int n = read_lockless(entry, buf, size);
+    if (n >= 0) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        return n;
+    }
+    
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
     
-    pthread_mutex_unlock(&inodes_mutex);
+    int bytes_read = read_locked(entry, buf, size);
+    
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
     pthread_mutex_unlock(&entry->entry_mutex);
     
     return bytes_read;
@@ -537,22 +1781,23 @@ int RSFS_read(int fd, void *buf, int size) {
 
 // RSFS_close: Closes the file corresponding to the given file descriptor.
 // Frees the open file table entry. Returns 0 on success, -1 on error.
-int RSFS_close(int fd) {
+static int rsfs_close(int fd) {
+    struct rsfs *fs = rsfs_current;
     // Sanity test of fd
     if (fd < 0 || fd >= NUM_OPEN_FILE) {
-        printf("[RSFS_close] invalid fd: %d\n", fd);
+        rsfs_error(EBADF, "[RSFS_close] invalid fd: %d\n", fd);
         return -1;
     }
     
     // Get the corresponding open file entry
-    struct open_file_entry *entry = &open_file_table[fd];
+    struct open_file_entry *entry = &fs->open_file_table[fd];
     
     // Lock the entry mutex to ensure exclusive access
-    pthread_mutex_lock(&entry->entry_mutex);
+    rsfs_mutex_lock(&entry->entry_mutex);
     
     // Check if the file entry is in use
     if (!entry->used) {
-        printf("[RSFS_close] file descriptor not in use\n");
+        rsfs_error(EBADF, "[RSFS_close] file descriptor not in use\n");
         pthread_mutex_unlock(&entry->entry_mutex);
         return -1;
     }
@@ -560,83 +1805,87 @@ int RSFS_close(int fd) {
     // Get the corresponding inode number
     int inode_number = entry->inode_number;
     if (inode_number < 0 || inode_number >= NUM_INODES) {
-        printf("[RSFS_close] invalid inode number: %d\n", inode_number);
+        rsfs_error(EIO, "[RSFS_close] invalid inode number: %d\n", inode_number);
         pthread_mutex_unlock(&entry->entry_mutex);
         return -1;
     }
     
-    // Get the inode and update reader/writer status
-    struct inode *inode = &inodes[inode_number];
-    pthread_mutex_lock(&inode->rwlock);
-    
+    // Delayed allocation happens at the latest here; bytes that still find no data block are lost with the fd
+    int ret = 0;
+    if (flush_write_buffer(entry) < 0) {
+        rsfs_error(ENOSPC, "[RSFS_close] fail to flush %d buffered bytes, they are dropped\n", entry->wb_len);
+        ret = -1;
+    }
+
     // Update reader/writer status based on access flag
-    if (entry->access_flag == RSFS_RDWR) {
-        inode->writer_active = 0;
-    } else if (entry->access_flag == RSFS_RDONLY) {
-        inode->reader_count--;
-    } else {
-        printf("[RSFS_close] invalid access flag: %d\n", entry->access_flag);
-        pthread_mutex_unlock(&inode->rwlock);
+    if (entry->access_flag != RSFS_RDWR && entry->access_flag != RSFS_RDONLY) {
+        rsfs_error(EIO, "[RSFS_close] invalid access flag: %d\n", entry->access_flag);
         pthread_mutex_unlock(&entry->entry_mutex);
         return -1;
     }
-    
-    // Signal waiting threads that access is available
-    pthread_cond_broadcast(&inode->readers_done);
-    pthread_mutex_unlock(&inode->rwlock);
+    release_access(inode_number, entry->access_flag);
     
     // Release this open file entry in the open file table
-    entry->used = 0;
     entry->inode_number = -1;
     entry->position = 0;
     entry->access_flag = -1;
+    entry->buffered = 0;
+    entry->wb_len = 0;
+    entry->wb_error = 0;
+    free_open_file_entry(fd);
     
     // Unlock the entry mutex
     pthread_mutex_unlock(&entry->entry_mutex);
     
-    return 0;
+    return ret;
 }
 
 
 
-// RSFS_write: Write data to the file starting at its current position.
-// Overwrites existing data from the position and truncates the rest.
-// Returns number of bytes written or -1 on error.
-int RSFS_write(int fd, void *buf, int size) {
-    // Sanity check
-    if (fd < 0 || fd >= NUM_OPEN_FILE || buf == NULL || size <= 0) {
-        printf("[RSFS_write] invalid fd, buf, or size\n");
-        return -1;
-    }
+// write_locked: Write size bytes of buf to the file of entry at its position, which advances; like after
+// RSFS_write, the file then ends after them. Caller holds entry->entry_mutex and inodes_mutex, and has
+// flushed the entry's write-back buffer. Returns number of bytes written or -1 on error
+static int write_locked(struct open_file_entry *entry, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    struct inode *inode = &fs->inodes[entry->inode_number];
+    inode_write_begin(inode);
 
-    struct open_file_entry *entry = &open_file_table[fd];
-    
-    // Lock the entry mutex to ensure exclusive access
-    pthread_mutex_lock(&entry->entry_mutex);
+    int position = entry->position;
+    int file_length = inode->length;
 
-    if (!entry->used || entry->access_flag != RSFS_RDWR) {
-        printf("[RSFS_write] file not open for writing\n");
-        pthread_mutex_unlock(&entry->entry_mutex);
-        return -1;
-    }
+    // Compressed file: recompress from the chunk containing position on
+    if (inode->compressed) {
+        int written = compressed_update(inode, position, buf, size);
+        if (written == -1) {
+            rsfs_error(ENOSPC, "[RSFS_write] fail to allocate data block\n");
+        } else if (written >= 0) {
+            entry->position = position + written;
+        }
 
-    int inode_number = entry->inode_number;
-    if (inode_number < 0 || inode_number >= NUM_INODES) {
-        printf("[RSFS_write] invalid inode number: %d\n", inode_number);
-        pthread_mutex_unlock(&entry->entry_mutex);
-        return -1;
+        inode_write_end(inode);
+        return (written < 0) ? -1 : written;
     }
 
-    // Lock the inode mutex
-    pthread_mutex_lock(&inodes_mutex);
-    struct inode *inode = &inodes[inode_number];
+    // Inline file: overwrite in place if the result still fits, otherwise move it to a block
+    if (inode->is_inline) {
+        if (position + size <= INLINE_DATA_SIZE) {
+            memcpy(inode->inline_data + position, buf, size);
+            inode->length = position + size;
+            entry->position = position + size;
 
-    int position = entry->position;
-    int file_length = inode->length;
+            inode_write_end(inode);
+            return size;
+        }
+        if (migrate_inline_data(inode) < 0) {
+            rsfs_error(ENOSPC, "[RSFS_write] fail to allocate data block\n");
+            inode_write_end(inode);
+            return -1;
+        }
+    }
 
-    // If writing in the middle, free blocks beyond current position
+    // If writing in the middle, free blocks entirely beyond the new end of the file
     if (position < file_length) {
-        int start_block = (position + size) / BLOCK_SIZE;
+        int start_block = (position + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
         for (int i = start_block; i < NUM_POINTERS; i++) {
             if (inode->block[i] >= 0) {
                 free_data_block(inode->block[i]);
@@ -654,27 +1903,33 @@ int RSFS_write(int fd, void *buf, int size) {
     char *cbuf = (char *)buf;
 
     if (buf == NULL) {
-        printf("[RSFS_write] invalid buffer\n");
-        pthread_mutex_unlock(&inodes_mutex);
-        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EINVAL, "[RSFS_write] invalid buffer\n");
+        inode_write_end(inode);
         return -1;
     }
 
-    while (bytes_written < size && start_block < NUM_POINTERS) {
-        // Allocate block if necessary
-        if (inode->block[start_block] < 0) {
-            inode->block[start_block] = allocate_data_block();
-            if (inode->block[start_block] < 0) {
-                printf("[RSFS_write] fail to allocate data block\n");
-                break;
-            }
+    // Block-aligned position: whole runs of blocks at once
+    if (offset_in_block == 0 && size >= BLOCK_SIZE) {
+        bytes_written = write_blocks(inode, start_block, cbuf, size);
+        if (bytes_written < size && start_block + bytes_written / BLOCK_SIZE < NUM_POINTERS) {
+            rsfs_error(ENOSPC, "[RSFS_write] fail to allocate data block\n");
+        }
+        bytes_to_write = 0;
+    }
+
+    while (bytes_to_write > 0 && start_block < NUM_POINTERS) {
+        // Allocate block if necessary, or copy it first if it is shared
+        if (get_writable_block(inode, start_block) < 0) {
+            rsfs_error(ENOSPC, "[RSFS_write] fail to allocate data block\n");
+            break;
         }
 
-        void *dst = (char *)data_blocks[inode->block[start_block]] + offset_in_block;
+        void *dst = (char *)fs->data_blocks[(int)inode->block[start_block]] + offset_in_block;
         int writable = BLOCK_SIZE - offset_in_block;
         int chunk = (bytes_to_write < writable) ? bytes_to_write : writable;
 
         memcpy(dst, cbuf, chunk);
+        block_written(inode, start_block, offset_in_block + chunk);
 
         bytes_written += chunk;
         bytes_to_write -= chunk;
@@ -684,12 +1939,584 @@ int RSFS_write(int fd, void *buf, int size) {
         offset_in_block = 0; // after first block, always 0 offset
     }
 
+    // Out of data blocks partway: blocks past the shorter end (old ones not overwritten, or ones allocated
+    // before the failure) must not stay attached beyond the file length
+    if (bytes_written < size) {
+        for (int i = (position + bytes_written + BLOCK_SIZE - 1) / BLOCK_SIZE; i < NUM_POINTERS; i++) {
+            if (inode->block[i] >= 0) {
+                free_data_block(inode->block[i]);
+                inode->block[i] = -1;
+            }
+        }
+    }
+
     // Update inode length and open file entry position
     inode->length = position + bytes_written;
     entry->position = position + bytes_written;
 
-    pthread_mutex_unlock(&inodes_mutex);
+    inode_write_end(inode);
+    return bytes_written;
+}
+
+
+// RSFS_write: Write data to the file starting at its current position.
+// Overwrites existing data from the position and truncates the rest.
+// Returns number of bytes written or -1 on error.
+static int rsfs_write(int fd, void *buf, int size) {
+    struct rsfs *fs = rsfs_current;
+    // Sanity check
+    if (fd < 0 || fd >= NUM_OPEN_FILE || buf == NULL || size <= 0) {
+        rsfs_error(EINVAL, "[RSFS_write] invalid fd, buf, or size\n");
+        return -1;
+    }
+
+    struct open_file_entry *entry = &fs->open_file_table[fd];
+    
+    // Lock the entry mutex to ensure exclusive access
+    rsfs_mutex_lock(&entry->entry_mutex);
+
+    if (!entry->used || entry->access_flag != RSFS_RDWR) {
+        rsfs_error(EBADF, "[RSFS_write] file not open for writing\n");
+        pthread_mutex_unlock(&entry->entry_mutex);
+        return -1;
+    }
+
+    int inode_number = entry->inode_number;
+    if (inode_number < 0 || inode_number >= NUM_INODES) {
+        rsfs_error(EIO, "[RSFS_write] invalid inode number: %d\n", inode_number);
+        pthread_mutex_unlock(&entry->entry_mutex);
+        return -1;
+    }
+
+    // Buffered appends go first so the write sees the real file length
+    if (flush_write_buffer(entry) < 0) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(ENOSPC, "[RSFS_write] fail to allocate data blocks for buffered bytes\n");
+        return -1;
+    }
+
+    // Lock the inode mutex
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+    int bytes_written = write_locked(entry, buf, size);
+
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
     pthread_mutex_unlock(&entry->entry_mutex);
 
     return bytes_written;
 }
+
+
+
+// read_content: Copy n bytes at position off of the file into buf, whatever its storage
+// (inline, compressed or raw blocks). The range lies within the file. Caller holds inodes_mutex.
+// Returns 0, or -1 (EIO) if a compressed chunk of the range is corrupted
+static int read_content(struct inode *inode, int off, char *buf, int n) {
+    if (inode->is_inline) {
+        memcpy(buf, inode->inline_data + off, n);
+    } else if (inode->compressed) {
+        char chunk[COMPRESS_CHUNK_SIZE];
+        for (int done = 0; done < n; ) {
+            int pos = off + done;
+            int offset_in_chunk = pos % COMPRESS_CHUNK_SIZE;
+            int len = compressed_chunk(inode, pos / COMPRESS_CHUNK_SIZE, chunk);
+            if (len < 0) {
+                return -1;
+            }
+            len -= offset_in_chunk;
+            if (len > n - done) len = n - done;
+            memcpy(buf + done, chunk + offset_in_chunk, len);
+            done += len;
+        }
+    } else {
+        stream_read(inode, off, buf, n);
+    }
+    return 0;
+}
+
+
+// copy_blocks: Copy n bytes at off_in of src to off_out of dst, straight from data block to data block.
+// A destination block covered entirely by a source block (both offsets at a block boundary) is not copied:
+// dst shares src's block, copy-on-write. src and dst are distinct raw files (neither inline nor compressed),
+// and dst has no hole before off_out. Caller holds inodes_mutex.
+// Returns the number of bytes copied (short if no data block is available)
+static int copy_blocks(struct inode *dst, int off_out, struct inode *src, int off_in, int n) {
+    struct rsfs *fs = rsfs_current;
+    int copied = 0;
+    while (copied < n) {
+        int in = off_in + copied;
+        int out = off_out + copied;
+        int i = out / BLOCK_SIZE;
+        int offset_in_block = out % BLOCK_SIZE;
+        int chunk = BLOCK_SIZE - offset_in_block;
+        if (chunk > n - copied) chunk = n - copied;
+
+        int src_block = src->block[in / BLOCK_SIZE];
+        int src_offset = in % BLOCK_SIZE;
+
+        if (offset_in_block == 0 && src_offset == 0 && chunk == BLOCK_SIZE) {
+            if (dst->block[i] != src_block) { // not shared already
+                ref_data_block(src_block);
+                if (dst->block[i] >= 0) {
+                    free_data_block(dst->block[i]);
+                }
+                dst->block[i] = src_block;
+            }
+        } else {
+            if (get_writable_block(dst, i) < 0) {
+                break;
+            }
+            // The chunk may straddle two source blocks
+            char *to = fs->data_blocks[(int)dst->block[i]] + offset_in_block;
+            int first = BLOCK_SIZE - src_offset;
+            if (first > chunk) first = chunk;
+            memcpy(to, fs->data_blocks[src_block] + src_offset, first);
+            if (first < chunk) {
+                memcpy(to + first, fs->data_blocks[(int)src->block[in / BLOCK_SIZE + 1]], chunk - first);
+            }
+            block_written(dst, i, offset_in_block + chunk);
+        }
+        copied += chunk;
+    }
+    return copied;
+}
+
+
+// copy_internal: Copy n bytes at off_in of src to off_out of dst; like after RSFS_write, dst then ends
+// at off_out+n. Between two raw files the bytes go block to block (copy_blocks); otherwise, and within
+// a single file, they go through a bounce buffer. Caller holds inodes_mutex.
+// Returns the number of bytes copied, -1 if no data block is available, or -2 if a compressed chunk is
+// corrupted (EIO); dst is left unchanged in that case
+static int copy_internal(struct inode *dst, int off_out, struct inode *src, int off_in, int n) {
+    char tmp[MAX_FILE_SIZE];
+
+    // Content that has to go through the bounce buffer is read (and checked) before dst is touched
+    int bounced = (dst->compressed || dst->is_inline || src == dst || src->is_inline || src->compressed);
+    if (bounced && read_content(src, off_in, tmp, n) < 0) {
+        return -2;
+    }
+
+    if (dst->compressed) {
+        return compressed_update(dst, off_out, tmp, n);
+    }
+
+    if (dst->is_inline) {
+        if (off_out + n <= INLINE_DATA_SIZE) {
+            memcpy(dst->inline_data + off_out, tmp, n);
+            dst->length = off_out + n;
+            return n;
+        }
+        if (migrate_inline_data(dst) < 0) {
+            return -1;
+        }
+    }
+
+    int copied;
+    if (src == dst || src->is_inline || src->compressed) {
+        copied = stream_write(dst, off_out, tmp, n);
+    } else {
+        copied = copy_blocks(dst, off_out, src, off_in, n);
+    }
+
+    // Release the blocks past the new end of the file
+    for (int i = (off_out + copied + BLOCK_SIZE - 1) / BLOCK_SIZE; i < NUM_POINTERS; i++) {
+        if (dst->block[i] >= 0) {
+            free_data_block(dst->block[i]);
+            dst->block[i] = -1;
+        }
+    }
+    dst->length = off_out + copied;
+
+    return copied;
+}
+
+
+// RSFS_copy_range: Copy len bytes at off_in of the file of fd_in to off_out of the file of fd_out
+// without a user buffer (see copy_internal); the file of fd_out then ends after the copied bytes, like after
+// RSFS_write. The positions of both fds are left unchanged. The entries are locked in fd order, then
+// inodes_mutex (which guards both inodes), so that concurrent copies in opposite directions cannot deadlock.
+// Returns the number of bytes copied (short at the end of the source or at MAX_FILE_SIZE), or -1 on error
+static int rsfs_copy_range(int fd_in, int off_in, int fd_out, int off_out, int len) {
+    struct rsfs *fs = rsfs_current;
+    if (fd_in < 0 || fd_in >= NUM_OPEN_FILE || fd_out < 0 || fd_out >= NUM_OPEN_FILE) {
+        rsfs_error(EBADF, "[RSFS_copy_range] invalid fd: %d or %d\n", fd_in, fd_out);
+        return -1;
+    }
+    if (off_in < 0 || off_out < 0 || len < 0) {
+        rsfs_error(EINVAL, "[RSFS_copy_range] invalid offset or length\n");
+        return -1;
+    }
+
+    struct open_file_entry *in = &fs->open_file_table[fd_in];
+    struct open_file_entry *out = &fs->open_file_table[fd_out];
+    struct open_file_entry *first = (fd_in < fd_out) ? in : out;
+    struct open_file_entry *second = (fd_in < fd_out) ? out : in;
+    rsfs_mutex_lock(&first->entry_mutex);
+    if (second != first) rsfs_mutex_lock(&second->entry_mutex);
+
+    if (!in->used || !out->used || out->access_flag != RSFS_RDWR) {
+        rsfs_error(EBADF, "[RSFS_copy_range] file descriptor not in use or not open for writing\n");
+        if (second != first) pthread_mutex_unlock(&second->entry_mutex);
+        pthread_mutex_unlock(&first->entry_mutex);
+        return -1;
+    }
+
+    // Buffered appends of either fd belong to the files being copied
+    if (flush_write_buffer(in) < 0 || flush_write_buffer(out) < 0) {
+        rsfs_error(ENOSPC, "[RSFS_copy_range] fail to allocate data blocks for buffered bytes\n");
+        if (second != first) pthread_mutex_unlock(&second->entry_mutex);
+        pthread_mutex_unlock(&first->entry_mutex);
+        return -1;
+    }
+
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    struct inode *src = &fs->inodes[in->inode_number];
+    struct inode *dst = &fs->inodes[out->inode_number];
+
+    int n = (off_in >= src->length) ? 0 : src->length - off_in;
+    if (n > len) n = len;
+    if (n > MAX_FILE_SIZE - off_out) n = MAX_FILE_SIZE - off_out;
+
+    int ret = 0;
+    if (off_out > dst->length) {
+        rsfs_error(EINVAL, "[RSFS_copy_range] offset %d is past the end of the destination (%d)\n", off_out, dst->length);
+        ret = -1;
+    } else if (n > 0) {
+        inode_write_begin(dst);
+        ret = copy_internal(dst, off_out, src, off_in, n);
+        inode_write_end(dst);
+        if (ret == -1) {
+            rsfs_error(ENOSPC, "[RSFS_copy_range] fail to allocate data block\n");
+        }
+        if (ret < 0) ret = -1;
+    }
+
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    if (second != first) pthread_mutex_unlock(&second->entry_mutex);
+    pthread_mutex_unlock(&first->entry_mutex);
+    return ret;
+}
+
+
+
+// run_batch_ops: Run n consecutive data operations of a batch (read, write, append, fseek) on fd, validating the
+// fd and taking its entry_mutex and (unless every read goes lock-free) inodes_mutex once for all of them;
+// each op gets the result of the equivalent call
+static void run_batch_ops(int fd, struct rsfs_batch_op *ops, int n) {
+    struct rsfs *fs = rsfs_current;
+    struct open_file_entry *entry = &fs->open_file_table[fd < 0 || fd >= NUM_OPEN_FILE ? 0 : fd];
+
+    if (fd >= 0 && fd < NUM_OPEN_FILE) rsfs_mutex_lock(&entry->entry_mutex);
+    if (fd < 0 || fd >= NUM_OPEN_FILE || !entry->used) {
+        if (fd >= 0 && fd < NUM_OPEN_FILE) pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(EBADF, "[RSFS_submit_batch] invalid fd: %d\n", fd);
+        for (int i = 0; i < n; i++) {
+            ops[i].result = (ops[i].op == RSFS_BATCH_APPEND) ? 0 : -1;
+        }
+        return;
+    }
+
+    // Pending appends land first; appends of the batch then go straight to the file
+    if (flush_write_buffer(entry) < 0) {
+        pthread_mutex_unlock(&entry->entry_mutex);
+        rsfs_error(ENOSPC, "[RSFS_submit_batch] fail to allocate data blocks for buffered bytes\n");
+        for (int i = 0; i < n; i++) {
+            ops[i].result = (ops[i].op == RSFS_BATCH_APPEND) ? 0 : -1;
+        }
+        return;
+    }
+
+    // inodes_mutex is taken by the first op needing it, and kept for the rest of the run
+    int locked = 0;
+    for (int i = 0; i < n; i++) {
+        struct rsfs_batch_op *op = &ops[i];
+        int writing = (op->op == RSFS_BATCH_WRITE || op->op == RSFS_BATCH_APPEND);
+
+        if (op->op == RSFS_BATCH_READ && !locked && op->size >= 0
+            && (op->result = read_lockless(entry, op->buf, op->size)) >= 0) {
+            continue;
+        }
+        if (op->op != RSFS_BATCH_FSEEK && !locked) {
+            metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+            locked = 1;
+        }
+
+        if (writing && entry->access_flag != RSFS_RDWR) {
+            rsfs_error(EBADF, "[RSFS_submit_batch] file not open for writing\n");
+            op->result = (op->op == RSFS_BATCH_APPEND) ? 0 : -1;
+        } else if ((writing && (op->buf == NULL || op->size <= 0)) || (op->op == RSFS_BATCH_READ && op->size < 0)) {
+            rsfs_error(EINVAL, "[RSFS_submit_batch] invalid buf or size\n");
+            op->result = (op->op == RSFS_BATCH_APPEND) ? 0 : -1;
+        } else if (op->op == RSFS_BATCH_READ) {
+            op->result = read_locked(entry, op->buf, op->size);
+        } else if (op->op == RSFS_BATCH_WRITE) {
+            op->result = write_locked(entry, op->buf, op->size);
+        } else if (op->op == RSFS_BATCH_APPEND) {
+            op->result = append_locked(entry, op->buf, op->size);
+        } else {
+            op->result = seek_locked(entry, op->offset);
+        }
+    }
+
+    if (locked) metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    pthread_mutex_unlock(&entry->entry_mutex);
+}
+
+
+// RSFS_submit_batch: Run n operations in order, as the equivalent RSFS_* calls would, setting the result of each.
+// An op whose fd is RSFS_BATCH_FD works on the fd of the batch's latest RSFS_BATCH_OPEN (and fails with EBADF
+// if that open failed), so that open, fseek, read, close is one batch. Consecutive reads, writes, appends and
+// fseeks on one fd form a run that is validated and locked once (see run_batch_ops).
+// Returns the number of operations that succeeded (a non-negative result; a positive one for an append)
+static int rsfs_submit_batch(struct rsfs_batch_op *ops, int n) {
+    if (ops == NULL || n < 0) {
+        rsfs_error(EINVAL, "[RSFS_submit_batch] invalid batch\n");
+        return -1;
+    }
+
+    int chained_fd = -1;
+    int i = 0;
+    while (i < n) {
+        struct rsfs_batch_op *op = &ops[i];
+        int fd = (op->fd == RSFS_BATCH_FD) ? chained_fd : op->fd;
+
+        if (op->op == RSFS_BATCH_OPEN) {
+            op->result = rsfs_open(op->file_name, op->access_flag);
+            chained_fd = op->result;
+            i++;
+        } else if (op->op == RSFS_BATCH_CLOSE) {
+            op->result = rsfs_close(fd);
+            i++;
+        } else if (op->op >= RSFS_BATCH_READ && op->op <= RSFS_BATCH_FSEEK) {
+            int end = i + 1;
+            while (end < n && ops[end].op >= RSFS_BATCH_READ && ops[end].op <= RSFS_BATCH_FSEEK
+                   && ((ops[end].fd == RSFS_BATCH_FD) ? chained_fd : ops[end].fd) == fd) {
+                end++;
+            }
+            run_batch_ops(fd, op, end - i);
+            i = end;
+        } else {
+            rsfs_error(EINVAL, "[RSFS_submit_batch] invalid operation: %d\n", op->op);
+            op->result = -1;
+            i++;
+        }
+    }
+
+    int succeeded = 0;
+    for (i = 0; i < n; i++) {
+        succeeded += (ops[i].op == RSFS_BATCH_APPEND) ? (ops[i].result > 0) : (ops[i].result >= 0);
+    }
+    return succeeded;
+}
+
+
+
+
+//------ instrumented entry points: every RSFS_* call is timed and counted (see metrics.c), ------
+//------ and the file operations are recorded while a trace is running (see trace.c; path-based calls are not) ------
+
+int RSFS_create(char file_name){
+    uint64_t start = metrics_start(METRIC_OP_CREATE);
+    uint64_t trace = trace_start();
+    int ret = rsfs_create(file_name);
+    metrics_record(METRIC_OP_CREATE, start, 0);
+    trace_record(METRIC_OP_CREATE, trace, file_name, -1, 0, ret);
+    return ret;
+}
+
+int RSFS_delete(char file_name){
+    uint64_t start = metrics_start(METRIC_OP_DELETE);
+    uint64_t trace = trace_start();
+    int ret = rsfs_delete(file_name);
+    metrics_record(METRIC_OP_DELETE, start, 0);
+    trace_record(METRIC_OP_DELETE, trace, file_name, -1, 0, ret);
+    return ret;
+}
+
+int RSFS_clone(char src_name, char dst_name){
+    uint64_t start = metrics_start(METRIC_OP_CLONE);
+    int ret = rsfs_clone(src_name, dst_name);
+    metrics_record(METRIC_OP_CLONE, start, 0);
+    return ret;
+}
+
+int RSFS_copy_range(int fd_in, int off_in, int fd_out, int off_out, int len){
+    uint64_t start = metrics_start(METRIC_OP_COPY_RANGE);
+    int ret = rsfs_copy_range(fd_in, off_in, fd_out, off_out, len);
+    metrics_record(METRIC_OP_COPY_RANGE, start, ret);
+    return ret;
+}
+
+int RSFS_submit_batch(struct rsfs_batch_op *ops, int n){
+    uint64_t start = metrics_start(METRIC_OP_SUBMIT_BATCH);
+    int ret = rsfs_submit_batch(ops, n);
+    int bytes = 0;
+    for(int i=0; i<n && ret>=0; i++){
+        int data = (ops[i].op==RSFS_BATCH_READ || ops[i].op==RSFS_BATCH_WRITE || ops[i].op==RSFS_BATCH_APPEND);
+        if(data && ops[i].result>0) bytes += ops[i].result;
+    }
+    metrics_record(METRIC_OP_SUBMIT_BATCH, start, bytes);
+    return ret;
+}
+
+int RSFS_snapshot(){
+    uint64_t start = metrics_start(METRIC_OP_SNAPSHOT);
+    int ret = rsfs_snapshot();
+    metrics_record(METRIC_OP_SNAPSHOT, start, 0);
+    return ret;
+}
+
+int RSFS_restore(int snapshot_id){
+    uint64_t start = metrics_start(METRIC_OP_RESTORE);
+    int ret = rsfs_restore(snapshot_id);
+    metrics_record(METRIC_OP_RESTORE, start, 0);
+    return ret;
+}
+
+int RSFS_delete_snapshot(int snapshot_id){
+    uint64_t start = metrics_start(METRIC_OP_DELETE_SNAPSHOT);
+    int ret = rsfs_delete_snapshot(snapshot_id);
+    metrics_record(METRIC_OP_DELETE_SNAPSHOT, start, 0);
+    return ret;
+}
+
+int RSFS_create_many(const char *names, int n, int *results){
+    uint64_t start = metrics_start(METRIC_OP_CREATE_MANY);
+    int ret = rsfs_create_many(names, n, results);
+    metrics_record(METRIC_OP_CREATE_MANY, start, 0);
+    return ret;
+}
+int RSFS_delete_many(const char *names, int n, int *results){
+    uint64_t start = metrics_start(METRIC_OP_DELETE_MANY);
+    int ret = rsfs_delete_many(names, n, results);
+    metrics_record(METRIC_OP_DELETE_MANY, start, 0);
+    return ret;
+}
+int RSFS_mkdir(const char *path){
+    uint64_t start = metrics_start(METRIC_OP_MKDIR);
+    int ret = create_path(path, 1);
+    metrics_record(METRIC_OP_MKDIR, start, 0);
+    return ret;
+}
+int RSFS_rmdir(const char *path){
+    uint64_t start = metrics_start(METRIC_OP_RMDIR);
+    int ret = delete_path(path, 1);
+    metrics_record(METRIC_OP_RMDIR, start, 0);
+    return ret;
+}
+int RSFS_readdir_plus(const char *path, int *cursor, struct rsfs_dirent *ents, int max){
+    uint64_t start = metrics_start(METRIC_OP_READDIR_PLUS);
+    int ret = rsfs_readdir_plus(path, cursor, ents, max);
+    metrics_record(METRIC_OP_READDIR_PLUS, start, 0);
+    return ret;
+}
+
+int RSFS_readdir(const char *path, char *names, int max){
+    uint64_t start = metrics_start(METRIC_OP_READDIR);
+    int ret = rsfs_readdir(path, names, max);
+    metrics_record(METRIC_OP_READDIR, start, 0);
+    return ret;
+}
+int RSFS_create_path(const char *path){
+    uint64_t start = metrics_start(METRIC_OP_CREATE);
+    int ret = create_path(path, 0);
+    metrics_record(METRIC_OP_CREATE, start, 0);
+    return ret;
+}
+int RSFS_open_path(const char *path, int access_flag){
+    uint64_t start = metrics_start(METRIC_OP_OPEN);
+    int ret = open_path(path, access_flag);
+    metrics_record(METRIC_OP_OPEN, start, 0);
+    return ret;
+}
+int RSFS_delete_path(const char *path){
+    uint64_t start = metrics_start(METRIC_OP_DELETE);
+    int ret = delete_path(path, 0);
+    metrics_record(METRIC_OP_DELETE, start, 0);
+    return ret;
+}
+void RSFS_stat(){
+    uint64_t start = metrics_start(METRIC_OP_STAT);
+    rsfs_stat();
+    metrics_record(METRIC_OP_STAT, start, 0);
+}
+int RSFS_statfs(struct rsfs_statfs *st){
+    uint64_t start = metrics_start(METRIC_OP_STATFS);
+    int ret = rsfs_statfs(st);
+    metrics_record(METRIC_OP_STATFS, start, 0);
+    return ret;
+}
+int RSFS_fstat(int fd, struct rsfs_fstat *st){
+    uint64_t start = metrics_start(METRIC_OP_FSTAT);
+    int ret = rsfs_fstat(fd, st);
+    metrics_record(METRIC_OP_FSTAT, start, 0);
+    return ret;
+}
+
+int RSFS_set_compressed(int fd, int enable){
+    uint64_t start = metrics_start(METRIC_OP_SET_COMPRESSED);
+    int ret = rsfs_set_compressed(fd, enable);
+    metrics_record(METRIC_OP_SET_COMPRESSED, start, 0);
+    return ret;
+}
+
+int RSFS_open(char file_name, int access_flag){
+    uint64_t start = metrics_start(METRIC_OP_OPEN);
+    uint64_t trace = trace_start();
+    int ret = rsfs_open(file_name, access_flag);
+    metrics_record(METRIC_OP_OPEN, start, 0);
+    trace_record(METRIC_OP_OPEN, trace, file_name, -1, access_flag, ret);
+    return ret;
+}
+
+int RSFS_append(int fd, void *buf, int size){
+    uint64_t start = metrics_start(METRIC_OP_APPEND);
+    uint64_t trace = trace_start();
+    int ret = rsfs_append(fd, buf, size);
+    metrics_record(METRIC_OP_APPEND, start, ret);
+    trace_record(METRIC_OP_APPEND, trace, 0, fd, size, ret);
+    return ret;
+}
+
+int RSFS_fsync(int fd){
+    uint64_t start = metrics_start(METRIC_OP_FSYNC);
+    int ret = rsfs_fsync(fd);
+    metrics_record(METRIC_OP_FSYNC, start, 0);
+    return ret;
+}
+
+int RSFS_fseek(int fd, int offset){
+    uint64_t start = metrics_start(METRIC_OP_FSEEK);
+    uint64_t trace = trace_start();
+    int ret = rsfs_fseek(fd, offset);
+    metrics_record(METRIC_OP_FSEEK, start, 0);
+    trace_record(METRIC_OP_FSEEK, trace, 0, fd, offset, ret);
+    return ret;
+}
+
+int RSFS_read(int fd, void *buf, int size){
+    uint64_t start = metrics_start(METRIC_OP_READ);
+    uint64_t trace = trace_start();
+    int ret = rsfs_read(fd, buf, size);
+    metrics_record(METRIC_OP_READ, start, ret);
+    trace_record(METRIC_OP_READ, trace, 0, fd, size, ret);
+    return ret;
+}
+
+int RSFS_close(int fd){
+    uint64_t start = metrics_start(METRIC_OP_CLOSE);
+    uint64_t trace = trace_start();
+    int ret = rsfs_close(fd);
+    metrics_record(METRIC_OP_CLOSE, start, 0);
+    trace_record(METRIC_OP_CLOSE, trace, 0, fd, 0, ret);
+    return ret;
+}
+
+int RSFS_write(int fd, void *buf, int size){
+    uint64_t start = metrics_start(METRIC_OP_WRITE);
+    uint64_t trace = trace_start();
+    int ret = rsfs_write(fd, buf, size);
+    metrics_record(METRIC_OP_WRITE, start, ret);
+    trace_record(METRIC_OP_WRITE, trace, 0, fd, size, ret);
+    return ret;
+}
@@ -2,7 +2,12 @@
     application that tests the API
 */
 
-#include "def.h"
+#include "rsfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
 #include <unistd.h>
 
 struct thread_arg{
@@ -284,6 +289,67 @@ void test_isolated(){
 
 
 
+//helper: print the full content of a file
+void print_file(char file_name){
+    char buf[NUM_POINTERS*BLOCK_SIZE+1];
+    memset(buf,0,sizeof(buf));
+    int fd = RSFS_open(file_name, RSFS_RDONLY);
+    if(fd<0) return;
+    RSFS_read(fd,buf,NUM_POINTERS*BLOCK_SIZE);
+    printf("File '%c' content: %s\n", file_name, buf);
+    RSFS_close(fd);
+}
+
+
+void test_clone_snapshot(){
+
+    char original[] = "clones share blocks until one of them is written to";
+
+    //create a file spanning two data blocks, and clone it
+    RSFS_create('S');
+    int fd = RSFS_open('S', RSFS_RDWR);
+    RSFS_append(fd, original, strlen(original));
+    RSFS_close(fd);
+
+    int ret = RSFS_clone('S', 'T');
+    printf("[test_clone] result of RSFS_clone('S','T'): %d\n", ret);
+    RSFS_stat();
+
+    //diverge the clone: only T may change
+    fd = RSFS_open('T', RSFS_RDWR);
+    RSFS_fseek(fd, 7);
+    RSFS_write(fd, "XXXXX", 5);
+    RSFS_close(fd);
+    printf("[test_clone] wrote XXXXX to the clone from position 7.\n");
+    print_file('S');
+    print_file('T');
+    RSFS_stat();
+
+    //snapshot, then change everything
+    int snapshot_id = RSFS_snapshot();
+    printf("[test_snapshot] result of RSFS_snapshot(): %d\n", snapshot_id);
+    RSFS_delete('S');
+    fd = RSFS_open('T', RSFS_RDWR);
+    RSFS_append(fd, "!!!", 3);
+    RSFS_close(fd);
+    printf("[test_snapshot] deleted S and appended to T.\n");
+    print_file('T');
+
+    //roll back: S is back, and T lost the appended bytes
+    ret = RSFS_restore(snapshot_id);
+    printf("[test_snapshot] result of RSFS_restore(%d): %d\n", snapshot_id, ret);
+    print_file('S');
+    print_file('T');
+
+    RSFS_delete_snapshot(snapshot_id);
+    RSFS_delete('S');
+    RSFS_delete('T');
+    printf("[test_snapshot] have deleted the snapshot, S and T.\n");
+    RSFS_stat();
+}
+
+
+
 //test: reader-writer problem
 void main(){
 
@@ -301,6 +367,9 @@ void main(){
     printf("\n\n--------Test for Concurrent Readers/Writers-----------\n\n");
     test_concurrency();
 
+    printf("\n\n--------Test for Clones and Snapshots-----------\n\n");
+    test_clone_snapshot();
+
     
 
 }
@@ -0,0 +1,1137 @@
+/*
+    micro-benchmarks of the API
+*/
+
+#define _GNU_SOURCE //for sched_setaffinity
+#include "def.h"
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+//helper: current time in seconds
+static double now_sec(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+
+//benchmark: 16-byte appends per second, unbuffered vs. RSFS_BUFFERED
+//each round creates a file, fills it with 16-byte appends, closes and deletes it
+void bench_small_appends(){
+    char *debugTitle = "bench_small_appends";
+    char record[16] = "0123456789abcde";
+    int rounds = 20000;
+    int appends_per_file = NUM_POINTERS*BLOCK_SIZE/sizeof(record);
+
+    int modes[2] = {RSFS_RDWR, RSFS_RDWR|RSFS_BUFFERED};
+    char *mode_names[2] = {"unbuffered", "buffered"};
+
+    for(int m=0; m<2; m++){
+        long appends = 0;
+        double start = now_sec();
+        for(int r=0; r<rounds; r++){
+            RSFS_create('b');
+            int fd = RSFS_open('b', modes[m]);
+            if(fd<0){
+                printf("[%s] fail to open file\n", debugTitle);
+                return;
+            }
+            for(int i=0; i<appends_per_file; i++){
+                if(RSFS_append(fd, record, sizeof(record))==sizeof(record)) appends++;
+            }
+            RSFS_close(fd);
+            RSFS_delete('b');
+        }
+        double elapsed = now_sec() - start;
+        printf("[%s] %-10s %10.0f appends/s (%ld appends of %d bytes)\n",
+            debugTitle, mode_names[m], appends/elapsed, appends, (int)sizeof(record));
+    }
+}
+
+
+//benchmark: write throughput with and without block-level dedup
+//each round fills NUM_INODES-1 files with identical content, then deletes them
+void bench_dedup_writes(){
+    char *debugTitle = "bench_dedup_writes";
+    char content[NUM_POINTERS*BLOCK_SIZE];
+    int rounds = 20000;
+    int num_files = NUM_INODES-1;
+
+    for(size_t i=0; i<sizeof(content); i++) content[i] = 'a' + i%26;
+
+    for(int dedup=0; dedup<=1; dedup++){
+        RSFS_set_dedup(dedup);
+
+        long bytes = 0;
+        int blocks_used = 0;
+        double start = now_sec();
+        for(int r=0; r<rounds; r++){
+            for(int f=0; f<num_files; f++){
+                RSFS_create('a'+f);
+                int fd = RSFS_open('a'+f, RSFS_RDWR);
+                bytes += RSFS_append(fd, content, sizeof(content));
+                RSFS_close(fd);
+            }
+            if(r==0){
+                struct rsfs_statfs st;
+                RSFS_statfs(&st);
+                blocks_used = st.used_blocks;
+            }
+            for(int f=0; f<num_files; f++) RSFS_delete('a'+f);
+        }
+        double elapsed = now_sec() - start;
+        printf("[%s] dedup %-3s %8.1f MB/s, %d files x %d bytes in %d data blocks\n",
+            debugTitle, dedup ? "on" : "off", bytes/elapsed/1e6, num_files, (int)sizeof(content), blocks_used);
+    }
+
+    RSFS_set_dedup(0);
+}
+
+
+//benchmark: compression ratio and read/write throughput of compressed vs. raw files,
+//on text and on random content of MAX_FILE_SIZE bytes
+void bench_compression(){
+    char *debugTitle = "bench_compression";
+    char *text = "hello 1, hello 2, hello 3, hello 4, hello 5, hello 6, "; //like application.c writes
+    char content[2][MAX_FILE_SIZE];
+    char *content_names[2] = {"text", "random"};
+    int rounds = 20000;
+
+    srand(352);
+    for(int i=0; i<MAX_FILE_SIZE; i++){
+        content[0][i] = text[i % strlen(text)];
+        content[1][i] = rand();
+    }
+
+    for(int c=0; c<2; c++){
+        for(int compressed=0; compressed<=1; compressed++){
+            RSFS_create('z');
+            int fd = RSFS_open('z', RSFS_RDWR);
+            RSFS_set_compressed(fd, compressed);
+
+            //write: rewrite the whole file each round
+            long bytes = 0;
+            double start = now_sec();
+            for(int r=0; r<rounds; r++){
+                RSFS_fseek(fd, 0);
+                bytes += RSFS_write(fd, content[c], MAX_FILE_SIZE);
+            }
+            double write_mbs = bytes/(now_sec()-start)/1e6;
+
+            struct rsfs_fstat st;
+            RSFS_fstat(fd, &st);
+            int blocks_used = st.blocks;
+
+            //read: the whole file in 32-byte pieces
+            char buf[32];
+            bytes = 0;
+            start = now_sec();
+            for(int r=0; r<rounds; r++){
+                RSFS_fseek(fd, 0);
+                int n;
+                while((n = RSFS_read(fd, buf, sizeof(buf))) > 0) bytes += n;
+            }
+            double read_mbs = bytes/(now_sec()-start)/1e6;
+
+            printf("[%s] %-6s %-10s ratio %4.2f (%d blocks), write %7.1f MB/s, read %7.1f MB/s\n",
+                debugTitle, content_names[c], compressed ? "compressed" : "raw",
+                (double)MAX_FILE_SIZE/(blocks_used*BLOCK_SIZE), blocks_used, write_mbs, read_mbs);
+
+            RSFS_close(fd);
+            RSFS_delete('z');
+        }
+    }
+}
+
+
+//benchmark: RSFS_clone time vs. the file size, compared with copying through RSFS_read/RSFS_append
+void bench_clone(){
+    char *debugTitle = "bench_clone";
+    char content[MAX_FILE_SIZE];
+    int rounds = 20000;
+
+    for(int i=0; i<MAX_FILE_SIZE; i++) content[i] = 'a' + i%26;
+
+    for(int size=BLOCK_SIZE; size<=MAX_FILE_SIZE; size*=2){
+        RSFS_create('s');
+        int fd = RSFS_open('s', RSFS_RDWR);
+        RSFS_append(fd, content, size);
+        RSFS_close(fd);
+
+        double start = now_sec();
+        for(int r=0; r<rounds; r++){
+            RSFS_clone('s', 'd');
+            RSFS_delete('d');
+        }
+        double clone_ns = (now_sec()-start)/rounds*1e9;
+
+        char buf[MAX_FILE_SIZE];
+        start = now_sec();
+        for(int r=0; r<rounds; r++){
+            int in = RSFS_open('s', RSFS_RDONLY);
+            int n = RSFS_read(in, buf, size);
+            RSFS_close(in);
+            RSFS_create('d');
+            int out = RSFS_open('d', RSFS_RDWR);
+            RSFS_append(out, buf, n);
+            RSFS_close(out);
+            RSFS_delete('d');
+        }
+        double copy_ns = (now_sec()-start)/rounds*1e9;
+
+        printf("[%s] %4d bytes: clone %7.0f ns, read/append copy %7.0f ns\n", debugTitle, size, clone_ns, copy_ns);
+        RSFS_delete('s');
+    }
+}
+
+
+//benchmark: path lookup time vs. depth, with a warm dentry cache, a cold one (cleared before each lookup)
+//and none; the path is "a/a/.../f", so the depth is bounded by the number of inodes
+//benchmark: small random writes over many small files (every inode but the root's), in place vs. log-structured,
+//then the cost of the cleaner: one RSFS_clean() pass, and the write throughput with the cleaner running
+void bench_log_mode(){
+    char *debugTitle = "bench_log_mode";
+    int num_files = NUM_INODES-1;
+    int writes = 100000;
+    char data[BLOCK_SIZE];
+
+    memset(data, 'l', sizeof(data));
+
+    for(int mode=0; mode<3; mode++){ //in place, log-structured, log-structured with the cleaner
+        RSFS_set_log_mode(mode>0);
+        for(int f=0; f<num_files; f++) RSFS_create('a'+f);
+        if(mode==2) RSFS_cleaner_start(1, 50);
+
+        srand(7);
+        double start = now_sec();
+        for(int w=0; w<writes; w++){
+            int fd = RSFS_open('a'+rand()%num_files, RSFS_RDWR);
+            struct rsfs_fstat st;
+            RSFS_fstat(fd, &st);
+            int size = 8 + rand()%(BLOCK_SIZE-8);
+            if(st.length+size > MAX_FILE_SIZE/2) RSFS_fseek(fd, rand()%(st.length+1)); //keep the files small
+            else RSFS_fseek(fd, st.length);
+            RSFS_write(fd, data, size);
+            RSFS_close(fd);
+        }
+        double ns = (now_sec()-start)/writes*1e9;
+
+        if(mode==2) RSFS_cleaner_stop();
+        struct rsfs_statfs before, after;
+        RSFS_statfs(&before);
+        start = now_sec();
+        int moved = RSFS_clean();
+        double clean_us = (now_sec()-start)*1e6;
+        RSFS_statfs(&after);
+
+        printf("[%s] %-22s %6.0f ns per write; clean pass %5.1f us, %2d blocks moved, clean segments %d -> %d of %d\n",
+            debugTitle, mode==0 ? "in place:" : mode==1 ? "log-structured:" : "log + cleaner (50%):", ns,
+            clean_us, moved, before.clean_segments, after.clean_segments, NUM_SEGMENTS);
+
+        for(int f=0; f<num_files; f++) RSFS_delete('a'+f);
+    }
+    RSFS_set_log_mode(0);
+}
+
+//benchmark: copying a file with RSFS_copy_range (block-aligned: blocks are shared; unaligned: copied block to block)
+//vs. a loop reading 64-byte chunks into a user buffer and writing them out
+void bench_copy_range(){
+    char *debugTitle = "bench_copy_range";
+    char content[MAX_FILE_SIZE], buf[64];
+    int rounds = 20000;
+
+    for(int i=0; i<MAX_FILE_SIZE; i++) content[i] = 'a' + i%26;
+
+    for(int size=BLOCK_SIZE; size<=MAX_FILE_SIZE; size*=2){
+        RSFS_create('s');
+        RSFS_create('d');
+        int in = RSFS_open('s', RSFS_RDWR);
+        RSFS_append(in, content, size);
+        int out = RSFS_open('d', RSFS_RDWR);
+
+        double start = now_sec();
+        for(int r=0; r<rounds; r++) RSFS_copy_range(in, 0, out, 0, size);
+        double aligned_ns = (now_sec()-start)/rounds*1e9;
+
+        start = now_sec();
+        for(int r=0; r<rounds; r++) RSFS_copy_range(in, 1, out, 0, size);
+        double unaligned_ns = (now_sec()-start)/rounds*1e9;
+
+        start = now_sec();
+        for(int r=0; r<rounds; r++){
+            RSFS_fseek(in, 0);
+            RSFS_fseek(out, 0);
+            int n;
+            while((n = RSFS_read(in, buf, sizeof(buf))) > 0) RSFS_write(out, buf, n);
+        }
+        double loop_ns = (now_sec()-start)/rounds*1e9;
+
+        printf("[%s] %4d bytes: copy_range aligned %6.0f ns, unaligned %6.0f ns, read/write loop %6.0f ns\n",
+            debugTitle, size, aligned_ns, unaligned_ns, loop_ns);
+
+        RSFS_close(in);
+        RSFS_close(out);
+        RSFS_delete('s');
+        RSFS_delete('d');
+    }
+}
+
+void bench_path_lookup(){
+    struct rsfs *fs = rsfs_current;
+    char *debugTitle = "bench_path_lookup";
+    int rounds = 200000;
+    int max_depth = (NUM_INODES-1 < 10) ? NUM_INODES-1 : 10;
+    char path[2*10];
+
+    //cold lookups are timed one by one, so that clearing the cache is not counted; this is the timer's own cost
+    double start, timer_ns = 0;
+    for(int r=0; r<rounds; r++){
+        start = now_sec();
+        timer_ns += now_sec()-start;
+    }
+
+    for(int depth=1; depth<=max_depth; depth++){
+        //directories a, a/a, ... then the file
+        for(int i=0; i<depth; i++){
+            path[2*i] = (i==depth-1) ? 'f' : 'a';
+            path[2*i+1] = '/';
+        }
+        path[2*depth-1] = '\0';
+        if(depth>1){
+            path[2*depth-3] = '\0';
+            RSFS_mkdir(path);
+            path[2*depth-3] = '/';
+        }
+        RSFS_create_path(path);
+
+        double ns[3];
+        for(int mode=0; mode<3; mode++){ //0-warm, 1-cold, 2-no cache
+            fs->dcache_enabled = (mode!=2);
+            lookup_path(path, NULL, NULL);
+
+            if(mode==1){
+                double total = 0;
+                for(int r=0; r<rounds; r++){
+                    dcache_clear();
+                    start = now_sec();
+                    lookup_path(path, NULL, NULL);
+                    total += now_sec()-start;
+                }
+                ns[mode] = (total-timer_ns)/rounds*1e9;
+            }else{
+                start = now_sec();
+                for(int r=0; r<rounds; r++) lookup_path(path, NULL, NULL);
+                ns[mode] = (now_sec()-start)/rounds*1e9;
+            }
+        }
+        fs->dcache_enabled = 1;
+
+        printf("[%s] depth %2d: warm %6.0f ns, cold %6.0f ns, no cache %6.0f ns\n", debugTitle, depth, ns[0], ns[1], ns[2]);
+        RSFS_delete_path(path);
+    }
+
+    //remove the directories, deepest first
+    for(int depth=max_depth-1; depth>=1; depth--){
+        for(int i=0; i<depth; i++){
+            path[2*i] = 'a';
+            path[2*i+1] = '/';
+        }
+        path[2*depth-1] = '\0';
+        RSFS_rmdir(path);
+    }
+}
+
+
+//benchmark: creating and deleting a set of files with RSFS_create_many/RSFS_delete_many
+//vs. a loop of RSFS_create/RSFS_delete; time and lock acquisitions per file
+//time name_scan with each implementation the CPU supports on arrays of 16 (a directory), 256 and 4096 names,
+//for a name found at varying positions and for a missing one
+void bench_name_scan(){
+    char *debugTitle = "bench_name_scan";
+    int sizes[3] = {DIR_ENTRIES, 256, 4096};
+    int (*scans[3])(const char *, int, char) = {name_scan_scalar, name_scan_sse2, name_scan_avx2};
+    char *scan_names[3] = {"scalar", "sse2", "avx2"};
+    int num_scans = strcmp(name_scan_kind, "avx2")==0 ? 3 : strcmp(name_scan_kind, "sse2")==0 ? 2 : 1;
+
+    printf("[%s] name_scan uses %s\n", debugTitle, name_scan_kind);
+    for(int s=0; s<3; s++){
+        int n = sizes[s], rounds = 4000000/n;
+        char *names = malloc(n);
+        for(int i=0; i<n; i++) names[i] = 'a' + i%26;
+
+        printf("[%s] %4d names:", debugTitle, n);
+        for(int k=0; k<num_scans; k++){
+            volatile int sink = 0;
+
+            //the name sought is somewhere in the array
+            double start = now_sec();
+            for(int r=0; r<rounds; r++){
+                int pos = (r*7919) % n;
+                names[pos] = 'Z';
+                sink += scans[k](names, n, 'Z');
+                names[pos] = 'a' + pos%26;
+            }
+            double hit_ns = (now_sec()-start)/rounds*1e9;
+
+            //the name sought is missing
+            start = now_sec();
+            for(int r=0; r<rounds; r++) sink += scans[k](names, n, 'Z');
+            double miss_ns = (now_sec()-start)/rounds*1e9;
+
+            printf("  %s hit %6.1f ns, miss %6.1f ns", scan_names[k], hit_ns, miss_ns);
+        }
+        printf("\n");
+        free(names);
+    }
+}
+
+//benchmark: CRC32C throughput (table vs. SSE4.2) and the cost of verifying checksums in RSFS_read
+void bench_checksum(){
+    char *debugTitle = "bench_checksum";
+    int len = 1<<20, rounds = 64;
+    char *data = malloc(len);
+    uint32_t (*crcs[2])(uint32_t, const void *, int) = {crc32c_sw, crc32c_hw};
+    char *crc_names[2] = {"software", "sse4.2"};
+    int num_crcs = strcmp(crc32c_kind, "sse4.2")==0 ? 2 : 1;
+
+    srand(39);
+    for(int i=0; i<len; i++) data[i] = rand();
+
+    printf("[%s] crc32c uses %s\n", debugTitle, crc32c_kind);
+    for(int k=0; k<num_crcs; k++){
+        volatile uint32_t sink = 0;
+
+        //long buffers
+        double start = now_sec();
+        for(int r=0; r<rounds; r++) sink += crcs[k](0, data, len);
+        double gbs = (double)len*rounds/(now_sec()-start)/1e9;
+
+        //one data block at a time, as the file system does
+        int blocks = len/BLOCK_SIZE;
+        start = now_sec();
+        for(int r=0; r<rounds; r++){
+            for(int b=0; b<blocks; b++) sink += crcs[k](0, data + b*BLOCK_SIZE, BLOCK_SIZE);
+        }
+        double block_ns = (now_sec()-start)/((double)blocks*rounds)*1e9;
+
+        printf("[%s] %-8s %6.2f GB/s, %5.1f ns per %d-byte block\n", debugTitle, crc_names[k], gbs, block_ns, BLOCK_SIZE);
+    }
+    free(data);
+
+    //read path: the whole file in 32-byte pieces, verification off and on
+    int reads = 20000;
+    char content[MAX_FILE_SIZE], buf[32];
+    double read_ns[2];
+    for(int i=0; i<MAX_FILE_SIZE; i++) content[i] = 'a' + i%26;
+
+    RSFS_create('z');
+    int fd = RSFS_open('z', RSFS_RDWR);
+    RSFS_write(fd, content, MAX_FILE_SIZE);
+    for(int verify=0; verify<=1; verify++){
+        RSFS_set_checksum_verify(verify);
+        double start = now_sec();
+        for(int r=0; r<reads; r++){
+            RSFS_fseek(fd, 0);
+            while(RSFS_read(fd, buf, sizeof(buf)) > 0);
+        }
+        read_ns[verify] = (now_sec()-start)/reads*1e9;
+    }
+    RSFS_set_checksum_verify(0);
+    printf("[%s] reading %d bytes: %7.0f ns unverified, %7.0f ns verified (+%.1f%%)\n", debugTitle,
+        MAX_FILE_SIZE, read_ns[0], read_ns[1], (read_ns[1]/read_ns[0]-1)*100);
+
+    //scrubber: let it run without pauses for a while
+    struct rsfs_statfs before, after;
+    struct timespec run = {0, 100000000}; //100ms
+    RSFS_statfs(&before);
+    RSFS_scrub_start(0);
+    nanosleep(&run, NULL);
+    RSFS_scrub_stop();
+    RSFS_statfs(&after);
+    printf("[%s] scrubber: %.0f blocks/s, %llu checksum errors\n", debugTitle,
+        (after.scrubbed_blocks-before.scrubbed_blocks)/0.1, (unsigned long long)after.checksum_errors);
+
+    RSFS_close(fd);
+    RSFS_delete('z');
+}
+
+//helper for bench_defrag: create the files of names by appending one block to each in turn,
+//so that their blocks interleave in the data block array
+static void create_interleaved(const char *names, int n, char *content){
+    int fds[NUM_INODES];
+    for(int f=0; f<n; f++){
+        RSFS_create(names[f]);
+        fds[f] = RSFS_open(names[f], RSFS_RDWR);
+    }
+    for(int b=0; b<NUM_POINTERS; b++){
+        for(int f=0; f<n; f++) RSFS_append(fds[f], content + b*BLOCK_SIZE, BLOCK_SIZE);
+    }
+    for(int f=0; f<n; f++) RSFS_close(fds[f]);
+}
+
+//benchmark: sequential read throughput of files with interleaved blocks, before and after compaction
+void bench_defrag(){
+    char *debugTitle = "bench_defrag";
+    char *names = "pqrs";
+    int n = strlen(names), rounds = 20000;
+    char content[MAX_FILE_SIZE], buf[MAX_FILE_SIZE];
+    struct rsfs_statfs st;
+
+    for(int i=0; i<MAX_FILE_SIZE; i++) content[i] = 'a' + i%26;
+    create_interleaved(names, n, content);
+
+    for(int pass=0; pass<2; pass++){
+        if(pass==1){
+            double start = now_sec();
+            int moved = RSFS_defrag();
+            printf("[%s] RSFS_defrag moved %d blocks in %.0f us\n", debugTitle, moved, (now_sec()-start)*1e6);
+        }
+        RSFS_statfs(&st);
+
+        //read each file whole, in one call
+        int fds[NUM_INODES];
+        for(int f=0; f<n; f++) fds[f] = RSFS_open(names[f], RSFS_RDONLY);
+        long bytes = 0;
+        double start = now_sec();
+        for(int r=0; r<rounds; r++){
+            for(int f=0; f<n; f++){
+                RSFS_fseek(fds[f], 0);
+                bytes += RSFS_read(fds[f], buf, MAX_FILE_SIZE);
+            }
+        }
+        double read_mbs = bytes/(now_sec()-start)/1e6;
+        for(int f=0; f<n; f++) RSFS_close(fds[f]);
+
+        printf("[%s] %-10s fragmentation %3d%%, sequential read %7.1f MB/s\n", debugTitle,
+            pass ? "compacted" : "scattered", st.fragmentation, read_mbs);
+    }
+    for(int f=0; f<n; f++) RSFS_delete(names[f]);
+
+    //the same layout, compacted by the background thread
+    create_interleaved(names, n, content);
+    RSFS_defrag_start(1, 25);
+    double start = now_sec();
+    do{
+        RSFS_statfs(&st);
+    }while(st.fragmentation>0 && now_sec()-start<1);
+    double elapsed = now_sec()-start;
+    RSFS_defrag_stop();
+    printf("[%s] compactor thread: fragmentation %d%% after %.1f ms\n", debugTitle, st.fragmentation, elapsed*1e3);
+    for(int f=0; f<n; f++) RSFS_delete(names[f]);
+}
+
+//worker of bench_shards: open/append/read/close its own file until the time is up
+struct shard_worker{
+    rsfs_shards_t *shards;
+    char file_name;
+    double seconds;
+    long ops;
+};
+
+static void *shard_worker_main(void *arg){
+    struct shard_worker *w = arg;
+    char data[16] = "0123456789abcdef", buf[16];
+
+    double start = now_sec();
+    while(now_sec()-start < w->seconds){
+        int fd = RSFS_shards_open(w->shards, w->file_name, RSFS_RDWR);
+        if(RSFS_shards_append(w->shards, fd, data, sizeof(data)) < (int)sizeof(data)){
+            RSFS_shards_fseek(w->shards, fd, 0);
+            RSFS_shards_write(w->shards, fd, data, sizeof(data)); //the file is full: start it over
+        }
+        RSFS_shards_fseek(w->shards, fd, 0);
+        RSFS_shards_read(w->shards, fd, buf, sizeof(buf));
+        RSFS_shards_close(w->shards, fd);
+        w->ops += 5;
+    }
+    return NULL;
+}
+
+//benchmark: aggregate throughput of threads working on their own files, all in one instance vs. one shard each
+void bench_shards(){
+    char *debugTitle = "bench_shards";
+    int num_threads = 4;
+    pthread_t threads[4];
+    struct shard_worker workers[4];
+    double ops_per_sec[2];
+
+    for(int k=0; k<2; k++){
+        int num_shards = k ? num_threads : 1;
+        rsfs_shards_t *shards = RSFS_shards_new(num_shards);
+
+        for(int t=0; t<num_threads; t++){
+            workers[t] = (struct shard_worker){shards, 'A'+t, 0.3, 0};
+            RSFS_shards_create(shards, workers[t].file_name);
+        }
+        for(int t=0; t<num_threads; t++) pthread_create(&threads[t], NULL, shard_worker_main, &workers[t]);
+
+        long ops = 0;
+        for(int t=0; t<num_threads; t++){
+            pthread_join(threads[t], NULL);
+            ops += workers[t].ops;
+        }
+        ops_per_sec[k] = ops/0.3;
+        printf("[%s] %d threads, %d shard(s): %9.0f ops/s\n", debugTitle, num_threads, num_shards, ops_per_sec[k]);
+
+        RSFS_shards_free(shards);
+    }
+    printf("[%s] speedup with %d shards: %.2fx\n", debugTitle, num_threads, ops_per_sec[1]/ops_per_sec[0]);
+}
+
+//worker of bench_shm: the loop of shard_worker_main() on its own file of a shared instance
+struct shm_worker{
+    rsfs_t *fs;
+    char file_name;
+    double seconds;
+    long ops;
+};
+
+static void *shm_worker_main(void *arg){
+    struct shm_worker *w = arg;
+    char data[16] = "0123456789abcdef", buf[16];
+
+    double start = now_sec();
+    while(now_sec()-start < w->seconds){
+        int fd = RSFS_fs_open(w->fs, w->file_name, RSFS_RDWR);
+        if(RSFS_fs_append(w->fs, fd, data, sizeof(data)) < (int)sizeof(data)){
+            RSFS_fs_fseek(w->fs, fd, 0);
+            RSFS_fs_write(w->fs, fd, data, sizeof(data)); //the file is full: start it over
+        }
+        RSFS_fs_fseek(w->fs, fd, 0);
+        RSFS_fs_read(w->fs, fd, buf, sizeof(buf));
+        RSFS_fs_close(w->fs, fd);
+        w->ops += 5;
+    }
+    return NULL;
+}
+
+//benchmark: workers on their own files of one shared-memory instance, as threads of this process vs. as processes
+void bench_shm(){
+    char *debugTitle = "bench_shm";
+    const char *name = "/rsfs_bench_shm";
+    int num_workers = 4;
+    pthread_t threads[4];
+
+    //the workers' counters, where the parent sees them whether the workers are threads or processes
+    struct shm_worker *workers = mmap(NULL, num_workers*sizeof(struct shm_worker), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(workers==MAP_FAILED) return;
+
+    shm_unlink(name); //left over by an interrupted run
+    rsfs_t *fs = RSFS_shm_open(name);
+    if(fs==NULL){
+        printf("[%s] no shared memory: skipped\n", debugTitle);
+        munmap(workers, num_workers*sizeof(struct shm_worker));
+        return;
+    }
+
+    for(int procs=0; procs<=1; procs++){
+        for(int t=0; t<num_workers; t++){
+            workers[t] = (struct shm_worker){fs, 'A'+t, 0.3, 0};
+            RSFS_fs_create(fs, workers[t].file_name);
+        }
+
+        for(int t=0; t<num_workers; t++){
+            if(!procs){
+                pthread_create(&threads[t], NULL, shm_worker_main, &workers[t]);
+            }else if(fork()==0){
+                //a process of its own, mapping the instance at an address of its own
+                workers[t].fs = RSFS_shm_open(name);
+                if(workers[t].fs) shm_worker_main(&workers[t]);
+                RSFS_shm_close(workers[t].fs);
+                _exit(0);
+            }
+        }
+
+        long ops = 0;
+        for(int t=0; t<num_workers; t++){
+            if(!procs) pthread_join(threads[t], NULL);
+            else wait(NULL);
+        }
+        for(int t=0; t<num_workers; t++) ops += workers[t].ops;
+        printf("[%s] %d %-9s on one shared instance: %9.0f ops/s\n", debugTitle, num_workers, procs ? "processes" : "threads", ops/0.3);
+
+        for(int t=0; t<num_workers; t++) RSFS_fs_delete(fs, workers[t].file_name);
+    }
+
+    RSFS_shm_close(fs);
+    RSFS_shm_unlink(name);
+    munmap(workers, num_workers*sizeof(struct shm_worker));
+}
+
+//worker of bench_read_scaling: read its fd from the start until stop is set
+struct read_worker{
+    int fd;
+    int *stop;
+    long reads;
+};
+
+static void *read_worker_main(void *arg){
+    struct read_worker *w = arg;
+    char buf[MAX_FILE_SIZE];
+
+    while(!__atomic_load_n(w->stop, __ATOMIC_RELAXED)){
+        RSFS_fseek(w->fd, 0);
+        RSFS_read(w->fd, buf, sizeof(buf));
+        w->reads++;
+    }
+    return NULL;
+}
+
+//appender of bench_read_scaling: keep appending to (and restarting) another file until stop is set
+static void *append_worker_main(void *arg){
+    struct read_worker *w = arg;
+    char data[16] = "0123456789abcdef";
+
+    while(!__atomic_load_n(w->stop, __ATOMIC_RELAXED)){
+        if(RSFS_append(w->fd, data, sizeof(data)) < (int)sizeof(data)){
+            RSFS_fseek(w->fd, 0);
+            RSFS_write(w->fd, data, sizeof(data));
+        }
+        w->reads++;
+    }
+    return NULL;
+}
+
+//benchmark: read throughput of 1 to 64 threads reading one file, alone and next to a thread appending to another file;
+//the open file table is small, so the readers share NUM_OPEN_FILE-1 fds (the lock of an fd is then contended)
+void bench_read_scaling(){
+    char *debugTitle = "bench_read_scaling";
+    int thread_counts[] = {1, 4, 16, 64};
+    pthread_t threads[64], appender;
+    struct read_worker workers[64], writer;
+    int fds[NUM_OPEN_FILE-1];
+    char data[MAX_FILE_SIZE];
+    double seconds = 0.2;
+
+    memset(data, 'r', sizeof(data));
+    RSFS_create('R');
+    RSFS_create('W');
+    int fd = RSFS_open('R', RSFS_RDWR);
+    RSFS_append(fd, data, 4*BLOCK_SIZE);
+    RSFS_close(fd);
+    for(int i=0; i<NUM_OPEN_FILE-1; i++) fds[i] = -1;
+
+    for(int with_writer=0; with_writer<=1; with_writer++){
+        for(int k=0; k<(int)(sizeof(thread_counts)/sizeof(thread_counts[0])); k++){
+            int num_threads = thread_counts[k], stop = 0;
+            int num_fds = num_threads < NUM_OPEN_FILE-1 ? num_threads : NUM_OPEN_FILE-1;
+            for(int i=0; i<num_fds; i++) fds[i] = RSFS_open('R', RSFS_RDONLY);
+
+            struct rsfs_metrics before, after;
+            RSFS_metrics_snapshot(&before);
+
+            if(with_writer){
+                writer = (struct read_worker){RSFS_open('W', RSFS_RDWR), &stop, 0};
+                pthread_create(&appender, NULL, append_worker_main, &writer);
+            }
+            for(int t=0; t<num_threads; t++){
+                workers[t] = (struct read_worker){fds[t % num_fds], &stop, 0};
+                pthread_create(&threads[t], NULL, read_worker_main, &workers[t]);
+            }
+
+            struct timespec pause = {0, (long)(seconds*1e9)};
+            nanosleep(&pause, NULL);
+            __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+            long reads = 0;
+            for(int t=0; t<num_threads; t++){
+                pthread_join(threads[t], NULL);
+                reads += workers[t].reads;
+            }
+            if(with_writer){
+                pthread_join(appender, NULL);
+                RSFS_close(writer.fd);
+            }
+
+            RSFS_metrics_snapshot(&after);
+            uint64_t locks = after.locks[METRIC_LOCK_INODES].acquisitions - before.locks[METRIC_LOCK_INODES].acquisitions;
+
+            printf("[%s] %2d readers%-15s %10.0f reads/s, %5.2f inodes_mutex acquisitions per read\n", debugTitle, num_threads,
+                with_writer ? " + 1 appender:" : ":", reads/seconds, reads ? (double)locks/reads : 0.0);
+
+            for(int i=0; i<num_fds; i++) RSFS_close(fds[i]);
+        }
+    }
+
+    RSFS_delete('R');
+    RSFS_delete('W');
+}
+
+void bench_batch_metadata(){
+    char *debugTitle = "bench_batch_metadata";
+    char names[NUM_INODES];
+    int num_files = NUM_INODES-1; //every inode but the root's
+    int rounds = 50000;
+
+    for(int i=0; i<num_files; i++) names[i] = 'k'+i;
+
+    for(int batched=0; batched<=1; batched++){
+        struct rsfs_metrics before, after;
+        RSFS_metrics_snapshot(&before);
+
+        double start = now_sec();
+        for(int r=0; r<rounds; r++){
+            if(batched){
+                RSFS_create_many(names, num_files, NULL);
+                RSFS_delete_many(names, num_files, NULL);
+            }else{
+                for(int i=0; i<num_files; i++) RSFS_create(names[i]);
+                for(int i=0; i<num_files; i++) RSFS_delete(names[i]);
+            }
+        }
+        double ns = (now_sec()-start)/rounds/num_files*1e9;
+
+        RSFS_metrics_snapshot(&after);
+        uint64_t locks = 0;
+        for(int lock=0; lock<NUM_METRIC_LOCKS; lock++) locks += after.locks[lock].acquisitions - before.locks[lock].acquisitions;
+
+        printf("[%s] %-7s create+delete %6.0f ns per file, %5.2f lock acquisitions per file\n",
+            debugTitle, batched ? "batched" : "looped", ns, (double)locks/rounds/num_files);
+    }
+}
+
+void bench_submit_batch(){
+    char *debugTitle = "bench_submit_batch";
+    char data[4*BLOCK_SIZE], buf[16];
+    int rounds = 200000;
+
+    memset(data, 'b', sizeof(data));
+    RSFS_create('B');
+    int fd = RSFS_open('B', RSFS_RDWR);
+    RSFS_append(fd, data, sizeof(data));
+    RSFS_close(fd);
+
+    //open, fseek, read 16 bytes, close: as four calls, or as one batch chaining the fd; the shared locks counted
+    //below are the open file table's, taken by the open and the close on both paths, while the batch runs the
+    //fseek and the read under a single acquisition of the fd's entry_mutex (not counted) instead of two
+    struct rsfs_batch_op ops[4] = {
+        {.op = RSFS_BATCH_OPEN, .file_name = 'B', .access_flag = RSFS_RDONLY},
+        {.op = RSFS_BATCH_FSEEK, .fd = RSFS_BATCH_FD},
+        {.op = RSFS_BATCH_READ, .fd = RSFS_BATCH_FD, .buf = buf, .size = sizeof(buf)},
+        {.op = RSFS_BATCH_CLOSE, .fd = RSFS_BATCH_FD},
+    };
+
+    for(int batched=0; batched<=1; batched++){
+        struct rsfs_metrics before, after;
+        RSFS_metrics_snapshot(&before);
+
+        long failed = 0;
+        double start = now_sec();
+        for(int r=0; r<rounds; r++){
+            int offset = (r*16) % (int)(sizeof(data)-sizeof(buf));
+            if(batched){
+                ops[1].offset = offset;
+                failed += RSFS_submit_batch(ops, 4) != 4;
+            }else{
+                fd = RSFS_open('B', RSFS_RDONLY);
+                RSFS_fseek(fd, offset);
+                failed += RSFS_read(fd, buf, sizeof(buf)) != (int)sizeof(buf);
+                RSFS_close(fd);
+            }
+        }
+        double seconds = now_sec()-start;
+
+        RSFS_metrics_snapshot(&after);
+        uint64_t locks = 0;
+        for(int lock=0; lock<NUM_METRIC_LOCKS; lock++) locks += after.locks[lock].acquisitions - before.locks[lock].acquisitions;
+
+        printf("[%s] %-10s open+fseek+read+close %10.0f batches/s, %5.2f shared lock acquisitions per batch%s\n",
+            debugTitle, batched ? "batched:" : "4 calls:", rounds/seconds, (double)locks/rounds, failed ? " (FAILED)" : "");
+    }
+
+    RSFS_delete('B');
+}
+
+void bench_readdir_plus(){
+    char *debugTitle = "bench_readdir_plus";
+    char names[NUM_INODES], data[3*BLOCK_SIZE];
+    int num_files = NUM_INODES-2, rounds = 100000;
+
+    memset(data, 'l', sizeof(data));
+    for(int i=0; i<num_files; i++){
+        names[i] = 'l'+i;
+        RSFS_create(names[i]);
+        int fd = RSFS_open(names[i], RSFS_RDWR);
+        RSFS_append(fd, data, (i+1)*sizeof(data)/num_files);
+        RSFS_close(fd);
+    }
+
+    //list the root with the length of each file: RSFS_readdir then open+fstat+close per file, or RSFS_readdir_plus
+    for(int plus=0; plus<=1; plus++){
+        struct rsfs_metrics before, after;
+        RSFS_metrics_snapshot(&before);
+
+        long total = 0;
+        double start = now_sec();
+        for(int r=0; r<rounds; r++){
+            if(plus){
+                struct rsfs_dirent ents[4];
+                int cursor = 0, n;
+                while((n = RSFS_readdir_plus("/", &cursor, ents, 4)) > 0){
+                    for(int i=0; i<n; i++) total += ents[i].length;
+                }
+            }else{
+                char listed[DIR_ENTRIES];
+                int n = RSFS_readdir("/", listed, DIR_ENTRIES);
+                for(int i=0; i<n; i++){
+                    struct rsfs_fstat st;
+                    int fd = RSFS_open(listed[i], RSFS_RDONLY);
+                    if(fd<0) continue; //a subdirectory
+                    RSFS_fstat(fd, &st);
+                    RSFS_close(fd);
+                    total += st.length;
+                }
+            }
+        }
+        double ns = (now_sec()-start)/rounds*1e9;
+
+        RSFS_metrics_snapshot(&after);
+        uint64_t locks = 0;
+        for(int lock=0; lock<NUM_METRIC_LOCKS; lock++) locks += after.locks[lock].acquisitions - before.locks[lock].acquisitions;
+
+        printf("[%s] %-26s %6.0f ns per listing of %d files, %5.2f lock acquisitions per listing (%ld bytes)\n",
+            debugTitle, plus ? "RSFS_readdir_plus:" : "RSFS_readdir+open+fstat:", ns, num_files, (double)locks/rounds, total/rounds);
+    }
+
+    for(int i=0; i<num_files; i++) RSFS_delete(names[i]);
+}
+
+void bench_block_copy(){
+    char *debugTitle = "bench_block_copy";
+    size_t sizes[] = {4<<10, 1<<20, 64<<20};
+
+    //the copy primitive: through the cache vs. streaming stores, the destination reused as a hot working set would be
+    printf("[%s] block_copy streams from %zu bytes (%s)\n", debugTitle, block_copy_large_size(), block_copy_kind);
+    for(int k=0; k<3; k++){
+        size_t n = sizes[k];
+        char *src = malloc(n), *dst = malloc(n);
+        memset(src, 'c', n);
+        memset(dst, 0, n);
+        int reps = (int)((256<<20) / n);
+
+        double mbs[2];
+        for(int nt=0; nt<=1; nt++){
+            double start = now_sec();
+            for(int r=0; r<reps; r++){
+                if(nt) block_copy_nt(dst, src, n);
+                else block_copy_memcpy(dst, src, n);
+            }
+            mbs[nt] = (double)n*reps/(now_sec()-start)/1e6;
+        }
+        printf("[%s] %8zu KB copies: memcpy %8.0f MB/s, streaming %8.0f MB/s\n", debugTitle, n>>10, mbs[0], mbs[1]);
+        free(src);
+        free(dst);
+    }
+
+    //file writes: block-aligned (whole runs of blocks per copy) vs. one byte off (partial first block)
+    char data[MAX_FILE_SIZE];
+    int io_sizes[] = {BLOCK_SIZE, 4*BLOCK_SIZE, MAX_FILE_SIZE-2*BLOCK_SIZE}; //whole, even from the unaligned offset
+    int rounds = 200000;
+    memset(data, 'w', sizeof(data));
+    RSFS_create('C');
+    int fd = RSFS_open('C', RSFS_RDWR);
+    RSFS_append(fd, data, 2*BLOCK_SIZE); //both offsets below lie within the file from the first round on
+
+    for(int k=0; k<3; k++){
+        double mbs[2];
+        for(int aligned=0; aligned<=1; aligned++){
+            int pos = aligned ? BLOCK_SIZE : BLOCK_SIZE+1;
+            double start = now_sec();
+            for(int r=0; r<rounds; r++){
+                RSFS_fseek(fd, pos);
+                RSFS_write(fd, data, io_sizes[k]);
+            }
+            mbs[aligned] = (double)io_sizes[k]*rounds/(now_sec()-start)/1e6;
+        }
+        printf("[%s] %4d-byte RSFS_write: unaligned %7.0f MB/s, aligned %7.0f MB/s\n", debugTitle, io_sizes[k], mbs[0], mbs[1]);
+    }
+
+    RSFS_close(fd);
+    RSFS_delete('C');
+}
+
+void bench_lazy_commit(){
+    char *debugTitle = "bench_lazy_commit";
+    int rounds = 2000;
+
+    //startup: RSFS_new (address space committed on first touch) vs. allocating and zeroing the instance up front
+    double start = now_sec();
+    for(int r=0; r<rounds; r++) RSFS_free(RSFS_new());
+    double lazy_us = (now_sec()-start)/rounds*1e6;
+
+    start = now_sec();
+    for(int r=0; r<rounds; r++){
+        struct rsfs *fs;
+        if(posix_memalign((void **)&fs, DATA_PAGE_ALIGN, sizeof(struct rsfs))!=0) break;
+        memset(fs, 0, sizeof(struct rsfs));
+        struct rsfs *prev = RSFS_use(fs);
+        RSFS_init();
+        RSFS_use(prev);
+        free(fs);
+    }
+    double eager_us = (now_sec()-start)/rounds*1e6;
+    printf("[%s] %zu-byte instance: RSFS_new+RSFS_free %6.2f us, eager allocation %6.2f us\n",
+        debugTitle, sizeof(struct rsfs), lazy_us, eager_us);
+
+    //resident vs. used blocks as files come and go
+    rsfs_t *fs = RSFS_new();
+    struct rsfs *prev = RSFS_use(fs);
+    struct rsfs_statfs st;
+    char data[MAX_FILE_SIZE], names[] = "abcdefg";
+    memset(data, 'm', sizeof(data));
+
+    RSFS_statfs(&st);
+    printf("[%s] new:     %3d used, %3d resident blocks\n", debugTitle, st.used_blocks, st.resident_blocks);
+    for(int i=0; i<NUM_INODES-1; i++){
+        RSFS_create(names[i]);
+        int fd = RSFS_open(names[i], RSFS_RDWR);
+        RSFS_append(fd, data, sizeof(data));
+        RSFS_close(fd);
+    }
+    RSFS_statfs(&st);
+    printf("[%s] filled:  %3d used, %3d resident blocks\n", debugTitle, st.used_blocks, st.resident_blocks);
+    RSFS_delete_many(names, NUM_INODES-1, NULL);
+    RSFS_statfs(&st);
+    printf("[%s] deleted: %3d used, %3d resident blocks, %lu pages released\n", debugTitle, st.used_blocks,
+        st.resident_blocks, (unsigned long)st.released_pages);
+
+    //released pages are committed again by the next writes, and read back what was written, not zeros
+    int intact = 1;
+    for(int i=0; i<NUM_INODES-1; i++){
+        char back[MAX_FILE_SIZE];
+        memset(data, 'a'+i, sizeof(data));
+        RSFS_create(names[i]);
+        int fd = RSFS_open(names[i], RSFS_RDWR);
+        RSFS_append(fd, data, sizeof(data));
+        RSFS_fseek(fd, 0);
+        if(RSFS_read(fd, back, sizeof(back))!=(int)sizeof(back) || memcmp(back, data, sizeof(back))!=0) intact = 0;
+        RSFS_close(fd);
+    }
+    RSFS_statfs(&st);
+    printf("[%s] refilled:%3d used, %3d resident blocks, content %s\n", debugTitle, st.used_blocks,
+        st.resident_blocks, intact ? "intact" : "CORRUPTED");
+    if(st.released_pages==0){
+        printf("[%s] (%d-byte blocks: the data block array has no whole page to release; build with "
+            "`make BLOCK_SIZE=1024` to exercise it)\n", debugTitle, BLOCK_SIZE);
+    }
+
+    RSFS_use(prev);
+    RSFS_free(fs);
+}
+
+//helper of bench_numa: move the calling thread to a CPU of the instance's node index, keeping it there if it is
+//already on it; return the CPU, or -1 if the node has no CPU the thread may run on
+static int run_on_node(int index, cpu_set_t *allowed){
+    for(int cpu=0; cpu<CPU_SETSIZE; cpu++){
+        if(!CPU_ISSET(cpu, allowed)) continue;
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if(sched_setaffinity(0, sizeof(one), &one)==0 && numa_local_index()==index) return cpu;
+    }
+    return -1;
+}
+
+//benchmark: read throughput of a file written on node 0, read from a CPU of node 0 (local) and of node 1 (remote)
+void bench_numa(){
+    char *debugTitle = "bench_numa";
+    char data[MAX_FILE_SIZE], buf[MAX_FILE_SIZE];
+    double seconds = 0.2;
+    struct rsfs_statfs st;
+    cpu_set_t allowed;
+
+    RSFS_statfs(&st);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    if(st.nodes<2){
+        printf("[%s] %d NUMA node: blocks are allocated lowest first, local vs. remote comparison skipped\n", debugTitle, st.nodes);
+        return;
+    }
+
+    memset(data, 'n', sizeof(data));
+    run_on_node(0, &allowed);
+    RSFS_create('N');
+    int fd = RSFS_open('N', RSFS_RDWR);
+    RSFS_append(fd, data, sizeof(data));
+
+    for(int index=0; index<=1; index++){
+        int cpu = run_on_node(index, &allowed);
+        if(cpu<0) continue;
+
+        struct rsfs_fstat fst;
+        RSFS_fstat(fd, &fst);
+
+        long reads = 0;
+        double start = now_sec(), elapsed;
+        while((elapsed = now_sec()-start) < seconds){
+            for(int i=0; i<1000; i++){
+                RSFS_fseek(fd, 0);
+                RSFS_read(fd, buf, sizeof(buf));
+            }
+            reads += 1000;
+        }
+        printf("[%s] %-7s read on CPU %3d: %8.0f MB/s, %d of %d blocks local\n", debugTitle, index ? "remote" : "local",
+            cpu, reads*sizeof(buf)/elapsed/1e6, fst.local_blocks, fst.blocks);
+    }
+
+    RSFS_close(fd);
+    RSFS_delete('N');
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+
+
+//report the instrumentation counters gathered while the benchmarks ran
+void print_metrics(){
+    struct rsfs_metrics metrics;
+    RSFS_metrics_snapshot(&metrics);
+
+    printf("\n%16s%12s%12s%10s%10s%10s\n", "Operation", "Calls", "Bytes", "p50 ns", "p99 ns", "max ns");
+    for(int op=0; op<NUM_METRIC_OPS; op++){
+        struct rsfs_op_metrics *o = &metrics.ops[op];
+        if(o->count==0) continue;
+        printf("%16s%12lu%12lu%10lu%10lu%10lu\n", metric_op_names[op], o->count, o->bytes,
+            RSFS_metrics_percentile(o, 0.5), RSFS_metrics_percentile(o, 0.99), RSFS_metrics_percentile(o, 1.0));
+    }
+
+    printf("\n%24s%14s%14s%14s\n", "Lock", "Acquisitions", "Wait ms", "Hold ms");
+    for(int lock=0; lock<NUM_METRIC_LOCKS; lock++){
+        struct rsfs_lock_metrics *l = &metrics.locks[lock];
+        printf("%24s%14lu%14.2f%14.2f\n", metric_lock_names[lock], l->acquisitions, l->wait_ns/1e6, l->hold_ns/1e6);
+    }
+}
+
+
+int main(){
+
+    //initialize the file system
+    int ret = RSFS_init();
+    if(ret!=0){
+        printf("[main] fail to initialize the system\n");
+        return 1;
+    }
+
+    bench_small_appends();
+    bench_dedup_writes();
+    bench_compression();
+    bench_clone();
+    bench_path_lookup();
+    bench_name_scan();
+    bench_checksum();
+    bench_defrag();
+    bench_shards();
+    bench_shm();
+    bench_read_scaling();
+    bench_copy_range();
+    bench_log_mode();
+    bench_batch_metadata();
+    bench_submit_batch();
+    bench_readdir_plus();
+    bench_block_copy();
+    bench_lazy_commit();
+    bench_numa();
+
+    print_metrics();
+    return 0;
+}
@@ -0,0 +1,177 @@
+/*
+    CRC32C checksums of the data blocks and the background scrubber verifying them;
+    routines for computing, storing and checking them
+*/
+
+#define _GNU_SOURCE //for SCHED_IDLE
+#include "def.h"
+#include <time.h>
+#include <sched.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+
+//crc32c() uses the SSE4.2 crc32 instruction when crc32c_init() finds it, the table otherwise
+static uint32_t crc32c_table[256];
+static uint32_t (*crc32c_impl)(uint32_t crc, const void *data, int len) = crc32c_sw;
+const char *crc32c_kind = "software";
+
+
+//CRC32C (Castagnoli, reflected polynomial 0x82F63B78) of len bytes, continuing from crc (0 to start), one byte at a time
+uint32_t crc32c_sw(uint32_t crc, const void *data, int len){
+    const unsigned char *p = data;
+
+    crc = ~crc;
+    for(int i=0; i<len; i++) crc = crc32c_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+//the same with the SSE4.2 crc32 instruction, 8 bytes at a time
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, const void *data, int len){
+    const unsigned char *p = data;
+    uint64_t c = ~crc;
+    int i = 0;
+
+    for(; i+8<=len; i+=8){
+        uint64_t word;
+        memcpy(&word, p+i, 8);
+        c = _mm_crc32_u64(c, word);
+    }
+    for(; i<len; i++) c = _mm_crc32_u8((uint32_t)c, p[i]);
+    return ~(uint32_t)c;
+}
+
+#else
+
+uint32_t crc32c_hw(uint32_t crc, const void *data, int len){
+    return crc32c_sw(crc, data, len);
+}
+
+#endif
+
+//build the table and select the crc32c implementation for this CPU; called by RSFS_init
+void crc32c_init(){
+    for(uint32_t i=0; i<256; i++){
+        uint32_t c = i;
+        for(int k=0; k<8; k++) c = (c & 1) ? (c >> 1) ^ 0x82F63B78u : c >> 1;
+        crc32c_table[i] = c;
+    }
+
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")){
+        crc32c_impl = crc32c_hw;
+        crc32c_kind = "sse4.2";
+    }
+#endif
+}
+
+//CRC32C of len bytes, continuing from crc (0 to start)
+uint32_t crc32c(uint32_t crc, const void *data, int len){
+    return crc32c_impl(crc, data, len);
+}
+
+
+//record the checksum of a data block after its content changed; caller holds inodes_mutex
+void checksum_update(int block_number){
+    struct rsfs *fs = rsfs_current;
+    fs->data_checksum[block_number] = crc32c(0, fs->data_blocks[block_number], BLOCK_SIZE);
+    fs->checksum_valid[block_number] = 1;
+}
+
+//check a data block against its checksum; caller holds inodes_mutex
+//return 0 if it matches (or has none yet), or -1 if it is corrupted
+int checksum_check(int block_number){
+    struct rsfs *fs = rsfs_current;
+    if(fs->checksum_valid[block_number]==0) return 0;
+    if(fs->checksum_valid[block_number]==2) return -1;
+    if(crc32c(0, fs->data_blocks[block_number], BLOCK_SIZE) == fs->data_checksum[block_number]) return 0;
+
+    fs->checksum_valid[block_number] = 2;
+    __atomic_fetch_add(&fs->checksum_mismatches, 1, __ATOMIC_RELAXED);
+    rsfs_log(LOG_WARN, "[checksum] data block %d does not match its checksum\n", block_number);
+    return -1;
+}
+
+
+//background thread: check the allocated blocks SCRUB_BATCH at a time, holding inodes_mutex for one batch only,
+//and pause scrub_interval_ms between batches
+static void *scrub_main(void *arg){
+    struct rsfs *fs = arg; //the instance that started the scrubber
+    rsfs_current = fs;
+    struct timespec pause = {fs->scrub_interval_ms/1000, (fs->scrub_interval_ms%1000)*1000000L};
+    int next = 0;
+
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param); //run only when nothing else wants the CPU
+#endif
+
+    while(!__atomic_load_n(&fs->scrub_stopping, __ATOMIC_ACQUIRE)){
+        int checked = 0;
+
+        metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+        for(int n=0; n<SCRUB_BATCH; n++, next = (next+1) % NUM_DBLOCKS){
+            if(!fs->data_bitmap[next] || fs->checksum_valid[next]!=1) continue;
+            checksum_check(next);
+            checked++;
+        }
+        metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+        __atomic_fetch_add(&fs->scrub_checked, checked, __ATOMIC_RELAXED);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+//start the scrubber, pausing interval_ms between two batches of blocks
+//return 0 if succeed, or -1 if it is already running
+int RSFS_scrub_start(int interval_ms){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->scrub_mutex);
+
+    if(fs->scrub_running || interval_ms<0){
+        pthread_mutex_unlock(&fs->scrub_mutex);
+        rsfs_error(fs->scrub_running ? EBUSY : EINVAL, "[RSFS_scrub_start] scrubber already running or invalid interval\n");
+        return -1;
+    }
+
+    fs->scrub_interval_ms = interval_ms;
+    fs->scrub_stopping = 0;
+    pthread_create(&fs->scrub_thread, NULL, scrub_main, rsfs_current);
+    fs->scrub_running = 1;
+
+    pthread_mutex_unlock(&fs->scrub_mutex);
+    return 0;
+}
+
+//stop the scrubber
+//return 0 if succeed, or -1 if it is not running
+int RSFS_scrub_stop(){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->scrub_mutex);
+
+    if(!fs->scrub_running){
+        pthread_mutex_unlock(&fs->scrub_mutex);
+        rsfs_error(EINVAL, "[RSFS_scrub_stop] scrubber not running\n");
+        return -1;
+    }
+
+    __atomic_store_n(&fs->scrub_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(fs->scrub_thread, NULL);
+    fs->scrub_running = 0;
+
+    pthread_mutex_unlock(&fs->scrub_mutex);
+    return 0;
+}
+
+//turn checksum verification of RSFS_read on (1) or off (0)
+void RSFS_set_checksum_verify(int enable){
+    struct rsfs *fs = rsfs_current;
+    __atomic_store_n(&fs->checksum_verify, enable ? 1 : 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,138 @@
+/*
+    LZ-style codec for compressed files, and the cache of decompressed chunks;
+    routines for managing them
+*/
+
+#include "def.h"
+
+
+//compress len bytes of src into dst (at most cap bytes);
+//return the compressed length, or -1 if it would not fit in cap
+//format: a control byte c < 0x80 is followed by c+1 literal bytes;
+//c >= 0x80 is followed by one offset byte and copies (c&0x7f)+LZ_MIN_MATCH bytes from that far back
+int lz_compress(const char *src, int len, char *dst, int cap){
+    short last_seen[LZ_HASH_SIZE]; //most recent position of each 3-byte prefix hash, or -1
+    for(int i=0; i<LZ_HASH_SIZE; i++) last_seen[i]=-1;
+
+    int in=0, out=0, literal_start=0;
+
+    while(in < len){
+        int match_len=0, match_off=0;
+
+        if(in+LZ_MIN_MATCH <= len){
+            unsigned int h = ((unsigned char)src[in]*506832829u
+                ^ (unsigned char)src[in+1]*2654435761u ^ (unsigned char)src[in+2]) % LZ_HASH_SIZE;
+            int candidate = last_seen[h];
+            last_seen[h] = in;
+
+            if(candidate>=0 && in-candidate<=LZ_MAX_OFFSET){
+                while(in+match_len<len && match_len<LZ_MAX_MATCH
+                    && src[candidate+match_len]==src[in+match_len]) match_len++;
+                match_off = in-candidate;
+            }
+        }
+
+        if(match_len < LZ_MIN_MATCH){
+            in++;
+            //flush a full literal run
+            if(in-literal_start == 128){
+                if(out+1+128 > cap) return -1;
+                dst[out++] = 127;
+                memcpy(dst+out, src+literal_start, 128);
+                out += 128;
+                literal_start = in;
+            }
+            continue;
+        }
+
+        //flush pending literals, then emit the match
+        if(in > literal_start){
+            int run = in-literal_start;
+            if(out+1+run > cap) return -1;
+            dst[out++] = run-1;
+            memcpy(dst+out, src+literal_start, run);
+            out += run;
+        }
+        if(out+2 > cap) return -1;
+        dst[out++] = 0x80 | (match_len-LZ_MIN_MATCH);
+        dst[out++] = match_off;
+        in += match_len;
+        literal_start = in;
+    }
+
+    if(in > literal_start){
+        int run = in-literal_start;
+        if(out+1+run > cap) return -1;
+        dst[out++] = run-1;
+        memcpy(dst+out, src+literal_start, run);
+        out += run;
+    }
+
+    return out;
+}
+
+//decompress clen bytes of src into dst (at most cap bytes);
+//return the decompressed length, or -1 if the input is malformed
+int lz_decompress(const char *src, int clen, char *dst, int cap){
+    int in=0, out=0;
+
+    while(in < clen){
+        unsigned char c = src[in++];
+        if(c < 0x80){
+            int run = c+1;
+            if(in+run > clen || out+run > cap) return -1;
+            memcpy(dst+out, src+in, run);
+            in += run;
+            out += run;
+        }else{
+            if(in >= clen) return -1;
+            int match_len = (c & 0x7f) + LZ_MIN_MATCH;
+            int match_off = (unsigned char)src[in++];
+            if(match_off==0 || match_off>out || out+match_len>cap) return -1;
+            for(int i=0; i<match_len; i++, out++) dst[out] = dst[out-match_off]; //may overlap
+        }
+    }
+
+    return out;
+}
+
+
+//look up a decompressed chunk; return its length and copy it to dst, or return -1 on a miss
+int chunk_cache_get(int inode_number, int chunk, char *dst){
+    struct rsfs *fs = rsfs_current;
+    struct chunk_cache_entry *e = &fs->chunk_cache[(inode_number*MAX_CHUNKS+chunk) % CHUNK_CACHE_SIZE];
+    int length = -1;
+
+    rsfs_mutex_lock(&fs->chunk_cache_mutex);
+    if(e->valid && e->inode_number==inode_number && e->chunk==chunk){
+        memcpy(dst, e->data, e->length);
+        length = e->length;
+    }
+    pthread_mutex_unlock(&fs->chunk_cache_mutex);
+
+    return length;
+}
+
+//remember a decompressed chunk, evicting whatever occupied its slot
+void chunk_cache_put(int inode_number, int chunk, const char *data, int length){
+    struct rsfs *fs = rsfs_current;
+    struct chunk_cache_entry *e = &fs->chunk_cache[(inode_number*MAX_CHUNKS+chunk) % CHUNK_CACHE_SIZE];
+
+    rsfs_mutex_lock(&fs->chunk_cache_mutex);
+    e->valid = 1;
+    e->inode_number = inode_number;
+    e->chunk = chunk;
+    e->length = length;
+    memcpy(e->data, data, length);
+    pthread_mutex_unlock(&fs->chunk_cache_mutex);
+}
+
+//drop every cached chunk of a file (its content changed or it was deleted)
+void chunk_cache_invalidate(int inode_number){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->chunk_cache_mutex);
+    for(int i=0; i<CHUNK_CACHE_SIZE; i++){
+        if(fs->chunk_cache[i].inode_number==inode_number) fs->chunk_cache[i].valid = 0;
+    }
+    pthread_mutex_unlock(&fs->chunk_cache_mutex);
+}
@@ -1,45 +1,431 @@
 /*
-    Allocation of data block, data block bitmaps and mutex to guard M.E. access; 
-    routines for managing them
+    data blocks, data block bitmap and the dedup index (fields of struct rsfs);
+    routines for managing them, and the copy writes use to fill them
 */
 
 #include "def.h"
+#include <limits.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BLOCK_COPY_X86 1
+#endif
 
 
-//allocation of data block and data block bitmaps
-void *data_blocks[NUM_DBLOCKS];
-int data_bitmap[NUM_DBLOCKS];
-pthread_mutex_t data_bitmap_mutex;
+//copying into data blocks: copies of at least block_copy_threshold bytes, the size of the last-level cache found by
+//block_copy_init(), bypass the cache with non-temporal stores so that a large write does not evict the working set;
+//until then (and off x86) every copy is a memcpy
+static void (*block_copy_large)(void *dst, const void *src, size_t n) = block_copy_memcpy;
+static size_t block_copy_threshold = SIZE_MAX;
+const char *block_copy_kind = "memcpy";
 
+void block_copy_memcpy(void *dst, const void *src, size_t n){
+    memcpy(dst, src, n);
+}
+
+#ifdef BLOCK_COPY_X86
+
+//16-byte streaming stores from a destination aligned by a first short memcpy; the fence orders them before the
+//stores that publish the write (inode_write_end, the unlock of inodes_mutex)
+__attribute__((target("sse2")))
+void block_copy_nt(void *dst, const void *src, size_t n){
+    char *d = dst;
+    const char *s = src;
+
+    size_t head = (16 - ((uintptr_t)d & 15)) & 15;
+    if(head > n) head = n;
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    for(; n>=64; n-=64, d+=64, s+=64){
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s+16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s+32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s+48));
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d+16), b);
+        _mm_stream_si128((__m128i *)(d+32), c);
+        _mm_stream_si128((__m128i *)(d+48), e);
+    }
+    _mm_sfence();
+    memcpy(d, s, n);
+}
+
+#else
+
+void block_copy_nt(void *dst, const void *src, size_t n){
+    memcpy(dst, src, n);
+}
+
+#endif
+
+//find the size of the last-level cache and select the streaming copy if the CPU has it; called by RSFS_init
+void block_copy_init(){
+    long llc = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if(llc<=0) llc = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if(llc<=0) llc = BLOCK_COPY_DEFAULT_LLC;
+    block_copy_threshold = llc;
+#ifdef BLOCK_COPY_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse2")){
+        block_copy_large = block_copy_nt;
+        block_copy_kind = "sse2 streaming";
+    }
+#endif
+}
+
+//copy n bytes into data blocks: memcpy, or non-temporal stores when n is at least the size of the last-level cache
+void block_copy(void *dst, const void *src, size_t n){
+    if(n >= block_copy_threshold) block_copy_large(dst, src, n);
+    else memcpy(dst, src, n);
+}
+
+//the size from which block_copy uses non-temporal stores
+size_t block_copy_large_size(){
+    return block_copy_threshold;
+}
+
+
+//helper: hash the content of a full data block
+//four independent multiply-rotate lanes over 32-bit words, so the compiler can vectorize the loop
+static uint32_t block_hash(const void *data){
+    uint32_t lane[4] = {0x9E3779B1u, 0x85EBCA77u, 0xC2B2AE3Du, 0x27D4EB2Fu};
+    const unsigned char *p = data;
+
+    for(int i=0; i+16<=BLOCK_SIZE; i+=16){
+        for(int j=0; j<4; j++){
+            uint32_t word;
+            memcpy(&word, p+i+4*j, 4);
+            lane[j] += word * 0x85EBCA77u;
+            lane[j] = (lane[j]<<13) | (lane[j]>>19);
+            lane[j] *= 0x9E3779B1u;
+        }
+    }
+
+    uint32_t h = lane[0] ^ ((lane[1]<<7)|(lane[1]>>25)) ^ ((lane[2]<<12)|(lane[2]>>20)) ^ ((lane[3]<<18)|(lane[3]>>14));
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 16;
+    return h;
+}
+
+//helper: remove a block from the dedup index; caller holds data_bitmap_mutex
+static void dedup_remove(int block_number){
+    struct rsfs *fs = rsfs_current;
+    if(!fs->dedup_indexed[block_number]) return;
+
+    int *link = &fs->dedup_bucket[fs->dedup_hash[block_number] % DEDUP_BUCKETS];
+    while(*link){
+        if(*link-1 == block_number){
+            *link = fs->dedup_next[block_number];
+            break;
+        }
+        link = &fs->dedup_next[*link-1];
+    }
+    fs->dedup_indexed[block_number] = 0;
+}
+
+
+//number of allocated blocks in a segment of the log; caller holds data_bitmap_mutex
+int segment_live_blocks(int segment){
+    struct rsfs *fs = rsfs_current;
+    int live = 0;
+    for(int i=segment*SEGMENT_BLOCKS; i<(segment+1)*SEGMENT_BLOCKS; i++) live += fs->data_bitmap[i];
+    return live;
+}
+
+//helper (log-structured mode): the free block at the head of the log, which moves on to the next clean segment
+//once its segment is used up; without any clean segment, the first free block after the head;
+//return -1 if no block is free; caller holds data_bitmap_mutex
+static int log_next_block(){
+    struct rsfs *fs = rsfs_current;
+    int head = fs->log_head;
+    if(head<NUM_DBLOCKS && head%SEGMENT_BLOCKS!=0 && !fs->data_bitmap[head]){
+        fs->log_head = head+1;
+        return head;
+    }
+
+    int first_segment = (head/SEGMENT_BLOCKS) % NUM_SEGMENTS;
+    for(int k=0; k<NUM_SEGMENTS; k++){
+        int segment = (first_segment+k) % NUM_SEGMENTS;
+        if(segment_live_blocks(segment)==0){
+            fs->log_head = segment*SEGMENT_BLOCKS + 1;
+            return segment*SEGMENT_BLOCKS;
+        }
+    }
+
+    for(int k=0; k<NUM_DBLOCKS; k++){
+        int i = (head+k) % NUM_DBLOCKS;
+        if(!fs->data_bitmap[i]){
+            fs->log_head = i+1;
+            return i;
+        }
+    }
+    return -1;
+}
 
 //to allocate an empty data block and return the block-number;
+//in log-structured mode the block is taken at the head of the log, otherwise it is the lowest free one
 //if no free data block is available, return -1
 int allocate_data_block(){
+    struct rsfs *fs = rsfs_current;
 
     int block_number=-1; //init
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
 
-    for(int i=0; i<NUM_DBLOCKS; i++){
-        if(data_bitmap[i]==0){//find an available data block
-            block_number=i;
-            data_bitmap[i]=1; //mark it as allocated
-            break;
+    if(fs->log_mode){
+        block_number = log_next_block();
+        fs->log_last = block_number;
+    }else{
+        //the range of the caller's NUMA node first, then the next ones (see numa.c): on a single node, the lowest block
+        int first = numa_first_block(numa_local_index());
+        for(int k=0; k<NUM_DBLOCKS; k++){
+            int i = (first+k) % NUM_DBLOCKS;
+            if(fs->data_bitmap[i]==0){//find an available data block
+                block_number=i;
+                break;
+            }
         }
     }
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    if(block_number>=0){
+        fs->data_bitmap[block_number]=1; //mark it as allocated
+        fs->data_refcount[block_number]=1; //referenced by the caller only
+        fs->checksum_valid[block_number]=0; //until the caller writes it
+        __atomic_fetch_add(&fs->data_blocks_used, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&fs->data_block_refs, 1, __ATOMIC_RELAXED);
+    }
+
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
 
     return block_number;
 }
 
+//to allocate n adjacent empty data blocks and return the first block-number: the first free run from block start
+//on, then from block 0 (pass the first block of a node's range to keep the run on that node, see numa.c);
+//if there is no such run, return -1
+int allocate_data_run(int n, int start){
+    struct rsfs *fs = rsfs_current;
+
+    int first=-1, run=0;
+    if(start<0 || start>=NUM_DBLOCKS) start = 0;
+
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    for(int k=0; k<NUM_DBLOCKS && n>0; k++){
+        int i = (start+k) % NUM_DBLOCKS;
+        if(i==0) run = 0; //a run does not wrap around the end of the array
+        run = fs->data_bitmap[i] ? 0 : run+1;
+        if(run==n){
+            first = i-n+1;
+            break;
+        }
+    }
+
+    for(int i=first; first>=0 && i<first+n; i++){
+        fs->data_bitmap[i]=1; //mark it as allocated
+        fs->data_refcount[i]=1; //referenced by the caller only
+        fs->checksum_valid[i]=0; //until the caller writes it
+    }
+    if(first>=0){
+        __atomic_fetch_add(&fs->data_blocks_used, n, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&fs->data_block_refs, n, __ATOMIC_RELAXED);
+    }
+
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    return first;
+}
+
+//helper: drop one reference to a data block; caller holds data_bitmap_mutex
+static void put_data_block(int block_number){
+    struct rsfs *fs = rsfs_current;
+
+    if(fs->data_refcount[block_number]>0){
+        fs->data_refcount[block_number]--;
+        __atomic_fetch_sub(&fs->data_block_refs, 1, __ATOMIC_RELAXED);
+    }
+    if(fs->data_refcount[block_number]==0 && fs->data_bitmap[block_number]){
+        dedup_remove(block_number);
+        fs->data_bitmap[block_number]=0; //reset it to available
+        __atomic_fetch_sub(&fs->data_blocks_used, 1, __ATOMIC_RELAXED);
+    }
+}
+
+//helper: the number of whole memory pages in the data block array, which starts on a page boundary, and the blocks
+//per page in *blocks_per_page; 0 when the array is smaller than a page (as with the default 32-byte blocks), or a page
+//is not a multiple of a block
+static int data_pages(int *blocks_per_page){
+    struct rsfs *fs = rsfs_current;
+    static long page_size = 0;
+    if(page_size==0) page_size = sysconf(_SC_PAGESIZE);
+
+    *blocks_per_page = (page_size>0 && page_size%BLOCK_SIZE==0) ? page_size/BLOCK_SIZE : 0;
+    if(*blocks_per_page==0 || (uintptr_t)fs->data_blocks % page_size != 0) return 0;
+    return NUM_DBLOCKS / *blocks_per_page;
+}
+
+//helper: give back to the OS the pages of the data block array overlapping blocks first..last whose blocks are all
+//free, one madvise per run of adjacent pages; a released page reads as zeros and is committed again by its next
+//write (a page of a shared instance is removed from the segment); caller holds data_bitmap_mutex
+static void release_free_pages(int first, int last){
+    struct rsfs *fs = rsfs_current;
+    int per_page;
+    int num_pages = data_pages(&per_page);
+    if(num_pages==0) return;
+
+    int run_start = -1;
+    for(int page=first/per_page; page<=last/per_page+1; page++){
+        int free_page = (page<=last/per_page && page<num_pages);
+        for(int b=page*per_page; free_page && b<(page+1)*per_page; b++) free_page = !fs->data_bitmap[b];
+
+        if(free_page && run_start<0) run_start = page;
+        if(!free_page && run_start>=0){
+            size_t len = (size_t)(page-run_start)*per_page*BLOCK_SIZE;
+            if(madvise(fs->data_blocks[run_start*per_page], len, fs->shared ? MADV_REMOVE : MADV_DONTNEED)==0){
+                fs->pages_released += page-run_start;
+            }
+            run_start = -1;
+        }
+    }
+}
+
+//data blocks whose memory page is resident (committed), from mincore() over the data block array
+int data_blocks_resident(){
+    struct rsfs *fs = rsfs_current;
+    int per_page;
+    int num_pages = data_pages(&per_page);
+    if(num_pages==0) return NUM_DBLOCKS; //sharing a page with the rest of the instance, which is resident
+
+    unsigned char vec[num_pages];
+    if(mincore(fs->data_blocks, (size_t)num_pages*per_page*BLOCK_SIZE, vec)!=0) return NUM_DBLOCKS;
+
+    int resident = NUM_DBLOCKS - num_pages*per_page; //the blocks of the last, partial page
+    for(int page=0; page<num_pages; page++) resident += (vec[page]&1) ? per_page : 0;
+    return resident;
+}
+
 //to free a data block with the provided block_number
+//shared blocks only lose one reference; the block becomes available when the last one is dropped,
+//and its page is given back to the OS once all the blocks in it are free
 void free_data_block(int block_number){
+    struct rsfs *fs = rsfs_current;
+
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    put_data_block(block_number);
+    if(!fs->data_bitmap[block_number]) release_free_pages(block_number, block_number);
+
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+}
+
+//to free n data blocks like free_data_block(), under a single acquisition of data_bitmap_mutex,
+//releasing the pages they leave free in runs
+void free_data_blocks(const int *block_numbers, int n){
+    struct rsfs *fs = rsfs_current;
+
+    if(n<=0) return;
+
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    int first = NUM_DBLOCKS, last = -1;
+    for(int i=0; i<n; i++){
+        put_data_block(block_numbers[i]);
+        if(!fs->data_bitmap[block_numbers[i]]){
+            if(block_numbers[i]<first) first = block_numbers[i];
+            if(block_numbers[i]>last) last = block_numbers[i];
+        }
+    }
+    if(last>=0) release_free_pages(first, last);
+
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+}
+
+//to add a reference to an allocated data block (the block becomes shared)
+void ref_data_block(int block_number){
+    struct rsfs *fs = rsfs_current;
+
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    fs->data_refcount[block_number]++;
+    __atomic_fetch_add(&fs->data_block_refs, 1, __ATOMIC_RELAXED);
+
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+}
+
+//copy-on-write: called before the content of a data block is modified;
+//a private block is returned as is (and leaves the dedup index, as its content changes),
+//a shared block is copied into a new private block, which is returned;
+//in log-structured mode a private block is copied to the head of the log as well (written out of place),
+//unless it is the block the head is still filling, or no block is free
+//return -1 if a copy is needed but no free data block is available
+int cow_data_block(int block_number){
+    struct rsfs *fs = rsfs_current;
+
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    int shared = (fs->data_refcount[block_number]>1);
+    if(!shared){
+        dedup_remove(block_number);
+        if(!fs->log_mode || block_number==fs->log_last){
+            metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+            return block_number;
+        }
+    }
 
-    pthread_mutex_lock(&data_bitmap_mutex);
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
 
-    data_bitmap[block_number]=0; //reset it to available
+    int new_block = allocate_data_block();
+    if(new_block<0) return shared ? -1 : block_number;
 
-    pthread_mutex_unlock(&data_bitmap_mutex);
+    memcpy(fs->data_blocks[new_block], fs->data_blocks[block_number], BLOCK_SIZE);
+    free_data_block(block_number); //drop our reference to the old block
+
+    return new_block;
 }
 
+//dedup: called after a data block has been filled completely;
+//if an identical block is already indexed, take a reference to it and release this one,
+//otherwise index this block; return the block number the caller should point to
+int dedup_data_block(int block_number){
+    struct rsfs *fs = rsfs_current;
+
+    if(!fs->dedup_enabled) return block_number;
+
+    uint32_t h = block_hash(fs->data_blocks[block_number]);
+
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    if(fs->dedup_indexed[block_number]){
+        metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+        return block_number;
+    }
+
+    int *bucket = &fs->dedup_bucket[h % DEDUP_BUCKETS];
+    for(int b=*bucket; b; b=fs->dedup_next[b-1]){
+        int candidate = b-1;
+        if(fs->dedup_hash[candidate]==h
+            && memcmp(fs->data_blocks[candidate], fs->data_blocks[block_number], BLOCK_SIZE)==0){
+            fs->data_refcount[candidate]++;
+            if(--fs->data_refcount[block_number]==0){
+                fs->data_bitmap[block_number]=0;
+                __atomic_fetch_sub(&fs->data_blocks_used, 1, __ATOMIC_RELAXED);
+            }
+            metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+            return candidate;
+        }
+    }
+
+    fs->dedup_hash[block_number] = h;
+    fs->dedup_next[block_number] = *bucket;
+    *bucket = block_number+1;
+    fs->dedup_indexed[block_number] = 1;
+
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+
+    return block_number;
+}
@@ -0,0 +1,55 @@
+/*
+    dentry cache: (directory inode, name) -> inode number, including negative entries for missing names;
+    routines for looking up, filling and purging it
+*/
+
+#include "def.h"
+
+
+//helper: the key bits of an entry
+static inline uint32_t dcache_key(int dir, char name){
+    return (1u<<16) | ((uint32_t)dir<<8) | (unsigned char)name;
+}
+
+//helper: the slot of an entry
+static inline uint32_t *dcache_slot(int dir, char name){
+    struct rsfs *fs = rsfs_current;
+    return &fs->dcache_slots[(dir*31u + (unsigned char)name) & (DCACHE_SIZE-1)];
+}
+
+
+//look up name in directory dir without locking;
+//return its inode number, -1 if it is known to be missing, or DCACHE_MISS if the cache cannot tell
+int dcache_lookup(int dir, char name){
+    struct rsfs *fs = rsfs_current;
+    if(!fs->dcache_enabled) return DCACHE_MISS;
+
+    uint32_t entry = __atomic_load_n(dcache_slot(dir, name), __ATOMIC_ACQUIRE);
+    if((entry>>8) != dcache_key(dir, name)) return DCACHE_MISS;
+
+    int inode_number = entry & 0xFF;
+    return inode_number==0xFF ? -1 : inode_number;
+}
+
+//record that name in directory dir refers to inode_number (-1 if missing), replacing whatever shared its slot;
+//the caller holds root_dir_mutex, so entries always match the directories
+void dcache_insert(int dir, char name, int inode_number){
+    uint32_t entry = (dcache_key(dir, name)<<8) | (inode_number<0 ? 0xFF : inode_number);
+    __atomic_store_n(dcache_slot(dir, name), entry, __ATOMIC_RELEASE);
+}
+
+//drop every entry of directory dir (when it is removed, as its inode number will be reused);
+//the caller holds root_dir_mutex
+void dcache_purge(int dir){
+    struct rsfs *fs = rsfs_current;
+    for(int i=0; i<DCACHE_SIZE; i++){
+        uint32_t entry = __atomic_load_n(&fs->dcache_slots[i], __ATOMIC_RELAXED);
+        if((entry>>24) && ((entry>>16) & 0xFF)==(uint32_t)dir) __atomic_store_n(&fs->dcache_slots[i], 0, __ATOMIC_RELEASE);
+    }
+}
+
+//drop every entry
+void dcache_clear(){
+    struct rsfs *fs = rsfs_current;
+    for(int i=0; i<DCACHE_SIZE; i++) __atomic_store_n(&fs->dcache_slots[i], 0, __ATOMIC_RELEASE);
+}
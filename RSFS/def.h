@@ -1,5 +1,5 @@
 /*
-    definitions of constants, data structures, and API
+    internal definitions of constants, data structures, and routines; the public API is in rsfs.h
 */
 
 
@@ -7,57 +7,78 @@
 #include <string.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include "rsfs.h"
 
 
-//global constants
-#define NUM_INODES 8 //total number of inodes
-#define NUM_DBLOCKS 64 //total number of data blocks
-#define NUM_POINTERS 8 //total number of (direct) pointers for each inode; i.e., each file can have at most this number of data blocks
-#define BLOCK_SIZE 32 //size of each data block (unit: byte)
-#define NUM_OPEN_FILE 8 //maximum number of files that can be open at a time in the whole system
-
-#define RSFS_RDONLY 0 //a value for access_flag in RSFS_open(): file is open for read only
-#define RSFS_RDWR 1 //a value for access_flag in RSFS_open(): file is open for read and write  
-
-#define RSFS_SEEK_SET 0 //a value for whence in RSFS_fseek()
-#define RSFS_SEEK_CUR 1 //a value for whence in RSFS_fseek()
-#define RSFS_SEEK_END 2 //a value for whence in RSFS_fseek()
+//internal constants
+#define DEDUP_BUCKETS 32 //number of hash buckets in the dedup index of full data blocks
+#define COMPRESS_CHUNK_SIZE 64 //compressed files are (de)compressed in units of this many bytes of content
+#define MAX_CHUNKS (MAX_FILE_SIZE/COMPRESS_CHUNK_SIZE) //number of chunks of a compressed file of maximum length
+#define CHUNK_CACHE_SIZE 8 //number of decompressed chunks kept in the chunk cache
+#define LZ_HASH_SIZE 64 //entries of the match-finder hash table in lz_compress()
+#define LZ_MIN_MATCH 3 //shortest back-reference emitted by lz_compress()
+#define LZ_MAX_MATCH (127+LZ_MIN_MATCH) //longest back-reference
+#define LZ_MAX_OFFSET 255 //farthest back-reference
+#define DCACHE_SIZE 256 //slots of the dentry cache (a power of two)
+#define DCACHE_MISS -2 //returned by dcache_lookup() when the cache holds no entry for the name
+#define SCRUB_BATCH 8 //data blocks the scrubber checks per acquisition of inodes_mutex
+#define SEGMENT_BLOCKS 8 //data blocks per segment of the log (log-structured mode)
+#define NUM_SEGMENTS (NUM_DBLOCKS/SEGMENT_BLOCKS) //segments of the log
+#define READ_RETRIES 4 //lock-free attempts of RSFS_read, disturbed by writers, before it takes inodes_mutex
+#define BLOCK_COPY_DEFAULT_LLC (8<<20) //last-level cache size (unit: byte) assumed when the system does not report it
+#define MAX_NUMA_NODES 4 //nodes the data blocks are split over at most (see numa.c)
+#define MAX_NUMA_NODE_ID 63 //highest node id a range of data blocks can be bound to
+#define DATA_PAGE_ALIGN 4096 //alignment of the data block array, so that its pages (but the last) hold data blocks only
+#define LAZY_COMMIT_MIN (64*1024) //RSFS_new maps instances at least this large (unit: byte) from the OS, see instance.c
+#define WB_BUFFER_SIZE (4*BLOCK_SIZE) //size of the per-fd write-back buffer used in RSFS_BUFFERED mode (unit: byte)
 
 #define DEBUG 0 //1-enable debug, 0-disable debug prints
 
-//directory entry
-struct dir_entry{
-    char name; //file name must be at most three characters
-    char inode_number; //inode_number identifying the inode of the file
+#define LOG_RING_SIZE 64 //messages a thread can have pending before further ones are dropped
+#define LOG_MSG_SIZE 128 //longest log message, including the terminating '\0' (unit: byte)
+#define METRICS 1 //1-enable per-thread call/lock instrumentation, 0-disable it
+#define METRICS_SUB_BUCKETS 8 //linear sub-buckets per power of two in latency histograms
+#define TRACE_RING_SIZE 4096 //records buffered in memory by the tracer before they are written to the trace file
+#define METRICS_SAMPLE_RATE 16 //call latencies and lock hold times are measured on one call/acquisition out of this many
+
+//directory entries, kept inline in the directory's inode; the names are contiguous (one byte each,
+//0 for a free entry) so that a lookup compares all of them at once with name_scan()
+#define DIR_ENTRIES (INLINE_DATA_SIZE/2) //entries per directory
+struct dir_block{
+    char names[DIR_ENTRIES]; //file name of each entry
+    char inode_numbers[DIR_ENTRIES]; //inode_number identifying the inode of each entry's file
 };
-extern int root_inode_number; //initial value
-extern pthread_mutex_t root_dir_mutex;
 
 
 //inode data structure: inodes implemented in inode.c
 struct inode {
-    char block[NUM_POINTERS];
+    union {
+        char block[NUM_POINTERS]; //data block numbers, valid when is_inline==0
+        char inline_data[INLINE_DATA_SIZE]; //file content, valid when is_inline==1
+    };
+    char is_inline; //1-content lives in inline_data, 0-content lives in data blocks
+    char compressed; //1-blocks hold the LZ-compressed chunks of the content back to back
+    char is_dir; //1-a directory: inline_data holds its struct dir_block and length counts the entries
+    short chunk_clen[MAX_CHUNKS]; //stored length of each chunk of a compressed file (== content length if stored raw)
     int length;
     // Added for reader-writer problem
     int reader_count;
     pthread_mutex_t rwlock;
     pthread_cond_t readers_done;
     int writer_active;
+    char unlinked; //1 if the file was deleted while open: it is freed by the last RSFS_close
+    unsigned int seq; //even while the content is stable, odd while a writer changes it: see inode_write_begin()
 };
-extern struct inode inodes[NUM_INODES]; //global array of inodes
-extern pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
-
-//inode bitmap: implemented in inode.c
-extern int inode_bitmap[NUM_INODES]; //global inode bitmap
-extern pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
 
-//data bitmap: implemented in data_block.c
-extern int data_bitmap[NUM_DBLOCKS]; //global data-block bitmap
-extern pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
-
-//data blocks: implemented in data_block.c
-extern void *data_blocks[NUM_DBLOCKS]; //global array of pointers to the data blocks
-extern void *root_data_block;
+//snapshot of the file system: snapshot table implemented in snapshot.c
+struct snapshot{
+    char used; //0-the slot is free, or 1- it holds a snapshot
+    int num_files; //number of files captured
+    char names[NUM_INODES]; //file names, in root directory order
+    struct inode files[NUM_INODES]; //content of each file (only length, inline data and block pointers are used)
+};
 
 //open file entry: open_file_table implemented in open_file_table.c 
 struct open_file_entry{
@@ -66,25 +87,199 @@ struct open_file_entry{
     int inode_number;
     int position; //current position of the file
     char access_flag; //RSFS_RDONLY or RSFS_RDWR - how the file can be accessed by the process/thread openning this file
+    char buffered; //1 if opened with RSFS_BUFFERED: appends accumulate in wb_buf until flushed
+    int wb_len; //number of pending bytes in wb_buf, not yet copied into data blocks
+    char wb_buf[WB_BUFFER_SIZE]; //write-back buffer for delayed allocation
+    char wb_error; //1 if a flush ran out of data blocks: the bytes it could not store stay in wb_buf, and the next
+                   //RSFS_append, RSFS_fsync or RSFS_close fails with ENOSPC unless a retried flush stores them
+};
+
+//entry of the cache of decompressed chunks: implemented in compress.c
+struct chunk_cache_entry{
+    char valid; //1-the entry holds a chunk
+    int inode_number;
+    int chunk; //index of the chunk inside the file
+    int length; //number of valid bytes in data
+    char data[COMPRESS_CHUNK_SIZE];
 };
-extern struct open_file_entry open_file_table[NUM_OPEN_FILE]; //global table (array) of open_file_entries 
-extern pthread_mutex_t open_file_table_mutex; //mutex to guard M.E. access to the table
+
+//a file system instance: all the state of one file system, so that a process can host several (see instance.c)
+struct rsfs{
+    //inodes and inode bitmap: inode.c
+    struct inode inodes[NUM_INODES]; //array of inodes
+    pthread_mutex_t inodes_mutex; //mutex to guard mutually-exclusive access of inodes
+    int inode_bitmap[NUM_INODES]; //inode bitmap
+    pthread_mutex_t inode_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+    int inodes_used; //number of allocated inodes (updated under inode_bitmap_mutex, read without it)
+    int root_inode_number;
+
+    //directories: dir.c, dcache.c
+    pthread_mutex_t root_dir_mutex; //guards the entries of every directory (the root and its sub-directories)
+    //dentry cache: direct-mapped slots, each packing one entry into a word so that lookups are a single atomic load:
+    //bit 24 - valid, bits 16..23 - directory inode, bits 8..15 - name, bits 0..7 - inode number (0xFF if missing)
+    uint32_t dcache_slots[DCACHE_SIZE];
+    int dcache_enabled; //1-path lookups use the cache (default), 0-they always search the directories
+
+    //data blocks and data bitmap: data_block.c
+    //the blocks themselves rather than pointers to them, so that the instance holds no address and can be mapped
+    //anywhere by several processes (see shm.c); consecutive block numbers are adjacent in memory
+    //page-aligned: pages of the array holding free blocks only are given back to the OS (release_free_pages)
+    char data_blocks[NUM_DBLOCKS][BLOCK_SIZE] __attribute__((aligned(DATA_PAGE_ALIGN)));
+    int data_bitmap[NUM_DBLOCKS]; //data-block bitmap
+    pthread_mutex_t data_bitmap_mutex; //mutex to guard mutually-exclusive access of the bitmap
+    int data_refcount[NUM_DBLOCKS]; //number of inode pointers sharing each data block (guarded by data_bitmap_mutex)
+    int dedup_enabled; //1-full blocks are deduplicated by content, 0-disabled (default)
+    int data_blocks_used; //number of allocated data blocks (updated under data_bitmap_mutex, read without it)
+    int data_block_refs; //number of references to allocated data blocks (likewise)
+    uint64_t pages_released; //pages of free data blocks given back to the OS (under data_bitmap_mutex)
+    int numa_nodes; //NUMA nodes the data blocks are split over, each owning a range of blocks (1 on a single node)
+    int numa_node_ids[MAX_NUMA_NODES]; //the node of each range
+    int dedup_bucket[DEDUP_BUCKETS]; //first indexed block in each bucket, stored +1 so that 0 means empty
+    int dedup_next[NUM_DBLOCKS]; //next indexed block in the same bucket, stored +1 as well
+    uint32_t dedup_hash[NUM_DBLOCKS]; //hash of an indexed block's content
+    char dedup_indexed[NUM_DBLOCKS]; //1 if the block is in the dedup index
+
+    //block checksums and the scrubber: checksum.c
+    uint32_t data_checksum[NUM_DBLOCKS]; //CRC32C of each data block's content (guarded by inodes_mutex)
+    char checksum_valid[NUM_DBLOCKS]; //1 once data_checksum is set for the block's current content, 2 if found corrupted
+    int checksum_verify; //1-RSFS_read verifies every block it reads, 0-disabled (default)
+    uint64_t checksum_mismatches; //blocks found not matching their checksum (each counted once until rewritten)
+    uint64_t scrub_checked; //blocks checked by the scrubber
+    pthread_t scrub_thread;
+    int scrub_running;
+    int scrub_stopping;
+    int scrub_interval_ms; //pause between two batches
+    pthread_mutex_t scrub_mutex; //serializes start/stop
+
+    //compactor: defrag.c
+    uint64_t defrag_moved; //data blocks relocated by the compactor
+    pthread_t defrag_thread;
+    int defrag_running;
+    int defrag_stopping;
+    int defrag_interval_ms; //pause between two checks of the fragmentation
+    int defrag_threshold; //fragmentation (percent) from which a pass is run
+    pthread_mutex_t defrag_mutex; //serializes start/stop
+
+    //log-structured mode and its cleaner: lfs.c
+    int log_mode; //1-blocks are taken at the head of a log of segments and rewritten out of place, 0-in place (default)
+    int log_head; //next block of the log (guarded by data_bitmap_mutex)
+    int log_last; //block most recently taken at the head: it is still being filled, so it is updated in place
+    uint64_t cleaner_moved; //live blocks relocated by the cleaner
+    pthread_t cleaner_thread;
+    int cleaner_running;
+    int cleaner_stopping;
+    int cleaner_interval_ms; //pause between two passes
+    int cleaner_threshold; //segments whose live blocks are at most this percentage are cleaned
+    pthread_mutex_t cleaner_mutex; //serializes start/stop
+
+    //cache of decompressed chunks: compress.c
+    struct chunk_cache_entry chunk_cache[CHUNK_CACHE_SIZE];
+    pthread_mutex_t chunk_cache_mutex;
+
+    //snapshots: snapshot.c
+    struct snapshot snapshots[NUM_SNAPSHOTS]; //table of snapshots
+    pthread_mutex_t snapshots_mutex; //mutex to guard M.E. access to the table
+
+    //open file table: open_file_table.c
+    struct open_file_entry open_file_table[NUM_OPEN_FILE]; //table (array) of open_file_entries 
+    pthread_mutex_t open_file_table_mutex; //mutex to guard M.E. access to the table
+    int open_entries; //number of entries in use (updated under open_file_table_mutex, read without it)
+
+    pthread_mutex_t mutex_for_fs_stat; //mutex used by RSFS_stat()
+
+    int shared; //1 if the instance lives in a shared memory segment: its mutexes are process-shared and robust
+    int mapped; //1 if RSFS_new mapped the instance from the OS, 0 if it came from the heap (or is not from RSFS_new)
+};
+
+//the instance the calling thread works on: the default one unless RSFS_use() selected another;
+//each routine of the file system takes it once on entry (struct rsfs *fs = rsfs_current) and works on fs
+extern __thread struct rsfs *rsfs_current;
 
 
 //routines for directory management: implemented in dir.c
-struct dir_entry *search_dir(char file_name); //get the dir_entry for file_name
-struct dir_entry *insert_dir(char file_name, char inode_number); //create a dir_entry for file_name and its inode_number; the dir_entry is returned
-int delete_dir(char file_name); //delete the dir_entry for the given file name from the global directory
+int search_dir(int dir, char file_name); //get the inode_number of file_name in directory dir, or -1
+int insert_dir(int dir, char file_name, int inode_number); //create a dir_entry in dir; return the inode_number it holds, or a negative value
+int delete_dir(int dir, char file_name, int is_dir); //delete the dir_entry for file_name from dir; return its inode_number or a negative value
+int insert_dir_many(int dir, const char *names, int n, int *results); //create files for n names at once; return how many
+int delete_dir_many(int dir, const char *names, int n, int *results); //delete the dir_entries of n files at once; return how many
+void name_scan_init(); //select the name_scan implementation for this CPU
+int name_scan(const char *names, int n, char name); //index of the first name in names[0..n-1], or -1: SIMD when the CPU has it
+int name_scan_scalar(const char *names, int n, char name); //name_scan comparing one name at a time
+int name_scan_sse2(const char *names, int n, char name); //name_scan comparing 16 names at a time (scalar off x86)
+int name_scan_avx2(const char *names, int n, char name); //name_scan comparing 32 names at a time (SSE2 without AVX2)
+extern const char *name_scan_kind; //"scalar", "sse2" or "avx2": the implementation name_scan selected
+int lookup_path(const char *path, int *parent, char *name); //resolve "a/b/c"; return the inode_number, or a negative errno value
+
+//dentry cache: implemented in dcache.c
+int dcache_lookup(int dir, char name); //cached inode_number of name in dir, -1 if cached as missing, or DCACHE_MISS
+void dcache_insert(int dir, char name, int inode_number); //cache a lookup result (-1 if missing); caller holds root_dir_mutex
+void dcache_purge(int dir); //drop the cached entries of a removed directory; caller holds root_dir_mutex
+void dcache_clear(); //drop every cached entry
 
 
 //routines for inode management: implemented in inode.c
 int allocate_inode(); //allocate an unused inode, and the inode_number is returned
+int allocate_inodes(int n, int *inode_numbers); //allocate up to n unused inodes at once; return how many
 void free_inode(int inode_number); //free (release) an inode
+void free_inodes(const int *inode_numbers, int n); //free n inodes at once
+void share_inode_content(struct inode *dst, struct inode *src); //make dst a copy-on-write copy of src's content
+void release_inode_content(struct inode *inode); //drop the references an inode holds on its data blocks
+void release_inodes_content(const int *inode_numbers, int n); //the same for n distinct inodes, freeing their blocks at once
+void inode_write_begin(struct inode *inode); //start changing the content of an inode (length, pointers, data); caller holds inodes_mutex
+void inode_write_end(struct inode *inode); //end of the change: lock-free readers that overlapped it retry
 
 
 //routines for data block management: implemented in data_block.c
 int allocate_data_block(); //allocate an unused data block, and the block_number is returned
-void free_data_block(int block_number); //free (release) a data block
+int allocate_data_run(int n, int start); //allocate n adjacent unused data blocks, searching from block start; return the first block_number, or -1
+void free_data_block(int block_number); //drop one reference to a data block; it is released when none is left
+void free_data_blocks(const int *block_numbers, int n); //drop one reference to each of n data blocks at once
+void ref_data_block(int block_number); //add one reference to an allocated data block
+int cow_data_block(int block_number); //make a data block private before modifying it; return the block to write to, or -1
+int dedup_data_block(int block_number); //share a full data block with an identical one if any; return the block to use
+int segment_live_blocks(int segment); //allocated blocks in a segment of the log; caller holds data_bitmap_mutex
+void block_copy_init(); //find the size of the last-level cache and select the block_copy implementation for this CPU
+void block_copy(void *dst, const void *src, size_t n); //memcpy, with non-temporal stores from the size of the last-level cache
+void block_copy_memcpy(void *dst, const void *src, size_t n); //block_copy through the cache
+void block_copy_nt(void *dst, const void *src, size_t n); //block_copy with SSE2 streaming stores (memcpy off x86)
+size_t block_copy_large_size(); //bytes from which block_copy streams
+int data_blocks_resident(); //data blocks whose memory page is resident
+
+//NUMA placement of the data blocks: implemented in numa.c
+void numa_init(); //split the data blocks over the online nodes and bind each range to its node
+int numa_first_block(int i); //first block of the range of the i-th node (NUM_DBLOCKS for i==numa_nodes)
+int numa_local_index(); //index of the calling thread's node among the instance's nodes (0 if single or unknown)
+int numa_block_index(int block_number); //index of the node holding a data block
+extern const char *block_copy_kind; //"memcpy" or "sse2 streaming": the copy block_copy uses for large sizes
+
+
+//block checksums and the scrubber: implemented in checksum.c
+extern const char *crc32c_kind; //"sse4.2" or "software": the implementation crc32c selected
+void crc32c_init(); //build the CRC32C table and select the implementation for this CPU
+uint32_t crc32c(uint32_t crc, const void *data, int len); //CRC32C of len bytes, continuing from crc (0 to start)
+uint32_t crc32c_sw(uint32_t crc, const void *data, int len); //crc32c with a table, one byte at a time
+uint32_t crc32c_hw(uint32_t crc, const void *data, int len); //crc32c with the SSE4.2 instruction (software off x86-64)
+void checksum_update(int block_number); //record the checksum of a modified block; caller holds inodes_mutex
+int checksum_check(int block_number); //0 if a block matches its checksum, -1 if not; caller holds inodes_mutex
+
+//process-shared locks: implemented in shm.c
+void rsfs_mutex_init(pthread_mutex_t *mutex); //pthread_mutex_init, process-shared and robust on a shared instance
+void rsfs_cond_init(pthread_cond_t *cond); //pthread_cond_init, process-shared on a shared instance
+void rsfs_mutex_lock(pthread_mutex_t *mutex); //pthread_mutex_lock, recovering a mutex whose holder died
+void rsfs_mutex_recover(pthread_mutex_t *mutex); //make a mutex obtained with EOWNERDEAD usable again
+
+//compaction of fragmented files: implemented in defrag.c
+int fragmentation_score(); //percentage of consecutive file blocks that are not adjacent, computed without locking
+
+//log-structured mode: implemented in lfs.c
+int clean_segments(); //segments of the log without any allocated block, counted without locking
+
+//routines for compression: implemented in compress.c
+int lz_compress(const char *src, int len, char *dst, int cap); //return compressed length, or -1 if it exceeds cap
+int lz_decompress(const char *src, int clen, char *dst, int cap); //return decompressed length, or -1 if malformed
+int chunk_cache_get(int inode_number, int chunk, char *dst); //return the length of a cached decompressed chunk, or -1
+void chunk_cache_put(int inode_number, int chunk, const char *data, int length); //cache a decompressed chunk
+void chunk_cache_invalidate(int inode_number); //drop all cached chunks of a file
 
 
 //routines for open file entry management: implemented in open_file_table.c
@@ -94,23 +289,29 @@ void free_open_file_entry(int fd); //free (release) an open file entry
 
 
 
-//api - basic: already implemented in api.c
-int RSFS_init(); //initialize thesystem (provided)
-void RSFS_stat(); //print the file's stat (provided)
+//routines for snapshot management: implemented in snapshot.c
+int allocate_snapshot(); //allocate a free snapshot slot and return its id, or -1
+void free_snapshot(int snapshot_id); //free (release) a snapshot slot
+
 
-//api - basic: required to be implemented in api.c
-int RSFS_create(char file_name); //create an empty file and return the file handler (i.e., index of the entry in open_file_table)
-int RSFS_open(char file_name, int access_flag); //open an existing file and return the file handler
-int RSFS_append(int fd, void *buf, int size); //append to the end of the file, and return the actual number of bytes appended
-int RSFS_fseek(int fd, int offset); //change the current location of the file
-int RSFS_read(int fd, void *buf, int size); //read from file, and return the actual number of bytes read
-int RSFS_close(int fd); //close the file
+//instrumentation: implemented in metrics.c; process-wide, not per instance
+uint64_t metrics_now(); //current time in ns (0 if METRICS is disabled)
+uint64_t metrics_start(int op); //start of a call of op: its start time if sampled, or 0
+void metrics_record(int op, uint64_t start, int bytes); //count one call of op, timing it if sampled
+void metrics_lock(pthread_mutex_t *mutex, int lock); //pthread_mutex_lock, counting the wait
+void metrics_unlock(pthread_mutex_t *mutex, int lock); //pthread_mutex_unlock, counting the hold time
+void metrics_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, int lock); //pthread_cond_wait, counting the wait
 
-//api - advanced: to be implemented in api.c
-int RSFS_write(int fd, void *buf, int size);
-int RSFS_cut(int fd, int size); 
-int RSFS_delete(char file_name); //delete the file with the provided file_name
 
+//logging: implemented in log.c
+extern int log_level; //most verbose level that is logged
+extern const char *log_level_names[NUM_LOG_LEVELS];
+void rsfs_log(int level, const char *format, ...) __attribute__((format(printf, 2, 3))); //log a message; never blocks
+void rsfs_error(int err, const char *format, ...) __attribute__((format(printf, 2, 3))); //log a failure and set errno to err
 
 
+//tracing of API calls: implemented in trace.c, replayed by rsfs_replay.c
+extern int trace_enabled; //1 while a trace is being recorded
 
+uint64_t trace_start(); //start of a traced call: its start time while tracing, or 0
+void trace_record(int op, uint64_t start, char file_name, int fd, int arg, int result); //record a finished call
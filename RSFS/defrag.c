@@ -0,0 +1,168 @@
+/*
+    online compaction of the files' data blocks, and the background thread driving it;
+    routines for measuring fragmentation and relocating blocks
+*/
+
+#include "def.h"
+#include <time.h>
+
+
+//fragmentation of the files, without locking: the percentage of pairs of consecutive blocks in a file
+//that are not adjacent in the data block array (0 when every file is one contiguous run)
+int fragmentation_score(){
+    struct rsfs *fs = rsfs_current;
+    int pairs = 0, breaks = 0;
+
+    for(int i=0; i<NUM_INODES; i++){
+        struct inode *inode = &fs->inodes[i];
+        if(!__atomic_load_n(&fs->inode_bitmap[i], __ATOMIC_RELAXED)) continue;
+        if(__atomic_load_n(&inode->is_inline, __ATOMIC_RELAXED) || __atomic_load_n(&inode->is_dir, __ATOMIC_RELAXED)) continue;
+
+        int prev = __atomic_load_n(&inode->block[0], __ATOMIC_RELAXED);
+        for(int j=1; j<NUM_POINTERS && prev>=0; j++){
+            int block_number = __atomic_load_n(&inode->block[j], __ATOMIC_RELAXED);
+            if(block_number<0) break;
+            pairs++;
+            if(block_number!=prev+1) breaks++;
+            prev = block_number;
+        }
+    }
+
+    return pairs ? breaks*100/pairs : 0;
+}
+
+
+//helper: move the blocks of a fragmented file into a run of adjacent free blocks on the node holding its first block;
+//files with shared blocks (dedup, clones, snapshots) are left alone, as moving them would unshare them
+//the content is copied without locks and validated by the inode's sequence counter (see inode_write_begin):
+//inodes_mutex is only taken to check that the file did not change meanwhile and to swap the pointers, so that
+//the file's readers and writers (and every other file) are never held up by the copy
+//return the number of blocks moved (0 if the file changed during the copy: the next pass tries again)
+static int compact_file(int inode_number){
+    struct rsfs *fs = rsfs_current;
+    struct inode *inode = &fs->inodes[inode_number];
+
+    unsigned int seq = __atomic_load_n(&inode->seq, __ATOMIC_ACQUIRE);
+    if(seq & 1) return 0; //a writer is at work
+    if(!__atomic_load_n(&fs->inode_bitmap[inode_number], __ATOMIC_RELAXED)) return 0;
+    if(__atomic_load_n(&inode->is_inline, __ATOMIC_RELAXED) || __atomic_load_n(&inode->is_dir, __ATOMIC_RELAXED)) return 0;
+
+    int old_blocks[NUM_POINTERS];
+    int n = 0, contiguous = 1;
+    while(n<NUM_POINTERS){
+        old_blocks[n] = __atomic_load_n(&inode->block[n], __ATOMIC_RELAXED);
+        if(old_blocks[n]<0 || old_blocks[n]>=NUM_DBLOCKS) break;
+        if(n>0 && old_blocks[n]!=old_blocks[n-1]+1) contiguous = 0;
+        n++;
+    }
+    if(contiguous) return 0;
+    for(int j=0; j<n; j++){
+        if(__atomic_load_n(&fs->data_refcount[old_blocks[j]], __ATOMIC_RELAXED)>1) return 0; //checked again below
+    }
+
+    int first = allocate_data_run(n, numa_first_block(numa_block_index(old_blocks[0])));
+    if(first<0) return 0;
+
+    //copy the content: a copy racing a writer (or a delete, whose blocks may be reused) is thrown away below
+    for(int j=0; j<n; j++) memcpy(fs->data_blocks[first+j], fs->data_blocks[old_blocks[j]], BLOCK_SIZE);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE); //the copy is done before seq is checked again
+
+    //swap the pointers if the file is unchanged and its blocks are still private, then free the old blocks
+    metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    int moved = (__atomic_load_n(&inode->seq, __ATOMIC_RELAXED)==seq && fs->inode_bitmap[inode_number]);
+    if(moved){
+        metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+        for(int j=0; j<n; j++) moved &= (fs->data_refcount[old_blocks[j]]==1);
+        metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+    }
+    if(moved){
+        inode_write_begin(inode);
+        for(int j=0; j<n; j++){
+            fs->data_checksum[first+j] = fs->data_checksum[old_blocks[j]];
+            fs->checksum_valid[first+j] = fs->checksum_valid[old_blocks[j]];
+            inode->block[j] = first+j;
+        }
+        inode_write_end(inode);
+        free_data_blocks(old_blocks, n);
+    }else{
+        int new_blocks[NUM_POINTERS];
+        for(int j=0; j<n; j++) new_blocks[j] = first+j;
+        free_data_blocks(new_blocks, n);
+    }
+    metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+
+    return moved ? n : 0;
+}
+
+//helper: compact every file, one at a time; return the number of blocks moved
+static int defrag_pass(){
+    struct rsfs *fs = rsfs_current;
+    int moved = 0;
+
+    for(int i=0; i<NUM_INODES; i++) moved += compact_file(i);
+
+    __atomic_fetch_add(&fs->defrag_moved, moved, __ATOMIC_RELAXED);
+    rsfs_log(LOG_DEBUG, "[defrag] %d blocks moved, fragmentation now %d%%\n", moved, fragmentation_score());
+    return moved;
+}
+
+
+//background thread: run a pass whenever the fragmentation reaches defrag_threshold
+static void *defrag_main(void *arg){
+    struct rsfs *fs = arg; //the instance that started the compactor
+    rsfs_current = fs;
+    struct timespec pause = {fs->defrag_interval_ms/1000, (fs->defrag_interval_ms%1000)*1000000L};
+
+    while(!__atomic_load_n(&fs->defrag_stopping, __ATOMIC_ACQUIRE)){
+        if(fragmentation_score()>=fs->defrag_threshold) defrag_pass();
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+//compact the files now; return the number of blocks moved
+int RSFS_defrag(){
+    return defrag_pass();
+}
+
+//start the compactor: every interval_ms, compact the files if the fragmentation is at least threshold percent
+//return 0 if succeed, or -1 if it is already running
+int RSFS_defrag_start(int interval_ms, int threshold){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->defrag_mutex);
+
+    if(fs->defrag_running || interval_ms<0){
+        pthread_mutex_unlock(&fs->defrag_mutex);
+        rsfs_error(fs->defrag_running ? EBUSY : EINVAL, "[RSFS_defrag_start] compactor already running or invalid interval\n");
+        return -1;
+    }
+
+    fs->defrag_interval_ms = interval_ms;
+    fs->defrag_threshold = threshold;
+    fs->defrag_stopping = 0;
+    pthread_create(&fs->defrag_thread, NULL, defrag_main, rsfs_current);
+    fs->defrag_running = 1;
+
+    pthread_mutex_unlock(&fs->defrag_mutex);
+    return 0;
+}
+
+//stop the compactor
+//return 0 if succeed, or -1 if it is not running
+int RSFS_defrag_stop(){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->defrag_mutex);
+
+    if(!fs->defrag_running){
+        pthread_mutex_unlock(&fs->defrag_mutex);
+        rsfs_error(EINVAL, "[RSFS_defrag_stop] compactor not running\n");
+        return -1;
+    }
+
+    __atomic_store_n(&fs->defrag_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(fs->defrag_thread, NULL);
+    fs->defrag_running = 0;
+
+    pthread_mutex_unlock(&fs->defrag_mutex);
+    return 0;
+}
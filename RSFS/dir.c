@@ -1,124 +1,389 @@
 /*
-    allocation of global variable root_dir (root directory); 
-    routines for directory management
+    routines for directory management and path resolution,
+    and the name scan they search directories with
 */
 
 
 #include "def.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NAME_SCAN_X86 1
+#endif
+
+//scanning an array of names: the implementation for this CPU is selected by name_scan_init();
+//until then (and off x86) names are compared one at a time
+static int (*name_scan_impl)(const char *names, int n, char name) = name_scan_scalar;
+const char *name_scan_kind = "scalar";
+
+//return the index of the first name in names[0..n-1] equal to name, or -1
+int name_scan_scalar(const char *names, int n, char name){
+    for(int i=0; i<n; i++){
+        if(names[i]==name) return i;
+    }
+    return -1;
+}
 
-//global variable
-pthread_mutex_t root_dir_mutex;
-struct inode *root_inode = NULL;
-void *root_data_block = NULL;
-
+#ifdef NAME_SCAN_X86
 
+//compare 16 names per instruction; the movemask of the comparison has a bit set for each match
+__attribute__((target("sse2")))
+int name_scan_sse2(const char *names, int n, char name){
+    __m128i key = _mm_set1_epi8(name);
+    int i = 0;
 
-//helper function: search for dir entry matching provided file_name
-struct dir_entry *search_dir_internal(char file_name){
+    for(; i+16<=n; i+=16){
+        __m128i block = _mm_loadu_si128((const __m128i *)(names+i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, key));
+        if(mask) return i + __builtin_ctz(mask);
+    }
 
-    //get the inode for root directory if not assigned yet
-    if(root_inode == NULL){
-        root_inode = &inodes[root_inode_number];
+    int ret = name_scan_scalar(names+i, n-i, name);
+    return ret<0 ? -1 : i+ret;
+}
 
-        int root_data_block_number = allocate_data_block();
-        if(root_data_block_number<0){
-            printf("[search_dir_internal] fail to get root_data_block_number.\n");
-            return NULL;
+//compare 32 names per instruction, and the rest 16 at a time; a directory takes only the 16-wide part
+__attribute__((target("avx2")))
+int name_scan_avx2(const char *names, int n, char name){
+    int i = 0;
+
+    if(n>=32){
+        __m256i key = _mm256_set1_epi8(name);
+        for(; i+32<=n; i+=32){
+            __m256i block = _mm256_loadu_si256((const __m256i *)(names+i));
+            unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, key));
+            if(mask) return i + __builtin_ctz(mask);
         }
-        root_data_block = data_blocks[root_data_block_number];
-        root_inode->block[0]=root_data_block_number;
-        printf("[search_dir_internal] got root_data_block_number = %d\n", root_data_block_number);
-    } 
+    }
 
-    //get the data block for root directory if not assigned to variable root_data_block yet
-    if(root_data_block == NULL){
-        int root_data_block_number = root_inode->block[0];
-        root_data_block = data_blocks[root_data_block_number];
+    //the rest stays in VEX-encoded code: calling name_scan_sse2 would mix in legacy SSE instructions,
+    //whose transition penalty costs more than the whole scan of a directory
+    __m128i key = _mm_set1_epi8(name);
+    for(; i+16<=n; i+=16){
+        __m128i block = _mm_loadu_si128((const __m128i *)(names+i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, key));
+        if(mask) return i + __builtin_ctz(mask);
+    }
+    for(; i<n; i++){
+        if(names[i]==name) return i;
     }
+    return -1;
+}
 
-    //search file_name in the entries 
-    for(int i=0; i<BLOCK_SIZE/sizeof(struct dir_entry); i++){
-        struct dir_entry *dir_entry = (struct dir_entry *)root_data_block + i;
-        if(dir_entry->name == file_name) return dir_entry;     
+#else
+
+int name_scan_sse2(const char *names, int n, char name){
+    return name_scan_scalar(names, n, name);
+}
+
+int name_scan_avx2(const char *names, int n, char name){
+    return name_scan_scalar(names, n, name);
+}
+
+#endif
+
+//select the widest name_scan the CPU supports; called by RSFS_init
+void name_scan_init(){
+#ifdef NAME_SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")){
+        name_scan_impl = name_scan_avx2;
+        name_scan_kind = "avx2";
+    }else if(__builtin_cpu_supports("sse2")){
+        name_scan_impl = name_scan_sse2;
+        name_scan_kind = "sse2";
     }
-    
-    return NULL;
+#endif
+}
+
+//return the index of the first name in names[0..n-1] equal to name, or -1
+int name_scan(const char *names, int n, char name){
+    return name_scan_impl(names, n, name);
+}
+
+
+//helper: the entries of a directory; they are kept inline in its inode (struct dir_block),
+//so a directory does not take a data block
+static struct dir_block *dir_entries(int dir){
+    struct rsfs *fs = rsfs_current;
+    return (struct dir_block *)fs->inodes[dir].inline_data;
+}
 
+//helper function: search directory dir for the entry matching provided file_name (0 finds a free entry);
+//return its index, or -1 if there is none; the caller holds root_dir_mutex
+static int search_dir_internal(int dir, char file_name){
+    return name_scan(dir_entries(dir)->names, DIR_ENTRIES, file_name);
 }
 
 
-//search for the dir_entry for provided file_name
-struct dir_entry *search_dir(char file_name){    
+//search directory dir for provided file_name;
+//return the inode number of its entry, or -1 if there is none (or dir is no longer a directory);
+//answered from the dentry cache when possible, and cached otherwise
+int search_dir(int dir, char file_name){
+    struct rsfs *fs = rsfs_current;
 
-    pthread_mutex_lock(&root_dir_mutex);
+    int inode_number = dcache_lookup(dir, file_name);
+    if(inode_number!=DCACHE_MISS) return inode_number;
 
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
-    
-    pthread_mutex_unlock(&root_dir_mutex);
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
 
-    return dir_entry;
+    if(fs->inodes[dir].is_dir){
+        int i = search_dir_internal(dir, file_name);
+        inode_number = i>=0 ? dir_entries(dir)->inode_numbers[i] : -1;
+        dcache_insert(dir, file_name, inode_number);
+    }else{
+        inode_number = -1;
+    }
+
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    return inode_number;
 }
 
 
-//insert an entry with provided (file_name, inode_number) and return it;
-//if such entry exists already, return it directly
-struct dir_entry *insert_dir(char file_name, char inode_number){
-    
-    pthread_mutex_lock(&root_dir_mutex);
+//insert an entry with provided (file_name, inode_number) into directory dir;
+//return the inode number the entry holds: inode_number, or another one if file_name exists already;
+//return -1 if the directory is full, or -2 if dir is no longer a directory
+int insert_dir(int dir, char file_name, int inode_number){
+    struct rsfs *fs = rsfs_current;
 
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    //a directory removed meanwhile takes no new entries
+    if(!fs->inodes[dir].is_dir){
+        metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+        return -2;
+    }
 
     //search for the entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name);
-    
-    if(!dir_entry && root_inode->length<BLOCK_SIZE/sizeof(struct dir_entry)){//if not found and there is space to add an entry
-        
+    struct dir_block *entries = dir_entries(dir);
+    int i = search_dir_internal(dir, file_name);
+
+    if(i<0){//if not found, add an entry
+
         //find an empty entry
-        dir_entry = search_dir_internal(0); //find an entry where name = 0 or '\0'
+        i = search_dir_internal(dir, 0); //find an entry where name = 0 or '\0'
 
         //construct a new dir_entry
-        if(dir_entry==NULL){
-            printf("[insert_dir] fail to allocate a space for dir_entry.\n");
-            pthread_mutex_unlock(&root_dir_mutex);
-            return NULL;
+        if(i<0){
+            metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+            rsfs_error(ENOSPC, "[insert_dir] fail to allocate a space for dir_entry.\n");
+            return -1;
         }
-        dir_entry->name = file_name;
-        dir_entry->inode_number = inode_number;
-        
+        entries->names[i] = file_name;
+        entries->inode_numbers[i] = inode_number;
+        dcache_insert(dir, file_name, inode_number);
+
         //update the inode
-        root_inode->length += 1;
-    } 
+        fs->inodes[dir].length += 1;
+    }
+
+    int ret = entries->inode_numbers[i];
 
-    pthread_mutex_unlock(&root_dir_mutex);
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
 
-    return dir_entry;
+    return ret;
 }
 
-//delete the entry matching provided file_name if it exists;
-//return 0 if succeed (found and deleted) or -1 if errs
-int delete_dir(char file_name){
+//delete the entry matching provided file_name from directory dir if it is a directory (is_dir=1)
+//or a file (is_dir=0) as expected; a directory must be empty
+//return the inode_number it pointed to if succeed (found and deleted),
+//-1 if there is no such entry, -2 if it is of the other kind, or -3 if it is a directory that is not empty
+int delete_dir(int dir, char file_name, int is_dir){
+    struct rsfs *fs = rsfs_current;
 
-    pthread_mutex_lock(&root_dir_mutex);
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
 
     int ret = -1;
 
     //search for the matching dir_entry
-    struct dir_entry *dir_entry = search_dir_internal(file_name); 
+    struct dir_block *entries = dir_entries(dir);
+    int i = fs->inodes[dir].is_dir ? search_dir_internal(dir, file_name) : -1;
 
     //if found, delete it
-    if(dir_entry){
-        
-        //mark this entry as not used (empty)
-        dir_entry->name = 0;
-        dir_entry->inode_number = 0;
+    if(i>=0){
+
+        int inode_number = entries->inode_numbers[i];
+        if(fs->inodes[inode_number].is_dir != is_dir){
+            ret = -2;
+        }else if(is_dir && fs->inodes[inode_number].length>0){
+            ret = -3;
+        }else{
+            ret = inode_number;
+
+            //mark this entry as not used (empty)
+            entries->names[i] = 0;
+            entries->inode_numbers[i] = 0;
+            dcache_insert(dir, file_name, -1);
+
+            //update the inode
+            fs->inodes[dir].length -= 1;
+
+            //a removed directory takes no more entries, and its cached lookups go with it
+            if(is_dir){
+                fs->inodes[inode_number].is_dir = 0;
+                dcache_purge(inode_number);
+            }
+        }
+    }
 
-        //update the inode
-        root_inode->length -= 1;
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    return ret;
+}
+
+
+//create files for the n names in directory dir under a single acquisition of root_dir_mutex,
+//taking their inodes with a single acquisition of inode_bitmap_mutex;
+//results[i] is set to the inode number of the new file names[i], -1 if the name exists already
+//(or occurs earlier in names, or is '\0'), or -2 if no inode or dir_entry is left (or dir was removed)
+//return the number of files created
+int insert_dir_many(int dir, const char *names, int n, int *results){
+    struct rsfs *fs = rsfs_current;
 
-        ret = 0;
+    int created = 0;
+    char seen[256] = {0}; //names present in the directory or earlier in the batch
+
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    if(!fs->inodes[dir].is_dir){
+        metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+        for(int i=0; i<n; i++) results[i] = -2;
+        return 0;
     }
 
-    pthread_mutex_unlock(&root_dir_mutex);
+    struct dir_block *entries = dir_entries(dir);
+    int free_entries = DIR_ENTRIES - fs->inodes[dir].length;
+    seen[0] = 1;
+    for(int i=0; i<DIR_ENTRIES; i++) seen[(unsigned char)entries->names[i]] = 1;
+
+    //pick the names to create (marked -3 for now), as many as the directory has room for
+    int wanted = 0;
+    for(int i=0; i<n; i++){
+        unsigned char name = names[i];
+        if(seen[name]){
+            results[i] = -1;
+        }else if(wanted<free_entries){
+            seen[name] = 1;
+            results[i] = -3;
+            wanted++;
+        }else{
+            results[i] = -2;
+        }
+    }
 
-    return ret;
+    //one bitmap pass for all their inodes
+    int inode_numbers[DIR_ENTRIES];
+    int allocated = allocate_inodes(wanted, inode_numbers);
+
+    //fill the free entries in order
+    int slot = 0;
+    for(int i=0; i<n; i++){
+        if(results[i]!=-3) continue;
+        if(created==allocated){
+            results[i] = -2;
+            continue;
+        }
+
+        slot += name_scan(entries->names+slot, DIR_ENTRIES-slot, 0);
+        entries->names[slot] = names[i];
+        entries->inode_numbers[slot] = inode_numbers[created];
+        dcache_insert(dir, names[i], inode_numbers[created]);
+        results[i] = inode_numbers[created++];
+    }
+    fs->inodes[dir].length += created;
+
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    return created;
+}
+
+//delete the dir_entries of the files named in names from directory dir under a single acquisition of root_dir_mutex;
+//results[i] is set to the inode number the entry of names[i] pointed to, -1 if there is no such entry
+//(or it occurs earlier in names), or -2 if it is a directory
+//return the number of entries deleted
+int delete_dir_many(int dir, const char *names, int n, int *results){
+    struct rsfs *fs = rsfs_current;
+
+    int deleted = 0;
+    int slot_of[256]; //entry index of each name in the directory, or -1
+
+    for(int i=0; i<256; i++) slot_of[i] = -1;
+
+    metrics_lock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    struct dir_block *entries = dir_entries(dir);
+    if(fs->inodes[dir].is_dir){
+        for(int i=0; i<DIR_ENTRIES; i++){
+            if(entries->names[i]!=0) slot_of[(unsigned char)entries->names[i]] = i;
+        }
+    }
+
+    for(int i=0; i<n; i++){
+        int slot = slot_of[(unsigned char)names[i]];
+        if(slot<0){
+            results[i] = -1;
+            continue;
+        }
+
+        int inode_number = entries->inode_numbers[slot];
+        if(fs->inodes[inode_number].is_dir){
+            results[i] = -2;
+            continue;
+        }
+
+        entries->names[slot] = 0;
+        entries->inode_numbers[slot] = 0;
+        slot_of[(unsigned char)names[i]] = -1;
+        dcache_insert(dir, names[i], -1);
+        results[i] = inode_number;
+        deleted++;
+    }
+    fs->inodes[dir].length -= deleted;
+
+    metrics_unlock(&fs->root_dir_mutex, METRIC_LOCK_ROOT_DIR);
+
+    return deleted;
 }
 
+
+//resolve a path such as "a/b/c" (every component is a one-character name, a leading '/' is optional)
+//starting from the root directory; if parent and name are given, they are set to the directory holding
+//the last component and its name, or parent to -1 if a directory on the way does not exist
+//return the inode number of the last component, or a negative errno value:
+//-ENOENT if it (or a directory on the way) does not exist, -ENOTDIR if a component on the way is a file,
+//-EINVAL if the path is malformed
+int lookup_path(const char *path, int *parent, char *name){
+    struct rsfs *fs = rsfs_current;
+
+    int dir_parent = -1, inode_number = fs->root_inode_number;
+    char last = 0;
+
+    if(parent) *parent = -1;
+    if(path==NULL) return -EINVAL;
+
+    const char *p = path;
+    if(*p=='/') p++;
+    if(*p=='\0') return -EINVAL;
+
+    while(*p){
+        //each component is exactly one character, followed by '/' or the end of the path
+        if(*p=='/' || (p[1]!='/' && p[1]!='\0')) return -EINVAL;
+
+        if(inode_number<0) return -ENOENT;
+        if(!fs->inodes[inode_number].is_dir) return -ENOTDIR;
+
+        dir_parent = inode_number;
+        last = *p;
+        inode_number = search_dir(dir_parent, last);
+
+        p++;
+        if(*p=='/'){
+            p++;
+            if(*p=='\0') return -EINVAL;
+        }
+    }
+
+    if(parent) *parent = dir_parent;
+    if(name) *name = last;
+    return inode_number>=0 ? inode_number : -ENOENT;
+}
@@ -1,54 +1,168 @@
 /*
-    allocation of inodes, inode bitmap, and mutexes to guard them;
+    inodes, inode bitmap, and mutexes to guard them (fields of struct rsfs);
     routines for inode management
 */
 
 #include "def.h"
 
 
-//allocation of inodes, inode bitmap and their mutexes
-struct inode inodes[NUM_INODES];
-pthread_mutex_t inodes_mutex;
-int inode_bitmap[NUM_INODES];
-pthread_mutex_t inode_bitmap_mutex;
+//helper: mark inode i allocated and initialize it; caller holds inode_bitmap_mutex
+static void take_inode(int i){
+    struct rsfs *fs = rsfs_current;
 
-//root inode number, which should be known globally
-int root_inode_number=-1;
+    fs->inode_bitmap[i]=1; //mark it as allocated
+    __atomic_fetch_add(&fs->inodes_used, 1, __ATOMIC_RELAXED);
+
+    //initialize the inode: a new file starts with its (empty) content inline
+    fs->inodes[i].length=0;
+    fs->inodes[i].is_inline=1;
+    fs->inodes[i].compressed=0;
+    fs->inodes[i].is_dir=0;
+    fs->inodes[i].unlinked=0;
+    memset(fs->inodes[i].inline_data, 0, INLINE_DATA_SIZE);
+}
+
+//helper: mark an inode available; caller holds inode_bitmap_mutex
+static void put_inode(int inode_number){
+    struct rsfs *fs = rsfs_current;
+
+    if(fs->inode_bitmap[inode_number]) __atomic_fetch_sub(&fs->inodes_used, 1, __ATOMIC_RELAXED);
+    fs->inode_bitmap[inode_number]=0; //mark it as available
+}
 
 //to allocate an empty inode and return the inode-number; 
 //if no free inode is available, return -1
 int allocate_inode(){
+    struct rsfs *fs = rsfs_current;
 
     int inode_number=-1; //init 
 
-    pthread_mutex_lock(&inode_bitmap_mutex);
+    rsfs_mutex_lock(&fs->inode_bitmap_mutex);
 
     for(int i=0; i<NUM_INODES; i++){
-        if(inode_bitmap[i]==0){//find an empty inode
-            
+        if(fs->inode_bitmap[i]==0){//find an empty inode
             inode_number=i;
-            inode_bitmap[i]=1; //mark it as allocated
-            
-            //initialize the inode
-            inodes[i].length=0;
-            for(int j=0; j<NUM_POINTERS; j++) inodes[i].block[j]=-1;
-            
+            take_inode(i);
             break;
         }
     }
 
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex);
 
     return inode_number;
 }
 
+//to allocate up to n empty inodes under a single acquisition of the bitmap mutex;
+//their numbers are stored in inode_numbers, and how many were allocated (less than n if inodes run out) is returned
+int allocate_inodes(int n, int *inode_numbers){
+    struct rsfs *fs = rsfs_current;
+
+    int allocated=0;
+
+    rsfs_mutex_lock(&fs->inode_bitmap_mutex);
+
+    for(int i=0; i<NUM_INODES && allocated<n; i++){
+        if(fs->inode_bitmap[i]==0){
+            inode_numbers[allocated++]=i;
+            take_inode(i);
+        }
+    }
+
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+
+    return allocated;
+}
+
 //to free an inode with provided inode_number - require students to implement this???
 void free_inode(int inode_number){
+    struct rsfs *fs = rsfs_current;
 
-    pthread_mutex_lock(&inode_bitmap_mutex);
+    rsfs_mutex_lock(&fs->inode_bitmap_mutex);
     
-    inode_bitmap[inode_number]=0; //mark it as available
+    put_inode(inode_number);
     
-    pthread_mutex_unlock(&inode_bitmap_mutex);
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+}
+
+//to free n inodes under a single acquisition of the bitmap mutex
+void free_inodes(const int *inode_numbers, int n){
+    struct rsfs *fs = rsfs_current;
+
+    if(n<=0) return;
+
+    rsfs_mutex_lock(&fs->inode_bitmap_mutex);
+
+    for(int i=0; i<n; i++) put_inode(inode_numbers[i]);
+
+    pthread_mutex_unlock(&fs->inode_bitmap_mutex);
 }
 
+
+//to make inode dst share the content of inode src (length, inline data or block pointers);
+//every data block of src gains a reference, and is copied on the first write through either inode;
+//the caller holds inodes_mutex
+void share_inode_content(struct inode *dst, struct inode *src){
+
+    inode_write_begin(dst);
+    memcpy(dst->block, src->block, sizeof(src->block));
+    memcpy(dst->inline_data, src->inline_data, sizeof(src->inline_data));
+    memcpy(dst->chunk_clen, src->chunk_clen, sizeof(src->chunk_clen));
+    dst->is_inline = src->is_inline;
+    dst->compressed = src->compressed;
+    dst->length = src->length;
+
+    for(int i=0; !src->is_inline && i<NUM_POINTERS; i++){
+        if(src->block[i]>=0) ref_data_block(src->block[i]);
+    }
+    inode_write_end(dst);
+}
+
+//to drop the content of an inode: each of its data blocks loses a reference
+void release_inode_content(struct inode *inode){
+
+    inode_write_begin(inode);
+    for(int i=0; !inode->is_inline && i<NUM_POINTERS; i++){
+        if(inode->block[i]>=0){
+            free_data_block(inode->block[i]);
+            inode->block[i]=-1;
+        }
+    }
+    inode->length=0;
+    inode_write_end(inode);
+}
+
+//to drop the content of n inodes, releasing all their data blocks under a single acquisition of data_bitmap_mutex;
+//the caller holds inodes_mutex
+void release_inodes_content(const int *inode_numbers, int n){
+    struct rsfs *fs = rsfs_current;
+
+    int blocks[NUM_INODES*NUM_POINTERS], num_blocks=0;
+
+    for(int k=0; k<n; k++){
+        struct inode *inode = &fs->inodes[inode_numbers[k]];
+        inode_write_begin(inode);
+        for(int i=0; !inode->is_inline && i<NUM_POINTERS; i++){
+            if(inode->block[i]>=0){
+                blocks[num_blocks++] = inode->block[i];
+                inode->block[i]=-1;
+            }
+        }
+        inode->length=0;
+        inode_write_end(inode);
+    }
+
+    free_data_blocks(blocks, num_blocks);
+}
+
+//seqlock on the content of an inode, for RSFS_read: writers (serialized by inodes_mutex) make seq odd before
+//changing the length, the block pointers or the data, and even again afterwards; a reader copies without the lock
+//and keeps the copy only if seq was even and unchanged throughout (blocks of the file cannot be freed meanwhile,
+//as that changes the inode too)
+void inode_write_begin(struct inode *inode){
+    __atomic_store_n(&inode->seq, inode->seq+1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE); //seq is odd before any change is visible
+}
+
+void inode_write_end(struct inode *inode){
+    __atomic_store_n(&inode->seq, inode->seq+1, __ATOMIC_RELEASE); //every change is visible before seq is even
+}
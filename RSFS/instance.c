@@ -0,0 +1,346 @@
+/*
+    file system instances: the default one, those created by RSFS_new(), and the one each thread works on;
+    routines for creating, selecting and freeing instances, and the API taking an instance handle;
+    every RSFS_* call works on the instance of the calling thread (RSFS_use), and has an RSFS_fs_* counterpart taking
+    the instance explicitly
+*/
+
+#include "def.h"
+#include <sys/mman.h>
+
+
+static struct rsfs rsfs_default __attribute__((aligned(64))); //initialized by RSFS_init()
+__thread struct rsfs *rsfs_current = &rsfs_default;
+
+
+//helper: give the memory of an instance created by RSFS_new() back
+static void release_instance(struct rsfs *fs){
+    if(fs->mapped) munmap(fs, sizeof(struct rsfs));
+    else free(fs);
+}
+
+//create and initialize a new instance, independent of every other one
+//return its handle, or NULL if out of memory
+rsfs_t *RSFS_new(){
+    //a large instance gets pages of its own, zero-filled and committed on first touch: its data blocks cost memory
+    //once written (and until freed, see release_free_pages); a small one is cheaper to take from the heap, where
+    //it is page-aligned all the same, so instances used by different threads never share a cache line
+    int mapped = sizeof(struct rsfs) >= LAZY_COMMIT_MIN;
+    struct rsfs *fs = NULL;
+    if(mapped){
+        fs = mmap(NULL, sizeof(struct rsfs), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(fs==MAP_FAILED) fs = NULL;
+    }else if(posix_memalign((void **)&fs, DATA_PAGE_ALIGN, sizeof(struct rsfs))==0){
+        memset(fs, 0, sizeof(struct rsfs));
+    }else{
+        fs = NULL;
+    }
+    if(fs==NULL){
+        rsfs_error(ENOMEM, "[RSFS_new] fails to allocate an instance\n");
+        return NULL;
+    }
+    fs->mapped = mapped;
+
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_init();
+    RSFS_use(prev);
+
+    if(ret!=0){
+        release_instance(fs);
+        return NULL;
+    }
+    return fs;
+}
+
+//release an instance created by RSFS_new(), stopping its background threads; its fds become invalid
+void RSFS_free(rsfs_t *fs){
+    if(fs==NULL || fs==&rsfs_default) return;
+
+    struct rsfs *prev = RSFS_use(fs);
+    if(fs->scrub_running) RSFS_scrub_stop();
+    if(fs->defrag_running) RSFS_defrag_stop();
+    if(fs->cleaner_running) RSFS_cleaner_stop();
+    RSFS_use(prev==fs ? NULL : prev);
+
+    release_instance(fs);
+}
+
+//make the calling thread's RSFS_* calls work on instance fs (NULL for the default instance)
+//return the instance it worked on before
+rsfs_t *RSFS_use(rsfs_t *fs){
+    struct rsfs *prev = rsfs_current;
+    rsfs_current = fs ? fs : &rsfs_default;
+    return prev;
+}
+
+
+//------ the API on a given instance: each call works on fs, leaving the thread's instance as it was ------
+
+int RSFS_fs_create(rsfs_t *fs, char file_name){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_create(file_name);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_delete(rsfs_t *fs, char file_name){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_delete(file_name);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_open(rsfs_t *fs, char file_name, int access_flag){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_open(file_name, access_flag);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_close(rsfs_t *fs, int fd){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_close(fd);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_read(rsfs_t *fs, int fd, void *buf, int size){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_read(fd, buf, size);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_append(rsfs_t *fs, int fd, void *buf, int size){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_append(fd, buf, size);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_write(rsfs_t *fs, int fd, void *buf, int size){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_write(fd, buf, size);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_fseek(rsfs_t *fs, int fd, int offset){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_fseek(fd, offset);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_statfs(rsfs_t *fs, struct rsfs_statfs *st){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_statfs(st);
+    rsfs_current = prev;
+    return ret;
+}
+
+void RSFS_fs_stat(rsfs_t *fs){
+    struct rsfs *prev = RSFS_use(fs);
+    RSFS_stat();
+    rsfs_current = prev;
+}
+
+int RSFS_fs_fstat(rsfs_t *fs, int fd, struct rsfs_fstat *st){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_fstat(fd, st);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_fsync(rsfs_t *fs, int fd){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_fsync(fd);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_set_compressed(rsfs_t *fs, int fd, int enable){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_set_compressed(fd, enable);
+    rsfs_current = prev;
+    return ret;
+}
+
+void RSFS_fs_set_dedup(rsfs_t *fs, int enable){
+    struct rsfs *prev = RSFS_use(fs);
+    RSFS_set_dedup(enable);
+    rsfs_current = prev;
+}
+
+void RSFS_fs_set_checksum_verify(rsfs_t *fs, int enable){
+    struct rsfs *prev = RSFS_use(fs);
+    RSFS_set_checksum_verify(enable);
+    rsfs_current = prev;
+}
+
+void RSFS_fs_set_log_mode(rsfs_t *fs, int enable){
+    struct rsfs *prev = RSFS_use(fs);
+    RSFS_set_log_mode(enable);
+    rsfs_current = prev;
+}
+
+int RSFS_fs_scrub_start(rsfs_t *fs, int interval_ms){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_scrub_start(interval_ms);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_scrub_stop(rsfs_t *fs){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_scrub_stop();
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_defrag(rsfs_t *fs){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_defrag();
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_defrag_start(rsfs_t *fs, int interval_ms, int threshold){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_defrag_start(interval_ms, threshold);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_defrag_stop(rsfs_t *fs){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_defrag_stop();
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_clean(rsfs_t *fs){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_clean();
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_cleaner_start(rsfs_t *fs, int interval_ms, int threshold){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_cleaner_start(interval_ms, threshold);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_cleaner_stop(rsfs_t *fs){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_cleaner_stop();
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_create_many(rsfs_t *fs, const char *names, int n, int *results){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_create_many(names, n, results);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_delete_many(rsfs_t *fs, const char *names, int n, int *results){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_delete_many(names, n, results);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_submit_batch(rsfs_t *fs, struct rsfs_batch_op *ops, int n){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_submit_batch(ops, n);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_mkdir(rsfs_t *fs, const char *path){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_mkdir(path);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_rmdir(rsfs_t *fs, const char *path){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_rmdir(path);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_readdir(rsfs_t *fs, const char *path, char *names, int max){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_readdir(path, names, max);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_readdir_plus(rsfs_t *fs, const char *path, int *cursor, struct rsfs_dirent *ents, int max){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_readdir_plus(path, cursor, ents, max);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_create_path(rsfs_t *fs, const char *path){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_create_path(path);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_open_path(rsfs_t *fs, const char *path, int access_flag){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_open_path(path, access_flag);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_delete_path(rsfs_t *fs, const char *path){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_delete_path(path);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_clone(rsfs_t *fs, char src_name, char dst_name){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_clone(src_name, dst_name);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_copy_range(rsfs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int len){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_copy_range(fd_in, off_in, fd_out, off_out, len);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_snapshot(rsfs_t *fs){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_snapshot();
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_restore(rsfs_t *fs, int snapshot_id){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_restore(snapshot_id);
+    rsfs_current = prev;
+    return ret;
+}
+
+int RSFS_fs_delete_snapshot(rsfs_t *fs, int snapshot_id){
+    struct rsfs *prev = RSFS_use(fs);
+    int ret = RSFS_delete_snapshot(snapshot_id);
+    rsfs_current = prev;
+    return ret;
+}
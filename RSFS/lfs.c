@@ -0,0 +1,176 @@
+/*
+    log-structured mode: data blocks are taken at the head of a log of segments (SEGMENT_BLOCKS adjacent blocks)
+    and modified blocks are rewritten there, so that writes to any file form one sequential stream (data_block.c);
+    routines for switching the mode and for the cleaner reclaiming sparse segments
+*/
+
+#include "def.h"
+#include <time.h>
+
+
+//segments of the log without any allocated block, without locking
+int clean_segments(){
+    struct rsfs *fs = rsfs_current;
+    int clean = 0;
+    for(int segment=0; segment<NUM_SEGMENTS; segment++){
+        int live = 0;
+        for(int i=segment*SEGMENT_BLOCKS; i<(segment+1)*SEGMENT_BLOCKS; i++) live += __atomic_load_n(&fs->data_bitmap[i], __ATOMIC_RELAXED);
+        clean += (live==0);
+    }
+    return clean;
+}
+
+
+//helper: move the live blocks of a segment to the head of the log, so that the segment becomes clean;
+//a segment holding a shared block (dedup, clones, snapshots) or a block of no file (kept by a snapshot only)
+//is left alone, as is the one the head is filling
+//the caller holds inodes_mutex and inode_bitmap_mutex; return the number of blocks moved
+static int clean_segment(int segment){
+    struct rsfs *fs = rsfs_current;
+    int first = segment*SEGMENT_BLOCKS;
+    char *owner[SEGMENT_BLOCKS] = {0}; //the pointer of a file to each live block
+    struct inode *owner_inode[SEGMENT_BLOCKS];
+    int live = 0, shared = 0;
+
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+    int head_segment = (fs->log_head-1)/SEGMENT_BLOCKS;
+    for(int i=first; i<first+SEGMENT_BLOCKS; i++){
+        live += fs->data_bitmap[i];
+        shared |= (fs->data_bitmap[i] && fs->data_refcount[i]>1);
+    }
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+    if(live==0 || shared || segment==head_segment) return 0;
+
+    for(int i=0; i<NUM_INODES; i++){
+        struct inode *inode = &fs->inodes[i];
+        if(!fs->inode_bitmap[i] || inode->is_inline || inode->is_dir) continue;
+        for(int j=0; j<NUM_POINTERS; j++){
+            int block_number = inode->block[j];
+            if(block_number>=first && block_number<first+SEGMENT_BLOCKS){
+                owner[block_number-first] = &inode->block[j];
+                owner_inode[block_number-first] = inode;
+            }
+        }
+    }
+
+    int found = 0;
+    for(int k=0; k<SEGMENT_BLOCKS; k++) found += (owner[k]!=NULL);
+    if(found!=live) return 0;
+
+    //copy each live block (and its checksum) to the head, then repoint its file and free the old one
+    int moved = 0;
+    for(int k=0; k<SEGMENT_BLOCKS; k++){
+        if(owner[k]==NULL) continue;
+
+        int new_block = allocate_data_block();
+        if(new_block<0) break;
+        if(new_block/SEGMENT_BLOCKS==segment){ //no clean segment left: the head came back here
+            free_data_block(new_block);
+            break;
+        }
+
+        memcpy(fs->data_blocks[new_block], fs->data_blocks[first+k], BLOCK_SIZE);
+        fs->data_checksum[new_block] = fs->data_checksum[first+k];
+        fs->checksum_valid[new_block] = fs->checksum_valid[first+k];
+        inode_write_begin(owner_inode[k]);
+        *owner[k] = new_block;
+        inode_write_end(owner_inode[k]);
+        free_data_block(first+k);
+        moved++;
+    }
+    return moved;
+}
+
+//helper: clean every segment at most threshold percent live, holding the locks for one segment at a time;
+//return the number of blocks moved
+static int clean_pass(int threshold){
+    struct rsfs *fs = rsfs_current;
+    int moved = 0;
+
+    for(int segment=0; segment<NUM_SEGMENTS && fs->log_mode; segment++){
+        metrics_lock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+        rsfs_mutex_lock(&fs->inode_bitmap_mutex);
+
+        metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+        int live = segment_live_blocks(segment);
+        metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+        if(live*100 <= threshold*SEGMENT_BLOCKS) moved += clean_segment(segment);
+
+        pthread_mutex_unlock(&fs->inode_bitmap_mutex);
+        metrics_unlock(&fs->inodes_mutex, METRIC_LOCK_INODES);
+    }
+
+    __atomic_fetch_add(&fs->cleaner_moved, moved, __ATOMIC_RELAXED);
+    rsfs_log(LOG_DEBUG, "[cleaner] %d blocks moved, %d clean segments\n", moved, clean_segments());
+    return moved;
+}
+
+
+//background thread: clean the sparse segments every cleaner_interval_ms
+static void *cleaner_main(void *arg){
+    struct rsfs *fs = arg; //the instance that started the cleaner
+    rsfs_current = fs;
+    struct timespec pause = {fs->cleaner_interval_ms/1000, (fs->cleaner_interval_ms%1000)*1000000L};
+
+    while(!__atomic_load_n(&fs->cleaner_stopping, __ATOMIC_ACQUIRE)){
+        clean_pass(fs->cleaner_threshold);
+        nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+//switch the log-structured mode on (1) or off (0); blocks already written stay where they are
+void RSFS_set_log_mode(int enable){
+    struct rsfs *fs = rsfs_current;
+    metrics_lock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+    fs->log_mode = enable ? 1 : 0;
+    fs->log_last = -1;
+    metrics_unlock(&fs->data_bitmap_mutex, METRIC_LOCK_DATA_BITMAP);
+}
+
+//clean now every segment that is neither clean, full nor the head's; return the number of blocks moved
+int RSFS_clean(){
+    return clean_pass(100 - 100/SEGMENT_BLOCKS);
+}
+
+//start the cleaner: every interval_ms, clean the segments whose live blocks are at most threshold percent
+//return 0 if succeed, or -1 if it is already running
+int RSFS_cleaner_start(int interval_ms, int threshold){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->cleaner_mutex);
+
+    if(fs->cleaner_running || interval_ms<0){
+        pthread_mutex_unlock(&fs->cleaner_mutex);
+        rsfs_error(fs->cleaner_running ? EBUSY : EINVAL, "[RSFS_cleaner_start] cleaner already running or invalid interval\n");
+        return -1;
+    }
+
+    fs->cleaner_interval_ms = interval_ms;
+    fs->cleaner_threshold = threshold;
+    fs->cleaner_stopping = 0;
+    pthread_create(&fs->cleaner_thread, NULL, cleaner_main, rsfs_current);
+    fs->cleaner_running = 1;
+
+    pthread_mutex_unlock(&fs->cleaner_mutex);
+    return 0;
+}
+
+//stop the cleaner
+//return 0 if succeed, or -1 if it is not running
+int RSFS_cleaner_stop(){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->cleaner_mutex);
+
+    if(!fs->cleaner_running){
+        pthread_mutex_unlock(&fs->cleaner_mutex);
+        rsfs_error(EINVAL, "[RSFS_cleaner_stop] cleaner not running\n");
+        return -1;
+    }
+
+    __atomic_store_n(&fs->cleaner_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(fs->cleaner_thread, NULL);
+    fs->cleaner_running = 0;
+
+    pthread_mutex_unlock(&fs->cleaner_mutex);
+    return 0;
+}
@@ -0,0 +1,195 @@
+/*
+    per-thread rings of log messages, drained to stderr by a background thread;
+    routines for logging, reporting errors, and flushing the log
+*/
+
+#include "def.h"
+#include <stdarg.h>
+#include <time.h>
+#include <sched.h>
+
+
+const char *log_level_names[NUM_LOG_LEVELS] = {"error", "warn", "info", "debug"};
+int log_level = DEBUG ? LOG_DEBUG : LOG_ERROR; //messages above this level are discarded unformatted
+
+struct log_message{
+    int level;
+    char text[LOG_MSG_SIZE];
+};
+
+//log ring of one thread: only the owner writes messages and head, only the log thread advances tail
+struct log_ring{
+    uint32_t head; //number of messages written
+    uint32_t tail; //number of messages drained
+    uint64_t dropped; //messages lost because the ring was full
+    int owned; //1 while a live thread writes into this ring
+    struct log_ring *next;
+    struct log_message messages[LOG_RING_SIZE];
+};
+
+//every ring ever created; the ring of an exited thread is reused by the next new thread
+static struct log_ring *all_log_rings = NULL;
+static __thread struct log_ring *my_log_ring = NULL;
+static pthread_key_t log_ring_key; //its destructor releases the ring when a thread exits
+
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_t log_thread;
+static int log_thread_running = 0; //1 once the log thread of this process is started (a forked child has none)
+
+
+//helper: write the pending messages of every ring to stderr; return the number written
+static int log_drain(){
+    int written = 0;
+
+    for(struct log_ring *ring = __atomic_load_n(&all_log_rings, __ATOMIC_ACQUIRE); ring!=NULL; ring = ring->next){
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while(ring->tail != head){
+            struct log_message *message = &ring->messages[ring->tail % LOG_RING_SIZE];
+            fprintf(stderr, "%-5s %s", log_level_names[message->level], message->text);
+            __atomic_store_n(&ring->tail, ring->tail+1, __ATOMIC_RELEASE);
+            written++;
+        }
+    }
+    if(written>0) fflush(stderr);
+    return written;
+}
+
+//background thread: drain the rings for the life of the process
+static void *log_thread_main(void *arg){
+    (void)arg; //the rings are process-wide
+    struct timespec pause = {0, 1000000}; //1ms
+
+    while(1){
+        if(log_drain()==0) nanosleep(&pause, NULL);
+    }
+    return NULL;
+}
+
+//helper: called when a thread with a log ring exits
+static void log_ring_release(void *ptr){
+    struct log_ring *ring = (struct log_ring *)ptr;
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+//helper: start the log thread of this process unless it runs already
+static void log_thread_start(){
+    int stopped = 0;
+    if(!__atomic_compare_exchange_n(&log_thread_running, &stopped, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) return;
+
+    if(pthread_create(&log_thread, NULL, log_thread_main, NULL)!=0){
+        __atomic_store_n(&log_thread_running, 0, __ATOMIC_RELEASE); //RSFS_log_flush drains the rings itself
+        return;
+    }
+    pthread_detach(log_thread);
+}
+
+//helper: in the child of a fork, which has no log thread: the messages pending at the fork are the parent's
+//to write, and the rings of the threads that did not follow into the child are free again; the thread is
+//started again by the child's first message
+static void log_atfork_child(){
+    for(struct log_ring *ring = all_log_rings; ring!=NULL; ring = ring->next){
+        ring->tail = ring->head;
+        if(ring!=my_log_ring) ring->owned = 0;
+    }
+    log_thread_running = 0;
+}
+
+//helper: set up the log thread on the first message
+static void log_init(){
+    pthread_key_create(&log_ring_key, log_ring_release);
+    pthread_atfork(NULL, NULL, log_atfork_child);
+    log_thread_start();
+    atexit(RSFS_log_flush);
+}
+
+//helper: the calling thread's ring: a released one if any, or a new one (NULL if out of memory)
+static struct log_ring *get_my_log_ring(){
+    if(my_log_ring!=NULL) return my_log_ring;
+
+    pthread_once(&log_once, log_init);
+
+    struct log_ring *ring;
+    for(ring = __atomic_load_n(&all_log_rings, __ATOMIC_ACQUIRE); ring!=NULL; ring = ring->next){
+        int free_ring = 0;
+        if(__atomic_compare_exchange_n(&ring->owned, &free_ring, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) break;
+    }
+
+    if(ring==NULL){
+        ring = calloc(1, sizeof(struct log_ring));
+        if(ring==NULL) return NULL;
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&all_log_rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&all_log_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    pthread_setspecific(log_ring_key, ring);
+    my_log_ring = ring;
+    return ring;
+}
+
+//helper: format a message into the calling thread's ring; drop it if the ring is full
+static void log_message(int level, const char *format, va_list args){
+    struct log_ring *ring = get_my_log_ring();
+    if(ring==NULL) return;
+    if(!__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE)) log_thread_start(); //first message since a fork
+
+    if(ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE){
+        __atomic_store_n(&ring->dropped, ring->dropped+1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_message *message = &ring->messages[ring->head % LOG_RING_SIZE];
+    message->level = level;
+    vsnprintf(message->text, LOG_MSG_SIZE, format, args);
+    __atomic_store_n(&ring->head, ring->head+1, __ATOMIC_RELEASE);
+}
+
+
+//log a message at the given level (LOG_*); never blocks, and is cheap when the level is disabled
+void rsfs_log(int level, const char *format, ...){
+    if(level > __atomic_load_n(&log_level, __ATOMIC_RELAXED)) return;
+
+    va_list args;
+    va_start(args, format);
+    log_message(level, format, args);
+    va_end(args);
+}
+
+//report a failed call: log the message at LOG_ERROR and set errno to err
+void rsfs_error(int err, const char *format, ...){
+    if(LOG_ERROR <= __atomic_load_n(&log_level, __ATOMIC_RELAXED)){
+        va_list args;
+        va_start(args, format);
+        log_message(LOG_ERROR, format, args);
+        va_end(args);
+    }
+    errno = err;
+}
+
+//set the most verbose level (LOG_*) that is logged
+void RSFS_log_level(int level){
+    __atomic_store_n(&log_level, level, __ATOMIC_RELAXED);
+}
+
+//wait until every message logged so far has been written to stderr
+void RSFS_log_flush(){
+    //without a log thread (it could not be started), the caller writes the messages itself
+    if(!__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE)){
+        log_drain();
+        return;
+    }
+
+    for(struct log_ring *ring = __atomic_load_n(&all_log_rings, __ATOMIC_ACQUIRE); ring!=NULL; ring = ring->next){
+        uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        while((int32_t)(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)) > 0) sched_yield();
+    }
+}
+
+//number of messages dropped so far because a thread logged faster than they were written
+uint64_t RSFS_log_dropped(){
+    uint64_t dropped = 0;
+    for(struct log_ring *ring = __atomic_load_n(&all_log_rings, __ATOMIC_ACQUIRE); ring!=NULL; ring = ring->next){
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
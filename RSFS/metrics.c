@@ -0,0 +1,209 @@
+/*
+    per-thread instrumentation counters and latency histograms;
+    routines for recording them and merging them into a snapshot;
+    the counters belong to the process, not to an instance: a thread's calls on every instance it uses add up in
+    the same counters, and the locks of all instances count under the same names
+*/
+
+#include "def.h"
+#include <time.h>
+
+
+const char *metric_op_names[NUM_METRIC_OPS] = {
+    "create", "delete", "open", "close", "read", "write", "append", "fseek",
+    "fsync", "clone", "snapshot", "restore", "delete_snapshot", "set_compressed", "stat",
+    "fstat", "statfs", "mkdir", "rmdir", "readdir",
+    "create_many", "delete_many", "copy_range", "submit_batch", "readdir_plus"
+};
+const char *metric_lock_names[NUM_METRIC_LOCKS] = {
+    "inodes_mutex", "data_bitmap_mutex", "root_dir_mutex", "open_file_table_mutex", "readers_done"
+};
+
+//counters of one thread: only that thread writes them, RSFS_metrics_snapshot() reads them
+struct thread_metrics{
+    struct rsfs_op_metrics ops[NUM_METRIC_OPS];
+    struct rsfs_lock_metrics locks[NUM_METRIC_LOCKS];
+    uint64_t held_since[NUM_METRIC_LOCKS]; //when the thread acquired each lock, or 0 if this hold is not sampled
+    struct thread_metrics *next;
+};
+
+//every thread's counters, kept after the thread exits so that totals never go backwards
+static struct thread_metrics *all_thread_metrics = NULL;
+static pthread_mutex_t all_thread_metrics_mutex = PTHREAD_MUTEX_INITIALIZER; //taken once per thread, and by snapshots
+static __thread struct thread_metrics *my_metrics = NULL;
+
+
+//helper: the calling thread's counters, registered on first use (NULL if out of memory)
+static struct thread_metrics *get_my_metrics(){
+    if(my_metrics==NULL){
+        struct thread_metrics *m = calloc(1, sizeof(struct thread_metrics));
+        if(m==NULL) return NULL;
+
+        pthread_mutex_lock(&all_thread_metrics_mutex);
+        m->next = all_thread_metrics;
+        all_thread_metrics = m;
+        pthread_mutex_unlock(&all_thread_metrics_mutex);
+
+        my_metrics = m;
+    }
+    return my_metrics;
+}
+
+//helper: add to a counter owned by this thread; a plain store, atomic only so that readers never see a torn value
+static inline void counter_add(uint64_t *counter, uint64_t value){
+    __atomic_store_n(counter, *counter + value, __ATOMIC_RELAXED);
+}
+
+//helper: HDR-style histogram bucket of a latency: 8 linear sub-buckets per power of two
+static int hist_bucket(uint64_t ns){
+    if(ns < METRICS_SUB_BUCKETS) return ns;
+
+    int e = 63 - __builtin_clzll(ns);
+    int bucket = (e-2)*METRICS_SUB_BUCKETS + ((ns >> (e-3)) & (METRICS_SUB_BUCKETS-1));
+    return (bucket < METRICS_HIST_BUCKETS) ? bucket : METRICS_HIST_BUCKETS-1;
+}
+
+//helper: lowest latency that falls into a histogram bucket
+static uint64_t hist_bucket_value(int bucket){
+    if(bucket < METRICS_SUB_BUCKETS) return bucket;
+
+    int e = bucket/METRICS_SUB_BUCKETS + 2;
+    return (uint64_t)(METRICS_SUB_BUCKETS + bucket%METRICS_SUB_BUCKETS) << (e-3);
+}
+
+
+//current time in nanoseconds, or 0 when instrumentation is disabled
+uint64_t metrics_now(){
+    if(!METRICS) return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+//called when an RSFS_* operation starts; return the start time if this call's latency is sampled, or 0
+uint64_t metrics_start(int op){
+    if(!METRICS) return 0;
+
+    struct thread_metrics *m = get_my_metrics();
+    if(m==NULL || m->ops[op].count % METRICS_SAMPLE_RATE != 0) return 0;
+    return metrics_now();
+}
+
+//record one call of an RSFS_* operation which moved bytes bytes; start comes from metrics_start()
+void metrics_record(int op, uint64_t start, int bytes){
+    if(!METRICS || my_metrics==NULL) return;
+
+    struct rsfs_op_metrics *o = &my_metrics->ops[op];
+    counter_add(&o->count, 1);
+    counter_add(&o->bytes, bytes>0 ? bytes : 0);
+
+    if(start){
+        uint64_t ns = metrics_now() - start;
+        counter_add(&o->total_ns, ns * METRICS_SAMPLE_RATE);
+        counter_add(&o->hist[hist_bucket(ns)], 1);
+    }
+}
+
+//lock a mutex, counting the time spent waiting for it;
+//the clock is only read when the mutex is contended, or when this hold is sampled
+void metrics_lock(pthread_mutex_t *mutex, int lock){
+    if(!METRICS){
+        rsfs_mutex_lock(mutex);
+        return;
+    }
+
+    uint64_t wait_ns = 0;
+    int ret = pthread_mutex_trylock(mutex);
+    if(ret==EBUSY){
+        uint64_t start = metrics_now();
+        ret = pthread_mutex_lock(mutex);
+        wait_ns = metrics_now() - start;
+    }
+    if(ret==EOWNERDEAD) rsfs_mutex_recover(mutex); //a robust mutex of a shared instance
+
+    struct thread_metrics *m = get_my_metrics();
+    if(m==NULL) return;
+    struct rsfs_lock_metrics *l = &m->locks[lock];
+    counter_add(&l->acquisitions, 1);
+    counter_add(&l->wait_ns, wait_ns);
+    m->held_since[lock] = (l->acquisitions % METRICS_SAMPLE_RATE == 0) ? metrics_now() : 0;
+}
+
+//unlock a mutex locked by metrics_lock(), counting the time it was held (scaled up from the sampled holds)
+void metrics_unlock(pthread_mutex_t *mutex, int lock){
+    if(METRICS && my_metrics && my_metrics->held_since[lock]){
+        uint64_t held_ns = metrics_now() - my_metrics->held_since[lock];
+        counter_add(&my_metrics->locks[lock].hold_ns, held_ns * METRICS_SAMPLE_RATE);
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+//wait on a condition variable, counting the time spent waiting
+void metrics_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex, int lock){
+    if(!METRICS){
+        if(pthread_cond_wait(cond, mutex)==EOWNERDEAD) rsfs_mutex_recover(mutex);
+        return;
+    }
+
+    uint64_t start = metrics_now();
+    if(pthread_cond_wait(cond, mutex)==EOWNERDEAD) rsfs_mutex_recover(mutex);
+    uint64_t woken = metrics_now();
+
+    struct thread_metrics *m = get_my_metrics();
+    if(m==NULL) return;
+    counter_add(&m->locks[lock].acquisitions, 1);
+    counter_add(&m->locks[lock].wait_ns, woken-start);
+}
+
+
+//add one latency sample to a histogram owned by the caller (e.g. a benchmark thread)
+void metrics_hist_add(struct rsfs_op_metrics *op, uint64_t ns, int bytes){
+    op->count++;
+    op->bytes += bytes>0 ? bytes : 0;
+    op->total_ns += ns;
+    op->hist[hist_bucket(ns)]++;
+}
+
+
+//merge the counters of all threads into out
+void RSFS_metrics_snapshot(struct rsfs_metrics *out){
+    memset(out, 0, sizeof(struct rsfs_metrics));
+
+    pthread_mutex_lock(&all_thread_metrics_mutex);
+    for(struct thread_metrics *m=all_thread_metrics; m!=NULL; m=m->next){
+        for(int op=0; op<NUM_METRIC_OPS; op++){
+            struct rsfs_op_metrics *src = &m->ops[op], *dst = &out->ops[op];
+            dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+            dst->bytes += __atomic_load_n(&src->bytes, __ATOMIC_RELAXED);
+            dst->total_ns += __atomic_load_n(&src->total_ns, __ATOMIC_RELAXED);
+            for(int b=0; b<METRICS_HIST_BUCKETS; b++){
+                dst->hist[b] += __atomic_load_n(&src->hist[b], __ATOMIC_RELAXED);
+            }
+        }
+        for(int lock=0; lock<NUM_METRIC_LOCKS; lock++){
+            struct rsfs_lock_metrics *src = &m->locks[lock], *dst = &out->locks[lock];
+            dst->acquisitions += __atomic_load_n(&src->acquisitions, __ATOMIC_RELAXED);
+            dst->wait_ns += __atomic_load_n(&src->wait_ns, __ATOMIC_RELAXED);
+            dst->hold_ns += __atomic_load_n(&src->hold_ns, __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&all_thread_metrics_mutex);
+}
+
+//latency (ns) below which the fraction p (0..1) of the sampled calls of an operation fall
+uint64_t RSFS_metrics_percentile(const struct rsfs_op_metrics *op, double p){
+    uint64_t sampled = 0;
+    for(int b=0; b<METRICS_HIST_BUCKETS; b++) sampled += op->hist[b];
+    if(sampled==0) return 0;
+
+    uint64_t target = (uint64_t)(p*sampled);
+    if(target >= sampled) target = sampled-1;
+
+    uint64_t seen = 0;
+    for(int b=0; b<METRICS_HIST_BUCKETS; b++){
+        seen += op->hist[b];
+        if(seen > target) return hist_bucket_value(b);
+    }
+    return hist_bucket_value(METRICS_HIST_BUCKETS-1);
+}
@@ -0,0 +1,106 @@
+/*
+    NUMA placement of the data blocks: the data block array is split into one range of blocks per node, whose pages
+    are bound to that node's memory, and a block is allocated from the range of the node its writer runs on;
+    routines for finding the nodes, the calling thread's node and the node of a block
+*/
+
+#define _GNU_SOURCE //for getcpu
+#include "def.h"
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define NUMA_MPOL_BIND 2 //mbind() policy: allocate the pages on the given nodes only
+#define NUMA_MPOL_MF_MOVE 2 //mbind() flag: move pages already touched elsewhere
+
+
+//the online nodes of this machine, found once per process (a single node 0 if unknown)
+static int online_nodes = 0;
+static int online_node_ids[MAX_NUMA_NODES];
+
+//helper: read the online nodes from sysfs ("0", "0-1", "0,2-3"...), keeping the first MAX_NUMA_NODES
+static void find_online_nodes(){
+    if(online_nodes>0) return;
+
+    char list[256] = "0";
+    FILE *f = fopen("/sys/devices/system/node/online", "r");
+    if(f!=NULL){
+        if(fgets(list, sizeof(list), f)==NULL) strcpy(list, "0");
+        fclose(f);
+    }
+
+    int n = 0;
+    char *p = list;
+    while(n<MAX_NUMA_NODES && *p>='0' && *p<='9'){
+        int first = strtol(p, &p, 10), last = first;
+        if(*p=='-') last = strtol(p+1, &p, 10);
+        for(int node=first; node<=last && n<MAX_NUMA_NODES; node++) online_node_ids[n++] = node;
+        if(*p==',') p++;
+    }
+    if(n==0) online_node_ids[n++] = 0;
+    __atomic_store_n(&online_nodes, n, __ATOMIC_RELEASE);
+}
+
+//helper: bind the whole pages of blocks first..last-1 to node; pages shared with another range are left to first touch
+static int bind_blocks(int first, int last, int node){
+    struct rsfs *fs = rsfs_current;
+    long page_size = sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t)fs->data_blocks[first] + page_size-1) & ~(uintptr_t)(page_size-1);
+    uintptr_t end = (uintptr_t)(fs->data_blocks[0] + (size_t)last*BLOCK_SIZE) & ~(uintptr_t)(page_size-1);
+    if(end<=start) return 0;
+
+    unsigned long mask[(MAX_NUMA_NODE_ID+1+63)/64] = {0};
+    if(node>MAX_NUMA_NODE_ID) return -1;
+    mask[node/64] |= 1UL << (node%64);
+    return syscall(SYS_mbind, (void *)start, end-start, NUMA_MPOL_BIND, mask, MAX_NUMA_NODE_ID+1, NUMA_MPOL_MF_MOVE);
+}
+
+//split the data blocks of the instance over the online nodes, binding each range to its node; on a single node
+//(or if the kernel refuses the binding) nothing is bound and blocks are allocated as before, lowest first;
+//called by RSFS_init
+void numa_init(){
+    struct rsfs *fs = rsfs_current;
+    find_online_nodes();
+
+    fs->numa_nodes = online_nodes;
+    if(fs->numa_nodes > NUM_DBLOCKS) fs->numa_nodes = NUM_DBLOCKS;
+    for(int i=0; i<fs->numa_nodes; i++) fs->numa_node_ids[i] = online_node_ids[i];
+    if(fs->numa_nodes==1) return;
+
+    //pages left unbound (the kernel lacks mbind, or a range is smaller than a page) still land on the node of the
+    //thread first writing them, which is the node whose range the block was allocated from
+    for(int i=0; i<fs->numa_nodes; i++){
+        if(bind_blocks(numa_first_block(i), numa_first_block(i+1), fs->numa_node_ids[i])!=0){
+            rsfs_log(LOG_DEBUG, "[numa_init] fails to bind the blocks of node %d (errno %d)\n", fs->numa_node_ids[i], errno);
+        }
+    }
+    rsfs_log(LOG_DEBUG, "[numa_init] data blocks split over %d nodes\n", fs->numa_nodes);
+}
+
+//first block of the range of the i-th node of the instance (NUM_DBLOCKS for i==numa_nodes)
+int numa_first_block(int i){
+    struct rsfs *fs = rsfs_current;
+    return (int)((long)i*NUM_DBLOCKS/fs->numa_nodes);
+}
+
+//index among the instance's nodes of the node the calling thread runs on (0 on a single node, or if unknown)
+int numa_local_index(){
+    struct rsfs *fs = rsfs_current;
+    if(fs->numa_nodes<=1) return 0;
+
+    unsigned int cpu, node;
+    if(getcpu(&cpu, &node)!=0) return 0;
+    for(int i=0; i<fs->numa_nodes; i++){
+        if(fs->numa_node_ids[i]==(int)node) return i;
+    }
+    return 0;
+}
+
+//index among the instance's nodes of the node holding a data block
+int numa_block_index(int block_number){
+    struct rsfs *fs = rsfs_current;
+    int i = (int)((long)block_number*fs->numa_nodes/NUM_DBLOCKS);
+    while(i+1<fs->numa_nodes && block_number>=numa_first_block(i+1)) i++;
+    while(i>0 && block_number<numa_first_block(i)) i--;
+    return i;
+}
@@ -1,25 +1,24 @@
 /*
-    allocation of global open_file_table and its guarding mutex; 
+    open_file_table and its guarding mutex (fields of struct rsfs); 
     routines for open file entry
 */
 
 #include "def.h"
 
-struct open_file_entry open_file_table[NUM_OPEN_FILE];
-pthread_mutex_t open_file_table_mutex;
-
 //allocate an available entry in open file table and return fd (file descriptor);
 //return -1 if no entry is found
 int allocate_open_file_entry(int access_flag, int inode_number){
+    struct rsfs *fs = rsfs_current;
     
     int fd=-1;
     
-    pthread_mutex_lock(&open_file_table_mutex);
+    metrics_lock(&fs->open_file_table_mutex, METRIC_LOCK_OPEN_FILE_TABLE);
     for(int i=0; i<NUM_OPEN_FILE; i++){
-        struct open_file_entry *entry = &open_file_table[i];
+        struct open_file_entry *entry = &fs->open_file_table[i];
         if(entry->used==0){ //find an empty entry
             fd=i; //record the entry index (i.e., file handler)
             entry->used = 1; //mark it as used
+            __atomic_fetch_add(&fs->open_entries, 1, __ATOMIC_RELAXED);
 
             //set up the entry
             entry->access_flag = access_flag;
@@ -27,18 +26,25 @@ int allocate_open_file_entry(int access_flag, int inode_number){
 
             //init position
             entry->position = 0; 
+
+            //write-back buffer starts empty and disabled
+            entry->buffered = 0;
+            entry->wb_len = 0;
+            entry->wb_error = 0;
             
             break;
         }
     }
-    pthread_mutex_unlock(&open_file_table_mutex);
+    metrics_unlock(&fs->open_file_table_mutex, METRIC_LOCK_OPEN_FILE_TABLE);
 
     return fd;
 }
 
 
 void free_open_file_entry(int fd){
-    pthread_mutex_lock(&open_file_table_mutex);
-    open_file_table[fd].used=0;
-    pthread_mutex_unlock(&open_file_table_mutex);
+    struct rsfs *fs = rsfs_current;
+    metrics_lock(&fs->open_file_table_mutex, METRIC_LOCK_OPEN_FILE_TABLE);
+    if(fs->open_file_table[fd].used) __atomic_fetch_sub(&fs->open_entries, 1, __ATOMIC_RELAXED);
+    fs->open_file_table[fd].used=0;
+    metrics_unlock(&fs->open_file_table_mutex, METRIC_LOCK_OPEN_FILE_TABLE);
 }
\ No newline at end of file
@@ -0,0 +1,317 @@
+/*
+    public API of the file system: constants, structures and routines for applications
+*/
+
+#ifndef RSFS_H
+#define RSFS_H
+
+#include <stdint.h>
+
+
+//global constants
+#define NUM_INODES 8 //total number of inodes (files and directories, including the root directory)
+#define NUM_DBLOCKS 64 //total number of data blocks
+#define NUM_POINTERS 8 //total number of (direct) pointers for each inode; i.e., each file can have at most this number of data blocks
+#ifndef BLOCK_SIZE
+#define BLOCK_SIZE 32 //size of each data block (unit: byte); `make BLOCK_SIZE=1024` builds with larger blocks
+#endif
+#define NUM_OPEN_FILE 8 //maximum number of files that can be open at a time in the whole system
+#define INLINE_DATA_SIZE BLOCK_SIZE //files up to this size (unit: byte) are stored inside the inode, without a data block
+#define MAX_FILE_SIZE (NUM_POINTERS*BLOCK_SIZE) //largest file length (unit: byte)
+#define NUM_SNAPSHOTS 4 //maximum number of whole-filesystem snapshots kept at a time
+
+#define RSFS_RDONLY 0 //a value for access_flag in RSFS_open(): file is open for read only
+#define RSFS_RDWR 1 //a value for access_flag in RSFS_open(): file is open for read and write  
+#define RSFS_BUFFERED 2 //can be OR-ed with RSFS_RDWR in RSFS_open(): appends are buffered per fd and flushed later
+
+#define RSFS_SEEK_SET 0 //a value for whence in RSFS_fseek()
+#define RSFS_SEEK_CUR 1 //a value for whence in RSFS_fseek()
+#define RSFS_SEEK_END 2 //a value for whence in RSFS_fseek()
+
+//levels of log messages, see RSFS_log_level()
+#define LOG_ERROR 0 //a call failed
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3 //progress of successful calls (logged by default when DEBUG is 1)
+#define NUM_LOG_LEVELS 4
+
+//operations counted by the instrumentation (index into rsfs_metrics.ops)
+#define METRIC_OP_CREATE 0
+#define METRIC_OP_DELETE 1
+#define METRIC_OP_OPEN 2
+#define METRIC_OP_CLOSE 3
+#define METRIC_OP_READ 4
+#define METRIC_OP_WRITE 5
+#define METRIC_OP_APPEND 6
+#define METRIC_OP_FSEEK 7
+#define METRIC_OP_FSYNC 8
+#define METRIC_OP_CLONE 9
+#define METRIC_OP_SNAPSHOT 10
+#define METRIC_OP_RESTORE 11
+#define METRIC_OP_DELETE_SNAPSHOT 12
+#define METRIC_OP_SET_COMPRESSED 13
+#define METRIC_OP_STAT 14
+#define METRIC_OP_FSTAT 15
+#define METRIC_OP_STATFS 16
+#define METRIC_OP_MKDIR 17
+#define METRIC_OP_RMDIR 18
+#define METRIC_OP_READDIR 19
+#define METRIC_OP_CREATE_MANY 20
+#define METRIC_OP_DELETE_MANY 21
+#define METRIC_OP_COPY_RANGE 22
+#define METRIC_OP_SUBMIT_BATCH 23
+#define METRIC_OP_READDIR_PLUS 24
+#define NUM_METRIC_OPS 25
+
+//locks and waits counted by the instrumentation (index into rsfs_metrics.locks)
+#define METRIC_LOCK_INODES 0
+#define METRIC_LOCK_DATA_BITMAP 1
+#define METRIC_LOCK_ROOT_DIR 2
+#define METRIC_LOCK_OPEN_FILE_TABLE 3
+#define METRIC_LOCK_READERS_DONE 4 //waits on an inode's readers_done condition
+#define NUM_METRIC_LOCKS 5
+
+#define METRICS_HIST_BUCKETS 312 //histogram buckets: latencies up to 2^40 ns
+#define TRACE_MAGIC "RSFSTRC1" //first bytes of a trace file
+
+
+typedef struct rsfs rsfs_t; //handle of an instance, created by RSFS_new(); its layout is private to the file system
+
+
+//instrumentation: implemented in metrics.c; process-wide, not per instance
+struct rsfs_op_metrics{
+    uint64_t count; //number of calls
+    uint64_t bytes; //bytes read or written by the calls
+    uint64_t total_ns; //sum of the call latencies, estimated from the sampled calls
+    uint64_t hist[METRICS_HIST_BUCKETS]; //latency histogram of the sampled calls, see RSFS_metrics_percentile()
+};
+struct rsfs_lock_metrics{
+    uint64_t acquisitions; //number of times the lock was taken (or the condition waited on)
+    uint64_t wait_ns; //time spent waiting to get it
+    uint64_t hold_ns; //time it was held, estimated from sampled holds (not counted for condition waits)
+};
+struct rsfs_metrics{
+    struct rsfs_op_metrics ops[NUM_METRIC_OPS];
+    struct rsfs_lock_metrics locks[NUM_METRIC_LOCKS];
+};
+extern const char *metric_op_names[NUM_METRIC_OPS];
+extern const char *metric_lock_names[NUM_METRIC_LOCKS];
+void metrics_hist_add(struct rsfs_op_metrics *op, uint64_t ns, int bytes); //add a latency sample to a private histogram
+void RSFS_metrics_snapshot(struct rsfs_metrics *out); //merge every thread's counters into out (process-wide: all instances together)
+uint64_t RSFS_metrics_percentile(const struct rsfs_op_metrics *op, double p); //latency (ns) at fraction p of the calls
+
+
+//logging: implemented in log.c
+void RSFS_log_level(int level); //set the most verbose level (LOG_*) that is logged
+void RSFS_log_flush(); //wait until every logged message is written to stderr
+uint64_t RSFS_log_dropped(); //number of messages dropped because a thread's ring was full
+
+
+//tracing of API calls: implemented in trace.c, replayed by rsfs_replay.c
+struct trace_header{
+    char magic[8]; //TRACE_MAGIC
+    uint32_t record_size; //sizeof(struct trace_record) of the writer
+};
+struct trace_record{
+    uint64_t timestamp_ns; //start of the call, relative to RSFS_trace_start()
+    uint32_t duration_ns;
+    uint16_t thread; //number of the calling thread, in order of first traced call
+    uint8_t op; //METRIC_OP_* of the call
+    char file_name; //for create, delete and open
+    int32_t fd; //for calls on an open file
+    int32_t arg; //access_flag for open, size for read/write/append, offset for fseek
+    int32_t result; //return value of the call
+} __attribute__((packed));
+int RSFS_trace_start(const char *path); //start recording the API calls into the file at path
+int RSFS_trace_stop(); //stop recording and flush the trace file
+
+
+//api: a call that fails returns -1 (or NULL) and sets errno: EINVAL for a bad argument, EBADF for a bad fd,
+//ENOENT/EEXIST for a missing/existing file, ENOSPC when inodes, data blocks or snapshot slots run out,
+//EMFILE when the open file table is full, EBUSY when files are still open, EIO for inconsistent metadata,
+//ENOTDIR/EISDIR/ENOTEMPTY for a path naming the wrong kind of entry or a non-empty directory
+
+//status of the file system, filled by RSFS_statfs()
+struct rsfs_statfs{
+    int block_size; //bytes per data block
+    int total_blocks;
+    int used_blocks;
+    int block_refs; //references to the used blocks; above used_blocks when blocks are shared (dedup, clones, snapshots)
+    int total_inodes;
+    int used_inodes; //including the root directory's
+    int open_files;
+    int max_open_files;
+    int max_file_size; //bytes
+    uint64_t checksum_errors; //data blocks found not matching their CRC32C, by RSFS_read or the scrubber
+    uint64_t scrubbed_blocks; //data blocks checked by the scrubber
+    int fragmentation; //percentage of consecutive file blocks that are not adjacent in the data block array
+    uint64_t defrag_moved_blocks; //data blocks relocated by RSFS_defrag and the compactor
+    int clean_segments; //segments of SEGMENT_BLOCKS blocks none of which is allocated
+    uint64_t cleaned_blocks; //live blocks relocated by RSFS_clean and the cleaner
+    int resident_blocks; //data blocks whose memory is committed; the others are address space only, until written
+    int nodes; //NUMA nodes the data blocks are split over (1 on a single-node machine)
+    uint64_t released_pages; //pages of free data blocks given back to the OS
+};
+
+//status of an open file, filled by RSFS_fstat()
+struct rsfs_fstat{
+    int inode_number;
+    int length; //bytes in the file, not counting pending appends
+    int pending; //bytes appended through this fd (RSFS_BUFFERED) and not flushed yet
+    int blocks; //data blocks the file points to (0 for an inline file)
+    int local_blocks; //those of them on the NUMA node of the calling thread
+    int stored; //bytes of storage holding the content (compressed size for a compressed file)
+    char is_inline; //1 if the content lives inside the inode
+    char compressed; //1 if the content is stored LZ-compressed
+    char access_flag; //RSFS_RDONLY or RSFS_RDWR
+    int position; //current position of fd
+};
+
+//entry of a directory with the attributes of its file, filled by RSFS_readdir_plus()
+struct rsfs_dirent{
+    char name;
+    char is_dir; //1 for a subdirectory
+    int inode_number;
+    int length; //bytes in the file (entries for a subdirectory), not counting appends pending in a write-back buffer
+    int blocks; //data blocks the file points to (0 for an inline file)
+};
+
+//api - basic: already implemented in api.c
+int RSFS_init(); //initialize thesystem (provided)
+void RSFS_stat(); //print the file's stat (provided)
+int RSFS_statfs(struct rsfs_statfs *st); //fill st with the file system's counters, in O(1) and without locking
+int RSFS_fstat(int fd, struct rsfs_fstat *st); //fill st with the status of the open file fd
+void RSFS_set_dedup(int enable); //turn block-level deduplication on (1) or off (0)
+void RSFS_set_checksum_verify(int enable); //make RSFS_read check block checksums (1) or not (0)
+int RSFS_scrub_start(int interval_ms); //start the background scrubber, pausing interval_ms between batches
+int RSFS_scrub_stop(); //stop the background scrubber
+int RSFS_defrag(); //move each fragmented file into adjacent blocks; return the number of blocks moved
+int RSFS_defrag_start(int interval_ms, int threshold); //compact in the background whenever fragmentation reaches threshold%
+int RSFS_defrag_stop(); //stop the background compactor
+void RSFS_set_log_mode(int enable); //allocate blocks at the head of a log and write them out of place (1) or in place (0)
+int RSFS_clean(); //relocate the live blocks of sparse segments of the log; return the number of blocks moved
+int RSFS_cleaner_start(int interval_ms, int threshold); //clean in the background segments at most threshold% live
+int RSFS_cleaner_stop(); //stop the background cleaner
+int RSFS_set_compressed(int fd, int enable); //store the (still empty) file of fd compressed (1) or raw (0)
+
+//api - basic: required to be implemented in api.c
+int RSFS_create(char file_name); //create an empty file and return the file handler (i.e., index of the entry in open_file_table)
+int RSFS_open(char file_name, int access_flag); //open an existing file and return the file handler
+int RSFS_append(int fd, void *buf, int size); //append to the end of the file, and return the actual number of bytes appended
+int RSFS_fseek(int fd, int offset); //change the current location of the file
+int RSFS_read(int fd, void *buf, int size); //read from file, and return the actual number of bytes read
+int RSFS_close(int fd); //close the file
+int RSFS_fsync(int fd); //flush the write-back buffer of fd (RSFS_BUFFERED mode) into data blocks
+
+//api - advanced: to be implemented in api.c
+int RSFS_write(int fd, void *buf, int size);
+int RSFS_cut(int fd, int size); 
+int RSFS_delete(char file_name); //delete the file with the provided file_name
+
+//api - batched metadata: implemented in api.c; each lock is taken once for the whole batch
+int RSFS_create_many(const char *names, int n, int *results); //create n files; return how many were created
+int RSFS_delete_many(const char *names, int n, int *results); //delete n files; return how many were deleted
+
+//api - compound operations: implemented in api.c; the consecutive reads, writes, appends and fseeks of a batch on one
+//fd are validated and take the fd's entry_mutex once, and a batch can chain an open with the calls on the fd it
+//returns; opens and closes lock the open file table like the single calls
+#define RSFS_BATCH_OPEN 0 //RSFS_open(file_name, access_flag)
+#define RSFS_BATCH_READ 1 //RSFS_read(fd, buf, size)
+#define RSFS_BATCH_WRITE 2 //RSFS_write(fd, buf, size)
+#define RSFS_BATCH_APPEND 3 //RSFS_append(fd, buf, size), bypassing the write-back buffer of a RSFS_BUFFERED fd
+#define RSFS_BATCH_FSEEK 4 //RSFS_fseek(fd, offset)
+#define RSFS_BATCH_CLOSE 5 //RSFS_close(fd)
+#define RSFS_BATCH_FD -1 //a value for fd: the fd returned by the latest RSFS_BATCH_OPEN of the batch
+struct rsfs_batch_op{
+    int op; //RSFS_BATCH_*
+    int fd; //fd the operation works on, or RSFS_BATCH_FD
+    char file_name; //for RSFS_BATCH_OPEN
+    int access_flag; //for RSFS_BATCH_OPEN
+    void *buf; //for RSFS_BATCH_READ/WRITE/APPEND
+    int size; //likewise
+    int offset; //for RSFS_BATCH_FSEEK
+    int result; //set by RSFS_submit_batch(): what the equivalent call returns
+};
+int RSFS_submit_batch(struct rsfs_batch_op *ops, int n); //run n operations in order; return how many succeeded
+
+//api - directories: implemented in api.c; a path is "a/b/c", every component being a one-character name
+int RSFS_mkdir(const char *path); //create an empty directory
+int RSFS_rmdir(const char *path); //delete an empty directory
+int RSFS_readdir(const char *path, char *names, int max); //store up to max entry names of a directory; return their number
+int RSFS_readdir_plus(const char *path, int *cursor, struct rsfs_dirent *ents, int max); //entries with attributes, from *cursor
+int RSFS_create_path(const char *path); //create an empty file in an existing directory
+int RSFS_open_path(const char *path, int access_flag); //like RSFS_open(), by path
+int RSFS_delete_path(const char *path); //like RSFS_delete(), by path
+
+//api - copy-on-write: implemented in api.c
+int RSFS_clone(char src_name, char dst_name); //create file dst_name sharing the content of src_name
+int RSFS_copy_range(int fd_in, int off_in, int fd_out, int off_out, int len); //copy len bytes between files, sharing whole blocks
+int RSFS_snapshot(); //capture all files, sharing their blocks; return the snapshot id
+int RSFS_restore(int snapshot_id); //replace all files by those captured in the snapshot
+int RSFS_delete_snapshot(int snapshot_id); //release a snapshot and its block references
+
+//api - instances: implemented in instance.c; RSFS_init() sets up the default instance, used until RSFS_use()
+rsfs_t *RSFS_new(); //create and initialize an independent instance; return its handle, or NULL
+void RSFS_free(rsfs_t *fs); //release an instance created by RSFS_new()
+rsfs_t *RSFS_use(rsfs_t *fs); //make the calling thread's RSFS_* calls work on fs (NULL-the default); return the previous one
+int RSFS_fs_create(rsfs_t *fs, char file_name); //RSFS_create() on instance fs; likewise for the calls below
+int RSFS_fs_delete(rsfs_t *fs, char file_name);
+int RSFS_fs_open(rsfs_t *fs, char file_name, int access_flag);
+int RSFS_fs_close(rsfs_t *fs, int fd);
+int RSFS_fs_read(rsfs_t *fs, int fd, void *buf, int size);
+int RSFS_fs_append(rsfs_t *fs, int fd, void *buf, int size);
+int RSFS_fs_write(rsfs_t *fs, int fd, void *buf, int size);
+int RSFS_fs_fseek(rsfs_t *fs, int fd, int offset);
+int RSFS_fs_statfs(rsfs_t *fs, struct rsfs_statfs *st);
+void RSFS_fs_stat(rsfs_t *fs);
+int RSFS_fs_fstat(rsfs_t *fs, int fd, struct rsfs_fstat *st);
+int RSFS_fs_fsync(rsfs_t *fs, int fd);
+int RSFS_fs_set_compressed(rsfs_t *fs, int fd, int enable);
+void RSFS_fs_set_dedup(rsfs_t *fs, int enable);
+void RSFS_fs_set_checksum_verify(rsfs_t *fs, int enable);
+void RSFS_fs_set_log_mode(rsfs_t *fs, int enable);
+int RSFS_fs_scrub_start(rsfs_t *fs, int interval_ms);
+int RSFS_fs_scrub_stop(rsfs_t *fs);
+int RSFS_fs_defrag(rsfs_t *fs);
+int RSFS_fs_defrag_start(rsfs_t *fs, int interval_ms, int threshold);
+int RSFS_fs_defrag_stop(rsfs_t *fs);
+int RSFS_fs_clean(rsfs_t *fs);
+int RSFS_fs_cleaner_start(rsfs_t *fs, int interval_ms, int threshold);
+int RSFS_fs_cleaner_stop(rsfs_t *fs);
+int RSFS_fs_create_many(rsfs_t *fs, const char *names, int n, int *results);
+int RSFS_fs_delete_many(rsfs_t *fs, const char *names, int n, int *results);
+int RSFS_fs_submit_batch(rsfs_t *fs, struct rsfs_batch_op *ops, int n);
+int RSFS_fs_mkdir(rsfs_t *fs, const char *path);
+int RSFS_fs_rmdir(rsfs_t *fs, const char *path);
+int RSFS_fs_readdir(rsfs_t *fs, const char *path, char *names, int max);
+int RSFS_fs_readdir_plus(rsfs_t *fs, const char *path, int *cursor, struct rsfs_dirent *ents, int max);
+int RSFS_fs_create_path(rsfs_t *fs, const char *path);
+int RSFS_fs_open_path(rsfs_t *fs, const char *path, int access_flag);
+int RSFS_fs_delete_path(rsfs_t *fs, const char *path);
+int RSFS_fs_clone(rsfs_t *fs, char src_name, char dst_name);
+int RSFS_fs_copy_range(rsfs_t *fs, int fd_in, int off_in, int fd_out, int off_out, int len);
+int RSFS_fs_snapshot(rsfs_t *fs);
+int RSFS_fs_restore(rsfs_t *fs, int snapshot_id);
+int RSFS_fs_delete_snapshot(rsfs_t *fs, int snapshot_id);
+
+//api - shared memory: implemented in shm.c; an instance in a POSIX shared memory segment, used by several processes
+rsfs_t *RSFS_shm_open(const char *name); //create and initialize the segment "name", or attach to it; return its instance, or NULL
+int RSFS_shm_close(rsfs_t *fs); //unmap an instance opened by RSFS_shm_open(); the segment stays for the other processes
+int RSFS_shm_unlink(const char *name); //remove the segment once every process has closed it
+
+//api - sharding: implemented in shard.c; files are spread over instances by name, and fds are valid across shards
+typedef struct rsfs_shards rsfs_shards_t;
+rsfs_shards_t *RSFS_shards_new(int num_shards); //create num_shards instances (one per online CPU if <=0), or NULL
+void RSFS_shards_free(rsfs_shards_t *s); //release the front-end and its instances
+int RSFS_shards_count(rsfs_shards_t *s); //number of shards
+rsfs_t *RSFS_shard_of(rsfs_shards_t *s, char file_name); //the instance holding file_name
+int RSFS_shards_create(rsfs_shards_t *s, char file_name); //RSFS_create() on the shard of file_name; likewise below
+int RSFS_shards_delete(rsfs_shards_t *s, char file_name);
+int RSFS_shards_open(rsfs_shards_t *s, char file_name, int access_flag);
+int RSFS_shards_close(rsfs_shards_t *s, int fd);
+int RSFS_shards_read(rsfs_shards_t *s, int fd, void *buf, int size);
+int RSFS_shards_append(rsfs_shards_t *s, int fd, void *buf, int size);
+int RSFS_shards_write(rsfs_shards_t *s, int fd, void *buf, int size);
+int RSFS_shards_fseek(rsfs_shards_t *s, int fd, int offset);
+
+#endif
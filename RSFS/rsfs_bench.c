@@ -0,0 +1,299 @@
+/*
+    rsfs_bench: configurable workload generator for the API;
+    runs a mix of operations from several threads for a fixed duration
+    and prints throughput and latency percentiles as JSON
+*/
+
+#include "rsfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+//operations of the workload mix; each one is a complete, request-scoped access to a file
+#define BENCH_CREATE 0 //RSFS_create
+#define BENCH_OPEN 1 //RSFS_open (read only) + RSFS_close
+#define BENCH_READ 2 //RSFS_open + RSFS_fseek + RSFS_read + RSFS_close
+#define BENCH_APPEND 3 //RSFS_open (read/write) + RSFS_append + RSFS_close
+#define BENCH_WRITE 4 //RSFS_open (read/write) + RSFS_fseek + RSFS_write + RSFS_close
+#define BENCH_FSEEK 5 //RSFS_open + RSFS_fseek + RSFS_close
+#define BENCH_DELETE 6 //RSFS_delete
+#define NUM_BENCH_OPS 7
+
+const char *bench_op_names[NUM_BENCH_OPS] = {"create", "open", "read", "append", "write", "fseek", "delete"};
+
+//workload configuration, set from the command line
+struct bench_config{
+    int threads;
+    int files;
+    int weight[NUM_BENCH_OPS]; //relative frequency of each operation
+    int io_size; //bytes per read/append/write
+    int random; //1-random offsets, 0-sequential offsets
+    double duration; //seconds
+    unsigned int seed;
+};
+
+//results of one thread
+struct bench_thread{
+    pthread_t thread;
+    int id;
+    struct bench_config *config;
+    unsigned int rand_state;
+    int offset; //next offset for sequential access
+    uint64_t ops[NUM_BENCH_OPS];
+    uint64_t errors[NUM_BENCH_OPS];
+    uint64_t bytes[NUM_BENCH_OPS];
+    struct rsfs_op_metrics latency[NUM_BENCH_OPS];
+};
+
+static volatile int stop = 0; //set by main when the duration is over
+
+
+//helper: current time in nanoseconds
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+//helper: next offset to access in a file of the given length
+static int next_offset(struct bench_thread *t, int length){
+    if(length<=0) return 0;
+    if(t->config->random) return rand_r(&t->rand_state) % length;
+
+    if(t->offset >= length) t->offset = 0;
+    int offset = t->offset;
+    t->offset += t->config->io_size;
+    return offset;
+}
+
+//run one operation on file_name; return the number of bytes moved, or -1 on error
+static int run_op(struct bench_thread *t, int op, char file_name, char *buf){
+    int size = t->config->io_size;
+    int fd, ret;
+
+    switch(op){
+    case BENCH_CREATE:
+        return RSFS_create(file_name)==0 ? 0 : -1;
+
+    case BENCH_DELETE:
+        return RSFS_delete(file_name)==0 ? 0 : -1;
+
+    case BENCH_OPEN:
+        if((fd = RSFS_open(file_name, RSFS_RDONLY)) < 0) return -1;
+        RSFS_close(fd);
+        return 0;
+
+    case BENCH_FSEEK:
+    case BENCH_READ:
+        if((fd = RSFS_open(file_name, RSFS_RDONLY)) < 0) return -1;
+        RSFS_fseek(fd, 0);
+        int length = RSFS_read(fd, buf, MAX_FILE_SIZE); //learn the length
+        ret = RSFS_fseek(fd, next_offset(t, length));
+        if(op==BENCH_READ && ret>=0) ret = RSFS_read(fd, buf, size);
+        RSFS_close(fd);
+        return (ret<0) ? -1 : (op==BENCH_READ ? ret : 0);
+
+    case BENCH_APPEND:
+        if((fd = RSFS_open(file_name, RSFS_RDWR)) < 0) return -1;
+        ret = RSFS_append(fd, buf, size);
+        if(ret==0){ //file is full: start it over
+            RSFS_fseek(fd, 0);
+            ret = RSFS_write(fd, buf, size);
+        }
+        RSFS_close(fd);
+        return ret;
+
+    case BENCH_WRITE:
+        if((fd = RSFS_open(file_name, RSFS_RDWR)) < 0) return -1;
+        RSFS_fseek(fd, 0);
+        length = RSFS_read(fd, buf, MAX_FILE_SIZE);
+        int offset = next_offset(t, length);
+        if(offset+size > MAX_FILE_SIZE) offset = 0;
+        RSFS_fseek(fd, offset);
+        ret = RSFS_write(fd, buf, size);
+        RSFS_close(fd);
+        return ret;
+    }
+    return -1;
+}
+
+//worker thread: pick operations by weight until stopped
+void *bench_thread_main(void *ptr){
+    struct bench_thread *t = (struct bench_thread *)ptr;
+    struct bench_config *config = t->config;
+    char buf[MAX_FILE_SIZE];
+    memset(buf, 'a'+t->id%26, sizeof(buf));
+
+    int total_weight = 0;
+    for(int op=0; op<NUM_BENCH_OPS; op++) total_weight += config->weight[op];
+
+    while(!stop){
+        int pick = rand_r(&t->rand_state) % total_weight, op = 0;
+        while(pick >= config->weight[op]) pick -= config->weight[op++];
+        char file_name = 'a' + rand_r(&t->rand_state) % config->files;
+
+        uint64_t start = now_ns();
+        int ret = run_op(t, op, file_name, buf);
+        metrics_hist_add(&t->latency[op], now_ns()-start, ret);
+
+        t->ops[op]++;
+        if(ret<0) t->errors[op]++;
+        else t->bytes[op] += ret;
+    }
+    return NULL;
+}
+
+
+//helper: parse an op mix such as "read=70,append=20,write=10"; return 0 if valid
+static int parse_mix(char *mix, int *weight){
+    for(int op=0; op<NUM_BENCH_OPS; op++) weight[op] = 0;
+
+    for(char *item = strtok(mix, ","); item; item = strtok(NULL, ",")){
+        char *eq = strchr(item, '=');
+        if(eq==NULL) return -1;
+        *eq = 0;
+
+        int op;
+        for(op=0; op<NUM_BENCH_OPS; op++){
+            if(strcmp(item, bench_op_names[op])==0) break;
+        }
+        if(op==NUM_BENCH_OPS || atoi(eq+1)<0) return -1;
+        weight[op] = atoi(eq+1);
+    }
+
+    int total_weight = 0;
+    for(int op=0; op<NUM_BENCH_OPS; op++) total_weight += weight[op];
+    return total_weight>0 ? 0 : -1;
+}
+
+static void usage(char *prog){
+    fprintf(stderr,
+        "usage: %s [-t threads] [-f files] [-m mix] [-s io_size] [-r] [-d seconds] [-S seed] [-o file] [-T trace]\n"
+        "  -t  number of threads (default 4)\n"
+        "  -f  number of files, at most %d (default 4)\n"
+        "  -m  op mix as name=weight pairs over create,open,read,append,write,fseek,delete\n"
+        "      (default read=60,append=20,write=10,fseek=10)\n"
+        "  -s  bytes per read/append/write, at most %d (default %d)\n"
+        "  -r  random offsets instead of sequential ones\n"
+        "  -d  duration in seconds (default 2)\n"
+        "  -S  random seed (default 352)\n"
+        "  -o  write the JSON report to file instead of stdout\n"
+        "  -T  record every call into trace (replay it with rsfs_replay)\n",
+        prog, NUM_INODES-1, MAX_FILE_SIZE, BLOCK_SIZE);
+}
+
+
+int main(int argc, char **argv){
+    struct bench_config config = {4, 4, {0}, BLOCK_SIZE, 0, 2.0, 352};
+    char default_mix[] = "read=60,append=20,write=10,fseek=10";
+    parse_mix(default_mix, config.weight);
+
+    FILE *out = stdout;
+    char *trace_path = NULL;
+    int opt;
+    while((opt = getopt(argc, argv, "t:f:m:s:rd:S:o:T:h")) != -1){
+        switch(opt){
+        case 't': config.threads = atoi(optarg); break;
+        case 'f': config.files = atoi(optarg); break;
+        case 'm':
+            if(parse_mix(optarg, config.weight)!=0){
+                fprintf(stderr, "invalid op mix\n");
+                return 1;
+            }
+            break;
+        case 's': config.io_size = atoi(optarg); break;
+        case 'r': config.random = 1; break;
+        case 'd': config.duration = atof(optarg); break;
+        case 'S': config.seed = atoi(optarg); break;
+        case 'o':
+            if((out = fopen(optarg, "w"))==NULL){
+                fprintf(stderr, "cannot open %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'T': trace_path = optarg; break;
+        default: usage(argv[0]); return 1;
+        }
+    }
+    if(config.threads<1 || config.files<1 || config.files>NUM_INODES-1
+        || config.io_size<1 || config.io_size>MAX_FILE_SIZE || config.duration<=0){
+        usage(argv[0]);
+        return 1;
+    }
+
+    if(RSFS_init()!=0){
+        fprintf(stderr, "fail to initialize the file system\n");
+        return 1;
+    }
+
+    //the setup is traced too, so a replay starts from the same state
+    if(trace_path!=NULL && RSFS_trace_start(trace_path)!=0){
+        fprintf(stderr, "cannot start tracing to %s\n", trace_path);
+        return 1;
+    }
+
+    //the files start half full
+    char buf[MAX_FILE_SIZE];
+    memset(buf, 'x', sizeof(buf));
+    for(int i=0; i<config.files; i++){
+        RSFS_create('a'+i);
+        int fd = RSFS_open('a'+i, RSFS_RDWR);
+        RSFS_append(fd, buf, MAX_FILE_SIZE/2);
+        RSFS_close(fd);
+    }
+
+    //run
+    struct bench_thread *threads = calloc(config.threads, sizeof(struct bench_thread));
+    if(threads==NULL) return 1;
+
+    uint64_t start = now_ns();
+    for(int i=0; i<config.threads; i++){
+        threads[i].id = i;
+        threads[i].config = &config;
+        threads[i].rand_state = config.seed + i;
+        pthread_create(&threads[i].thread, NULL, bench_thread_main, &threads[i]);
+    }
+    usleep((useconds_t)(config.duration*1e6));
+    stop = 1;
+    for(int i=0; i<config.threads; i++) pthread_join(threads[i].thread, NULL);
+    double elapsed = (now_ns()-start)/1e9;
+    if(trace_path!=NULL) RSFS_trace_stop();
+
+    //merge the threads' results and report them
+    uint64_t total_ops = 0, total_bytes = 0;
+    fprintf(out, "{\"threads\": %d, \"files\": %d, \"io_size\": %d, \"access\": \"%s\", \"duration_s\": %.3f, \"ops\": {",
+        config.threads, config.files, config.io_size, config.random ? "random" : "sequential", elapsed);
+
+    int first = 1;
+    for(int op=0; op<NUM_BENCH_OPS; op++){
+        struct rsfs_op_metrics latency;
+        uint64_t ops = 0, errors = 0, bytes = 0;
+        memset(&latency, 0, sizeof(latency));
+        for(int i=0; i<config.threads; i++){
+            ops += threads[i].ops[op];
+            errors += threads[i].errors[op];
+            bytes += threads[i].bytes[op];
+            for(int b=0; b<METRICS_HIST_BUCKETS; b++) latency.hist[b] += threads[i].latency[op].hist[b];
+        }
+        if(config.weight[op]==0) continue;
+        total_ops += ops;
+        total_bytes += bytes;
+
+        fprintf(out, "%s\n  \"%s\": {\"ops\": %lu, \"errors\": %lu, \"ops_per_s\": %.0f, \"mb_per_s\": %.3f, "
+            "\"p50_ns\": %lu, \"p90_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu}",
+            first ? "" : ",", bench_op_names[op], ops, errors, ops/elapsed, bytes/elapsed/1e6,
+            RSFS_metrics_percentile(&latency, 0.5), RSFS_metrics_percentile(&latency, 0.9),
+            RSFS_metrics_percentile(&latency, 0.99), RSFS_metrics_percentile(&latency, 0.999));
+        first = 0;
+    }
+    fprintf(out, "},\n  \"total\": {\"ops\": %lu, \"ops_per_s\": %.0f, \"mb_per_s\": %.3f}}\n",
+        total_ops, total_ops/elapsed, total_bytes/elapsed/1e6);
+
+    if(out!=stdout) fclose(out);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,207 @@
+/*
+    rsfs_replay: re-executes a trace recorded with RSFS_trace_start() against a fresh file system,
+    either keeping the original timing (and so the thread interleaving) or as fast as possible
+*/
+
+#include "rsfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+struct replay_thread{
+    pthread_t thread;
+    int num_records;
+    struct trace_record *records; //this thread's records, in call order
+    uint64_t mismatches; //calls whose result differed from the recorded one
+    int fd_map[NUM_OPEN_FILE]; //recorded fd -> replay fd for the files this thread opened (-1 if none)
+};
+
+static int timed = 1; //1-wait for each call's original start time, 0-as fast as possible
+static int max_size = 1; //largest buffer any read/write/append needs
+static uint64_t replay_t0;
+
+//recorded fd -> replay fd for fds used by a thread other than the one that opened them (-1 if not open);
+//fd numbers are reused, so a thread's own opens take precedence
+static int fd_map[NUM_OPEN_FILE];
+static pthread_mutex_t fd_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+//helper: current time in nanoseconds
+static uint64_t now_ns(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+//helper: the replay's fd for a recorded fd
+static int map_fd(struct replay_thread *t, int fd){
+    if(fd<0 || fd>=NUM_OPEN_FILE) return fd;
+    if(t->fd_map[fd]>=0) return t->fd_map[fd];
+
+    pthread_mutex_lock(&fd_map_mutex);
+    int mapped = fd_map[fd];
+    pthread_mutex_unlock(&fd_map_mutex);
+    return mapped;
+}
+
+//helper: remember the replay's fd for a recorded fd opened by thread t
+static void open_fd(struct replay_thread *t, int fd, int mapped){
+    if(fd<0 || fd>=NUM_OPEN_FILE) return;
+
+    t->fd_map[fd] = mapped;
+    pthread_mutex_lock(&fd_map_mutex);
+    fd_map[fd] = mapped;
+    pthread_mutex_unlock(&fd_map_mutex);
+}
+
+//helper: forget a recorded fd closed by thread t, whose replay fd was mapped
+static void close_fd(struct replay_thread *t, int fd, int mapped){
+    if(fd<0 || fd>=NUM_OPEN_FILE) return;
+
+    t->fd_map[fd] = -1;
+    pthread_mutex_lock(&fd_map_mutex);
+    if(fd_map[fd]==mapped) fd_map[fd] = -1;
+    pthread_mutex_unlock(&fd_map_mutex);
+}
+
+//replay the records of one thread
+void *replay_thread_main(void *ptr){
+    struct replay_thread *t = (struct replay_thread *)ptr;
+    char *buf = malloc(max_size);
+    if(buf==NULL) return NULL;
+    memset(buf, 'r', max_size);
+
+    for(int i=0; i<t->num_records; i++){
+        struct trace_record *r = &t->records[i];
+
+        if(timed){
+            uint64_t due = replay_t0 + r->timestamp_ns, now = now_ns();
+            if(due > now){
+                struct timespec pause = {(due-now)/1000000000u, (due-now)%1000000000u};
+                nanosleep(&pause, NULL);
+            }
+        }
+
+        int ret = -1, same;
+        switch(r->op){
+        case METRIC_OP_CREATE: ret = RSFS_create(r->file_name); break;
+        case METRIC_OP_DELETE: ret = RSFS_delete(r->file_name); break;
+        case METRIC_OP_OPEN:
+            ret = RSFS_open(r->file_name, r->arg);
+            if(ret>=0 && r->result>=0) open_fd(t, r->result, ret);
+            break;
+        case METRIC_OP_CLOSE:{
+            int fd = map_fd(t, r->fd);
+            ret = RSFS_close(fd);
+            close_fd(t, r->fd, fd);
+            break;
+        }
+        case METRIC_OP_READ: ret = RSFS_read(map_fd(t, r->fd), buf, r->arg); break;
+        case METRIC_OP_WRITE: ret = RSFS_write(map_fd(t, r->fd), buf, r->arg); break;
+        case METRIC_OP_APPEND: ret = RSFS_append(map_fd(t, r->fd), buf, r->arg); break;
+        case METRIC_OP_FSEEK: ret = RSFS_fseek(map_fd(t, r->fd), r->arg); break;
+        }
+
+        //fds differ between runs: for open only success vs. failure is compared
+        same = (r->op==METRIC_OP_OPEN) ? ((ret>=0) == (r->result>=0)) : (ret==r->result);
+        if(!same) t->mismatches++;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+
+int main(int argc, char **argv){
+    int opt;
+    while((opt = getopt(argc, argv, "fh")) != -1){
+        switch(opt){
+        case 'f': timed = 0; break;
+        default:
+            fprintf(stderr, "usage: %s [-f] trace_file\n"
+                "  -f  replay as fast as possible instead of keeping the original timing\n", argv[0]);
+            return 1;
+        }
+    }
+    if(optind >= argc){
+        fprintf(stderr, "usage: %s [-f] trace_file\n", argv[0]);
+        return 1;
+    }
+
+    //load the trace
+    FILE *file = fopen(argv[optind], "rb");
+    if(file==NULL){
+        fprintf(stderr, "cannot open %s\n", argv[optind]);
+        return 1;
+    }
+    struct trace_header header;
+    if(fread(&header, sizeof(header), 1, file)!=1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic))!=0
+        || header.record_size!=sizeof(struct trace_record)){
+        fprintf(stderr, "%s is not a trace file of this version\n", argv[optind]);
+        return 1;
+    }
+
+    int capacity = 1024, num_records = 0, num_threads = 0;
+    struct trace_record *records = malloc(capacity*sizeof(struct trace_record));
+    while(records && fread(&records[num_records], sizeof(struct trace_record), 1, file)==1){
+        struct trace_record *r = &records[num_records++];
+        if(r->thread >= num_threads) num_threads = r->thread+1;
+        if(r->op!=METRIC_OP_FSEEK && r->arg > max_size) max_size = r->arg;
+        if(num_records==capacity){
+            capacity *= 2;
+            records = realloc(records, capacity*sizeof(struct trace_record));
+        }
+    }
+    fclose(file);
+    if(records==NULL){
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
+    //split the records by thread, keeping their order
+    struct replay_thread *threads = calloc(num_threads, sizeof(struct replay_thread));
+    for(int i=0; i<num_records; i++) threads[records[i].thread].num_records++;
+    for(int t=0; t<num_threads; t++){
+        threads[t].records = malloc(threads[t].num_records*sizeof(struct trace_record));
+        threads[t].num_records = 0;
+        for(int i=0; i<NUM_OPEN_FILE; i++) threads[t].fd_map[i] = -1;
+    }
+    uint64_t trace_duration = 0;
+    for(int i=0; i<num_records; i++){
+        struct replay_thread *t = &threads[records[i].thread];
+        t->records[t->num_records++] = records[i];
+        if(records[i].timestamp_ns + records[i].duration_ns > trace_duration){
+            trace_duration = records[i].timestamp_ns + records[i].duration_ns;
+        }
+    }
+
+    //replay against a fresh file system
+    if(RSFS_init()!=0){
+        fprintf(stderr, "fail to initialize the file system\n");
+        return 1;
+    }
+    for(int i=0; i<NUM_OPEN_FILE; i++) fd_map[i] = -1;
+
+    replay_t0 = now_ns();
+    for(int t=0; t<num_threads; t++) pthread_create(&threads[t].thread, NULL, replay_thread_main, &threads[t]);
+    uint64_t mismatches = 0;
+    for(int t=0; t<num_threads; t++){
+        pthread_join(threads[t].thread, NULL);
+        mismatches += threads[t].mismatches;
+    }
+    double elapsed = (now_ns()-replay_t0)/1e9;
+
+    printf("{\"records\": %d, \"threads\": %d, \"mode\": \"%s\", \"trace_duration_s\": %.6f, "
+        "\"replay_duration_s\": %.6f, \"ops_per_s\": %.0f, \"result_mismatches\": %lu}\n",
+        num_records, num_threads, timed ? "timed" : "fast", trace_duration/1e9, elapsed,
+        num_records/elapsed, mismatches);
+
+    for(int t=0; t<num_threads; t++) free(threads[t].records);
+    free(threads);
+    free(records);
+    return 0;
+}
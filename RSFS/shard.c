@@ -0,0 +1,111 @@
+/*
+    sharded front-end: files spread by name over independent instances, one per core by default,
+    so that calls on files of different shards share no lock or cache line;
+    routines for creating the shards and the file API on them
+*/
+
+#include "def.h"
+#include <unistd.h>
+
+
+struct rsfs_shards{
+    int num_shards;
+    rsfs_t *shards[]; //one instance per shard
+};
+
+
+//create num_shards instances (one per online CPU if num_shards<=0)
+//return the front-end, or NULL if out of memory
+rsfs_shards_t *RSFS_shards_new(int num_shards){
+    if(num_shards<=0) num_shards = sysconf(_SC_NPROCESSORS_ONLN);
+    if(num_shards<=0) num_shards = 1;
+
+    rsfs_shards_t *s = malloc(sizeof(rsfs_shards_t) + num_shards*sizeof(rsfs_t *));
+    if(s==NULL){
+        rsfs_error(ENOMEM, "[RSFS_shards_new] fails to allocate %d shards\n", num_shards);
+        return NULL;
+    }
+
+    for(s->num_shards=0; s->num_shards<num_shards; s->num_shards++){
+        s->shards[s->num_shards] = RSFS_new();
+        if(s->shards[s->num_shards]==NULL){
+            RSFS_shards_free(s);
+            return NULL;
+        }
+    }
+    return s;
+}
+
+//release the front-end and all its instances
+void RSFS_shards_free(rsfs_shards_t *s){
+    if(s==NULL) return;
+    for(int i=0; i<s->num_shards; i++) RSFS_free(s->shards[i]);
+    free(s);
+}
+
+//number of shards
+int RSFS_shards_count(rsfs_shards_t *s){
+    return s->num_shards;
+}
+
+//the instance holding file_name
+rsfs_t *RSFS_shard_of(rsfs_shards_t *s, char file_name){
+    return s->shards[(unsigned char)file_name % s->num_shards];
+}
+
+//helper: the instance and the instance's fd behind an fd of the front-end (shard*NUM_OPEN_FILE + fd); NULL if invalid
+static rsfs_t *shard_of_fd(rsfs_shards_t *s, int sfd, int *fd){
+    if(sfd<0 || sfd>=s->num_shards*NUM_OPEN_FILE){
+        rsfs_error(EBADF, "[RSFS_shards] invalid fd: %d\n", sfd);
+        return NULL;
+    }
+    *fd = sfd % NUM_OPEN_FILE;
+    return s->shards[sfd / NUM_OPEN_FILE];
+}
+
+
+//------ the file API on the front-end: like RSFS_*, with fds valid across all shards ------
+
+int RSFS_shards_create(rsfs_shards_t *s, char file_name){
+    return RSFS_fs_create(RSFS_shard_of(s, file_name), file_name);
+}
+
+int RSFS_shards_delete(rsfs_shards_t *s, char file_name){
+    return RSFS_fs_delete(RSFS_shard_of(s, file_name), file_name);
+}
+
+int RSFS_shards_open(rsfs_shards_t *s, char file_name, int access_flag){
+    int shard = (unsigned char)file_name % s->num_shards;
+    int fd = RSFS_fs_open(s->shards[shard], file_name, access_flag);
+    return fd<0 ? fd : shard*NUM_OPEN_FILE + fd;
+}
+
+int RSFS_shards_close(rsfs_shards_t *s, int sfd){
+    int fd;
+    rsfs_t *fs = shard_of_fd(s, sfd, &fd);
+    return fs ? RSFS_fs_close(fs, fd) : -1;
+}
+
+int RSFS_shards_read(rsfs_shards_t *s, int sfd, void *buf, int size){
+    int fd;
+    rsfs_t *fs = shard_of_fd(s, sfd, &fd);
+    return fs ? RSFS_fs_read(fs, fd, buf, size) : -1;
+}
+
+int RSFS_shards_append(rsfs_shards_t *s, int sfd, void *buf, int size){
+    int fd;
+    rsfs_t *fs = shard_of_fd(s, sfd, &fd);
+    return fs ? RSFS_fs_append(fs, fd, buf, size) : -1;
+}
+
+int RSFS_shards_write(rsfs_shards_t *s, int sfd, void *buf, int size){
+    int fd;
+    rsfs_t *fs = shard_of_fd(s, sfd, &fd);
+    return fs ? RSFS_fs_write(fs, fd, buf, size) : -1;
+}
+
+int RSFS_shards_fseek(rsfs_shards_t *s, int sfd, int offset){
+    int fd;
+    rsfs_t *fs = shard_of_fd(s, sfd, &fd);
+    return fs ? RSFS_fs_fseek(fs, fd, offset) : -1;
+}
@@ -0,0 +1,206 @@
+/*
+    instances in POSIX shared memory, opened by several processes at once, and the process-shared locks they use;
+    routines for creating, attaching to and removing a segment, and for initializing and recovering the locks
+*/
+
+#include "def.h"
+#include <fcntl.h>
+#include <sched.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define SHM_MAGIC "RSFSSHM1" //first bytes of a segment
+#define SHM_ATTACH_TRIES 100000 //yields an attaching process waits for the creator to finish initializing
+
+
+//a segment: the instance, after a header telling the attaching processes when it is ready to use;
+//the instance holds block numbers and inode numbers only, never an address, so each process may map it anywhere
+struct rsfs_shm{
+    char magic[8]; //SHM_MAGIC
+    uint32_t size; //sizeof(struct rsfs_shm) of the creator
+    int ready; //set by the creator once the instance is initialized
+    pid_t creator; //the process that initialized the instance: the only one running its background threads
+    struct rsfs fs __attribute__((aligned(64)));
+};
+
+
+//------ locks of an instance: process-shared and robust when it lives in a segment ------
+
+void rsfs_mutex_init(pthread_mutex_t *mutex){
+    struct rsfs *fs = rsfs_current;
+    if(!fs->shared){
+        pthread_mutex_init(mutex, NULL);
+        return;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST); //a process dying with it held does not block the others
+    pthread_mutex_init(mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+void rsfs_cond_init(pthread_cond_t *cond){
+    struct rsfs *fs = rsfs_current;
+    if(!fs->shared){
+        pthread_cond_init(cond, NULL);
+        return;
+    }
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+//the previous holder of mutex died while holding it, and the caller got it with EOWNERDEAD:
+//what the holder was updating may be half done, but the structures stay usable, so carry on with them
+void rsfs_mutex_recover(pthread_mutex_t *mutex){
+    pthread_mutex_consistent(mutex);
+    rsfs_log(LOG_WARN, "[rsfs_mutex_recover] a process died holding a lock; its last update may be incomplete\n");
+}
+
+void rsfs_mutex_lock(pthread_mutex_t *mutex){
+    if(pthread_mutex_lock(mutex)==EOWNERDEAD) rsfs_mutex_recover(mutex);
+}
+
+
+//------ segments ------
+
+//helper: wait (yielding) until *word is non-zero; return 0 if it is, or -1 after SHM_ATTACH_TRIES tries
+static int wait_for(int *word){
+    for(int i=0; i<SHM_ATTACH_TRIES; i++){
+        if(__atomic_load_n(word, __ATOMIC_ACQUIRE)) return 0;
+        sched_yield();
+    }
+    return -1;
+}
+
+//helper: the creator's side of RSFS_shm_open(): size the new segment fd, map it and initialize the instance
+static struct rsfs_shm *shm_create(int fd, const char *name){
+    if(ftruncate(fd, sizeof(struct rsfs_shm))!=0){
+        rsfs_error(errno, "[RSFS_shm_open] fails to size segment %s\n", name);
+        return NULL;
+    }
+    struct rsfs_shm *shm = mmap(NULL, sizeof(struct rsfs_shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shm==MAP_FAILED){
+        rsfs_error(errno, "[RSFS_shm_open] fails to map segment %s\n", name);
+        return NULL;
+    }
+
+    //the segment is zero-filled: only the header and the shared flag need setting before RSFS_init()
+    memcpy(shm->magic, SHM_MAGIC, 8);
+    shm->size = sizeof(struct rsfs_shm);
+    shm->creator = getpid();
+    shm->fs.shared = 1;
+
+    struct rsfs *prev = RSFS_use(&shm->fs);
+    int ret = RSFS_init();
+    RSFS_use(prev);
+    if(ret!=0){
+        munmap(shm, sizeof(struct rsfs_shm));
+        return NULL;
+    }
+
+    __atomic_store_n(&shm->ready, 1, __ATOMIC_RELEASE);
+    rsfs_log(LOG_DEBUG, "[RSFS_shm_open] created segment %s (%zu bytes)\n", name, sizeof(struct rsfs_shm));
+    return shm;
+}
+
+//helper: the other processes' side of RSFS_shm_open(): map the segment fd once the creator has sized it,
+//and wait until the creator has initialized the instance
+static struct rsfs_shm *shm_attach(int fd, const char *name){
+    struct stat st;
+    int i;
+    for(i=0; i<SHM_ATTACH_TRIES; i++){
+        if(fstat(fd, &st)==0 && st.st_size>=(off_t)sizeof(struct rsfs_shm)) break;
+        sched_yield();
+    }
+    if(i==SHM_ATTACH_TRIES){
+        rsfs_error(EINVAL, "[RSFS_shm_open] segment %s is not an RSFS image\n", name);
+        return NULL;
+    }
+
+    struct rsfs_shm *shm = mmap(NULL, sizeof(struct rsfs_shm), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(shm==MAP_FAILED){
+        rsfs_error(errno, "[RSFS_shm_open] fails to map segment %s\n", name);
+        return NULL;
+    }
+
+    if(wait_for(&shm->ready)!=0 || memcmp(shm->magic, SHM_MAGIC, 8)!=0 || shm->size!=sizeof(struct rsfs_shm)){
+        munmap(shm, sizeof(struct rsfs_shm));
+        rsfs_error(EINVAL, "[RSFS_shm_open] segment %s is not an RSFS image of this build\n", name);
+        return NULL;
+    }
+
+    //the implementations selected by RSFS_init() are per process
+    name_scan_init();
+    crc32c_init();
+    block_copy_init();
+
+    rsfs_log(LOG_DEBUG, "[RSFS_shm_open] attached to segment %s\n", name);
+    return shm;
+}
+
+//open the instance in the POSIX shared memory segment name (e.g. "/rsfs"): the first process creates and
+//initializes it, the others attach to it; every process reads and writes the same files, and an fd is valid in
+//all of them; use the instance with RSFS_use() or RSFS_fs_*()
+//return its handle, or NULL if the segment cannot be created or is not an RSFS image
+rsfs_t *RSFS_shm_open(const char *name){
+    struct rsfs_shm *shm;
+
+    int fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0600);
+    if(fd>=0){
+        shm = shm_create(fd, name);
+        if(shm==NULL) shm_unlink(name);
+    }else if(errno==EEXIST){
+        fd = shm_open(name, O_RDWR, 0);
+        if(fd<0){
+            rsfs_error(errno, "[RSFS_shm_open] fails to open segment %s\n", name);
+            return NULL;
+        }
+        shm = shm_attach(fd, name);
+    }else{
+        rsfs_error(errno, "[RSFS_shm_open] fails to create segment %s\n", name);
+        return NULL;
+    }
+
+    close(fd); //the mapping keeps the segment
+    return shm ? &shm->fs : NULL;
+}
+
+//unmap an instance opened by RSFS_shm_open(); in the creator, stop the background threads first
+//the files stay in the segment for the other processes, and for those opening it later
+//return 0 if succeed, or -1 if fs is not a shared instance
+int RSFS_shm_close(rsfs_t *fs){
+    if(fs==NULL || !fs->shared){
+        rsfs_error(EINVAL, "[RSFS_shm_close] not a shared instance\n");
+        return -1;
+    }
+    struct rsfs_shm *shm = (struct rsfs_shm *)((char *)fs - offsetof(struct rsfs_shm, fs));
+
+    struct rsfs *prev = RSFS_use(fs);
+    if(shm->creator==getpid()){
+        if(fs->scrub_running) RSFS_scrub_stop();
+        if(fs->defrag_running) RSFS_defrag_stop();
+        if(fs->cleaner_running) RSFS_cleaner_stop();
+    }
+    RSFS_use(prev==fs ? NULL : prev);
+
+    munmap(shm, sizeof(struct rsfs_shm));
+    return 0;
+}
+
+//remove the segment name; processes that have it open keep using it until they close it
+//return 0 if succeed, or -1 if there is no such segment
+int RSFS_shm_unlink(const char *name){
+    if(shm_unlink(name)!=0){
+        rsfs_error(errno, "[RSFS_shm_unlink] fails to remove segment %s\n", name);
+        return -1;
+    }
+    return 0;
+}
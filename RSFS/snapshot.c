@@ -0,0 +1,35 @@
+/*
+    snapshot table and its guarding mutex (fields of struct rsfs);
+    routines for snapshot management
+*/
+
+#include "def.h"
+
+//allocate an available snapshot slot and return its id;
+//return -1 if all slots are in use
+int allocate_snapshot(){
+    struct rsfs *fs = rsfs_current;
+
+    int snapshot_id=-1;
+
+    rsfs_mutex_lock(&fs->snapshots_mutex);
+    for(int i=0; i<NUM_SNAPSHOTS; i++){
+        if(fs->snapshots[i].used==0){
+            snapshot_id=i;
+            fs->snapshots[i].used=1;
+            fs->snapshots[i].num_files=0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->snapshots_mutex);
+
+    return snapshot_id;
+}
+
+//free a snapshot slot; its files must already have released their data blocks
+void free_snapshot(int snapshot_id){
+    struct rsfs *fs = rsfs_current;
+    rsfs_mutex_lock(&fs->snapshots_mutex);
+    fs->snapshots[snapshot_id].used=0;
+    pthread_mutex_unlock(&fs->snapshots_mutex);
+}
@@ -0,0 +1,154 @@
+/*
+    record side of the API tracer: a ring buffer of trace records filled by the
+    RSFS_* entry points and drained to a file by a background thread;
+    routines for starting, recording and stopping a trace
+*/
+
+#include "def.h"
+#include <time.h>
+#include <sched.h>
+
+
+//ring buffer of records; slot i holds record number seq-1 once seq is published
+struct trace_slot{
+    uint64_t seq; //0-empty, otherwise the record's number + 1
+    struct trace_record record;
+};
+static struct trace_slot trace_ring[TRACE_RING_SIZE];
+static uint64_t trace_head = 0; //next record number to hand out (atomic)
+static uint64_t trace_tail = 0; //next record number to write to the file (flusher thread only)
+
+int trace_enabled = 0; //1 while a trace is being recorded
+static uint64_t trace_t0; //time the trace started
+static FILE *trace_file = NULL;
+static pthread_t trace_flusher;
+static int trace_stopping = 0;
+static pthread_mutex_t trace_mutex = PTHREAD_MUTEX_INITIALIZER; //serializes start/stop
+
+static int trace_next_thread = 0; //next thread number to hand out (atomic)
+static __thread int trace_thread = -1; //this thread's number in the trace
+
+
+//helper: current time in nanoseconds
+static uint64_t trace_now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec*1000000000u + ts.tv_nsec;
+}
+
+//helper: write every published record to the file; return the number written
+static int trace_drain(){
+    int written = 0;
+    struct trace_slot *slot = &trace_ring[trace_tail % TRACE_RING_SIZE];
+
+    while(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) == trace_tail+1){
+        fwrite(&slot->record, sizeof(struct trace_record), 1, trace_file);
+        __atomic_store_n(&trace_tail, trace_tail+1, __ATOMIC_RELEASE);
+        slot = &trace_ring[trace_tail % TRACE_RING_SIZE];
+        written++;
+    }
+    return written;
+}
+
+//background thread: drain the ring until the trace is stopped
+static void *trace_flusher_main(void *arg){
+    (void)arg; //the trace is process-wide
+    struct timespec pause = {0, 1000000}; //1ms
+
+    while(!__atomic_load_n(&trace_stopping, __ATOMIC_ACQUIRE)){
+        if(trace_drain()==0) nanosleep(&pause, NULL);
+    }
+    trace_drain();
+    fflush(trace_file);
+    return NULL;
+}
+
+
+//start recording every traced RSFS_* call into the file at path
+//return 0 if succeed, or -1 if a trace is already running or the file cannot be created
+int RSFS_trace_start(const char *path){
+    pthread_mutex_lock(&trace_mutex);
+
+    if(trace_enabled){
+        pthread_mutex_unlock(&trace_mutex);
+        return -1;
+    }
+
+    trace_file = fopen(path, "wb");
+    if(trace_file==NULL){
+        pthread_mutex_unlock(&trace_mutex);
+        return -1;
+    }
+
+    struct trace_header header;
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(struct trace_record);
+    fwrite(&header, sizeof(header), 1, trace_file);
+
+    memset(trace_ring, 0, sizeof(trace_ring));
+    trace_head = trace_tail = 0;
+    trace_stopping = 0;
+    trace_t0 = trace_now();
+    pthread_create(&trace_flusher, NULL, trace_flusher_main, NULL);
+    __atomic_store_n(&trace_enabled, 1, __ATOMIC_RELEASE);
+
+    pthread_mutex_unlock(&trace_mutex);
+    return 0;
+}
+
+//stop recording, write out the pending records and close the trace file
+//return 0 if succeed, or -1 if no trace is running
+int RSFS_trace_stop(){
+    pthread_mutex_lock(&trace_mutex);
+
+    if(!trace_enabled){
+        pthread_mutex_unlock(&trace_mutex);
+        return -1;
+    }
+
+    __atomic_store_n(&trace_enabled, 0, __ATOMIC_RELEASE);
+
+    //calls already inside trace_record() finish publishing before the last drain
+    while(__atomic_load_n(&trace_head, __ATOMIC_ACQUIRE) != __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE)){
+        sched_yield();
+    }
+    __atomic_store_n(&trace_stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(trace_flusher, NULL);
+
+    fclose(trace_file);
+    trace_file = NULL;
+
+    pthread_mutex_unlock(&trace_mutex);
+    return 0;
+}
+
+
+//called when a traced call starts: its start time while tracing, or 0
+uint64_t trace_start(){
+    return __atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE) ? trace_now() : 0;
+}
+
+//record one finished call; start comes from trace_start(), and the call is skipped if it is 0
+void trace_record(int op, uint64_t start, char file_name, int fd, int arg, int result){
+    if(start==0 || !__atomic_load_n(&trace_enabled, __ATOMIC_ACQUIRE)) return;
+
+    uint64_t end = trace_now();
+    if(trace_thread<0) trace_thread = __atomic_fetch_add(&trace_next_thread, 1, __ATOMIC_RELAXED);
+
+    //reserve a slot; when the ring is full wait for the flusher rather than lose the record
+    uint64_t seq = __atomic_fetch_add(&trace_head, 1, __ATOMIC_ACQ_REL);
+    while(seq - __atomic_load_n(&trace_tail, __ATOMIC_ACQUIRE) >= TRACE_RING_SIZE){
+        sched_yield();
+    }
+
+    struct trace_slot *slot = &trace_ring[seq % TRACE_RING_SIZE];
+    slot->record.timestamp_ns = start - trace_t0;
+    slot->record.duration_ns = (end-start > UINT32_MAX) ? UINT32_MAX : end-start;
+    slot->record.thread = trace_thread;
+    slot->record.op = op;
+    slot->record.file_name = file_name;
+    slot->record.fd = fd;
+    slot->record.arg = arg;
+    slot->record.result = result;
+    __atomic_store_n(&slot->seq, seq+1, __ATOMIC_RELEASE);
+}